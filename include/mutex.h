@@ -0,0 +1,35 @@
+#ifndef _MUTEX_H_
+#define _MUTEX_H_
+
+/*
+ * OS/161 user level mutexes and condition variables.
+ *
+ * They live in ordinary memory, so processes share them by putting them in memory they share. A
+ * shared memory segment (shmget) works for any processes. A shared file mapping (mmap) only works
+ * for processes that inherited the mapping through fork, since each mmap of the file gets pages
+ * of its own. Locking a free mutex and
+ * unlocking one nobody waits for don't enter the kernel. Processes that have to wait sleep in
+ * futex_wait() instead of spinning.
+ *
+ * Initialize them with mutex_init() and cond_init(), or to all zeros.
+ */
+
+struct mutex {
+	volatile int m_state;	/* 0 unlocked, 1 locked, 2 locked and maybe waited for */
+};
+
+struct cond {
+	volatile int c_seq;	/* bumped by every signal, waiters sleep on it */
+};
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+int mutex_trylock(struct mutex *m);	/* returns 0 if it got the mutex, -1 if not */
+void mutex_unlock(struct mutex *m);
+
+void cond_init(struct cond *c);
+void cond_wait(struct cond *c, struct mutex *m);
+void cond_signal(struct cond *c);
+void cond_broadcast(struct cond *c);
+
+#endif /* _MUTEX_H_ */
@@ -121,6 +121,18 @@ int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 unsigned int sleep(unsigned int seconds);
 int __getcwd(char *buf, size_t buflen);
+pid_t __spawn(const char *prog, char *const *args);
+void *__mmap(const char *path, off_t offset, size_t len, int flags);
+int munmap(void *addr, size_t len);
+int shmget(int key, size_t size, int flags);
+void *shmat(int shmid, const void *addr, int flags);
+int shmdt(const void *addr);
+int shmctl(int shmid, int cmd);
+int pagesend(pid_t pid, void *addr, size_t len);
+int pagerecv(void *addr, size_t len);
+int futex_wait(volatile int *addr, int val);
+int futex_wake(volatile int *addr, int n);
+int __ras(void *start, void *end);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -130,5 +142,8 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+pid_t spawn(const char *prog, char *const *args);	/* calls __spawn */
+void *mmap(void *addr, size_t len, int prot, int flags,
+	   const char *path, off_t offset);		/* calls __mmap */
 
 #endif /* _UNISTD_H_ */
@@ -24,12 +24,20 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   TLB_SetEntryHi: load ENTRYHI without touching the TLB. The PID field
+ *        of ENTRYHI is the current ASID; the other functions above leave
+ *        it unchanged.
  */
 
 void TLB_Random(u_int32_t entryhi, u_int32_t entrylo);
 void TLB_Write(u_int32_t entryhi, u_int32_t entrylo, u_int32_t index);
 void TLB_Read(u_int32_t *entryhi, u_int32_t *entrylo, u_int32_t index);
 int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
+void TLB_SetEntryHi(u_int32_t entryhi);
+
+void TLB_SetAsid(u_int32_t asid);
+u_int32_t TLB_GetAsid();
 
 /* Read and write to ASID in TLBHI */
 u_int32_t TLB_ReadAsid(u_int32_t index);
@@ -50,11 +58,35 @@ void TLB_Flush();
 
 /* TLB Replace. Implements our own replacement policy. Returns the index that we wrote to */
 int TLB_Replace(u_int32_t entryhi, u_int32_t entrylo);
+
+/* 
+ * Targeted shootdown. The Paddr variants match the physical page in every address space,
+ * ProbeVaddr only looks at the current one, and InvalidateVaddrAsid at the one with the ASID. 
+ */
 int TLB_FindEntry(u_int32_t entrylo);
 void TLB_Invalidate(int idx);
+int TLB_ProbeVaddr(u_int32_t vaddr);
+void TLB_InvalidateVaddr(u_int32_t vaddr);
+void TLB_InvalidateVaddrAsid(u_int32_t vaddr, u_int32_t asid);
+int TLB_InvalidatePaddr(paddr_t paddr);
+void TLB_WriteProtectPaddr(paddr_t paddr);
+void TLB_WriteProtectAsid(u_int32_t asid);
+void TLB_InvalidateAsid(u_int32_t asid);
 
 void TLB_Stat();
 
+/*
+ * Page table the UTLB miss handler in exception.S refills the TLB from. It is the page table of
+ * the current address space, or NULL to send every miss to vm_fault. The handler hardcodes the
+ * layout of the page table, see pagetable.h.
+ */
+struct pagetable;
+
+void TLB_SetPagetable(struct pagetable *pt);
+struct pagetable *TLB_GetPagetable();
+
+extern struct pagetable *tlb_refill_pt;
+
 /*
  * TLB entry fields.
  *
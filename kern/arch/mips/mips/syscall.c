@@ -115,12 +115,86 @@ mips_syscall(struct trapframe *tf)
 			err = sys_execv( (const char *)tf->tf_a0, (char **)tf->tf_a1, &retval );
 		break;
 
+		case SYS___spawn:
+			err = sys___spawn( (const char *)tf->tf_a0, (char **)tf->tf_a1, &retval );
+		break;
+
 		case SYS_sbrk:
 		#if !OPT_DUMBVM
 			err = sys_sbrk( (intptr_t)tf->tf_a0, &retval );
 		#endif
 		break;
 
+		/* System calls related to memory mappings */
+		case SYS___mmap:
+		#if !OPT_DUMBVM
+			err = sys___mmap( (const char *)tf->tf_a0, (off_t)tf->tf_a1, (size_t)tf->tf_a2, (int)tf->tf_a3, &retval );
+		#endif
+		break;
+
+		case SYS_munmap:
+		#if !OPT_DUMBVM
+			err = sys_munmap( (vaddr_t)tf->tf_a0, (size_t)tf->tf_a1 );
+		#endif
+		break;
+
+		/* System calls related to shared memory */
+		case SYS_shmget:
+		#if !OPT_DUMBVM
+			err = sys_shmget( (int)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2, &retval );
+		#endif
+		break;
+
+		case SYS_shmat:
+		#if !OPT_DUMBVM
+			err = sys_shmat( (int)tf->tf_a0, (vaddr_t)tf->tf_a1, (int)tf->tf_a2, &retval );
+		#endif
+		break;
+
+		case SYS_shmdt:
+		#if !OPT_DUMBVM
+			err = sys_shmdt( (vaddr_t)tf->tf_a0 );
+		#endif
+		break;
+
+		case SYS_shmctl:
+		#if !OPT_DUMBVM
+			err = sys_shmctl( (int)tf->tf_a0, (int)tf->tf_a1 );
+		#endif
+		break;
+
+		/* System calls that move pages between processes */
+		case SYS_pagesend:
+		#if !OPT_DUMBVM
+			err = sys_pagesend( (pid_t)tf->tf_a0, (vaddr_t)tf->tf_a1, (size_t)tf->tf_a2, &retval );
+		#endif
+		break;
+
+		case SYS_pagerecv:
+		#if !OPT_DUMBVM
+			err = sys_pagerecv( (vaddr_t)tf->tf_a0, (size_t)tf->tf_a1, &retval );
+		#endif
+		break;
+
+		/* System calls for user level synchronization */
+		case SYS_futex_wait:
+		#if !OPT_DUMBVM
+			err = sys_futex_wait( (vaddr_t)tf->tf_a0, (int)tf->tf_a1 );
+		#endif
+		break;
+
+		case SYS_futex_wake:
+		#if !OPT_DUMBVM
+			err = sys_futex_wake( (vaddr_t)tf->tf_a0, (int)tf->tf_a1, &retval );
+		#endif
+		break;
+
+		case SYS___ras:
+		#if !OPT_DUMBVM
+			err = sys___ras( (vaddr_t)tf->tf_a0, (vaddr_t)tf->tf_a1 );
+		#endif
+		break;
+
 	    default:
 			kprintf("Unknown syscall %d\n", callno);
 			err = ENOSYS;
@@ -11,6 +11,48 @@
  * To protect against corrupting the TLB, all operations are atomic.
  */
 
+/* 
+ * ASID of the running address space. Entries written by TLB_Replace are tagged with it,
+ * and the hardware only matches entries with this tag (it lives in c0_entryhi).
+ */
+static u_int32_t tlb_curasid = 0;
+
+/* Switch the current ASID */
+void TLB_SetAsid(u_int32_t asid)
+{
+    int spl = splhigh();
+
+    assert(asid < NUM_ASID);
+    tlb_curasid = asid;
+    TLB_SetEntryHi(asid << 6);
+
+    splx(spl);
+}
+
+u_int32_t TLB_GetAsid()
+{
+    return tlb_curasid;
+}
+
+/*
+ * Page table of the current address space, walked by the UTLB miss handler in exception.S.
+ * A miss it can't serve from here goes to vm_fault as usual. Hits never reach vm_fault, see
+ * coremap_page_watch() for how the VM sees references anyway.
+ */
+struct pagetable *tlb_refill_pt = NULL;
+
+void TLB_SetPagetable(struct pagetable *pt)
+{
+    int spl = splhigh();
+    tlb_refill_pt = pt;
+    splx(spl);
+}
+
+struct pagetable *TLB_GetPagetable()
+{
+    return tlb_refill_pt;
+}
+
 /* Read and write to ASID field in TLBHI */
 u_int32_t TLB_ReadAsid(u_int32_t index) 
 {
@@ -123,6 +165,8 @@ void TLB_Flush()
 /*
  * TLB_Replace()
  * Implements our own replacement policy for TLB.
+ * The entry is tagged with the current ASID. If the page already has an entry for this
+ * ASID we overwrite it, since duplicate entries are fatal.
  */
 int TLB_Replace(u_int32_t entryhi, u_int32_t entrylo)
 {
@@ -131,6 +175,16 @@ int TLB_Replace(u_int32_t entryhi, u_int32_t entrylo)
 
     spl = splhigh();
 
+    entryhi = (entryhi & TLBHI_VPAGE) | (tlb_curasid << 6);
+
+    /* Reuse an existing entry for this page */
+    idx = TLB_Probe(entryhi, 0);
+    if(idx >= 0) {
+        TLB_Write(entryhi, entrylo, idx);
+        splx(spl);
+        return idx;
+    }
+
     /* Replace invalid entries first */
     for(idx=0; idx<NUM_TLB; idx++) {
         TLB_Read(&ehi, &elo, idx);
@@ -151,6 +205,10 @@ int TLB_Replace(u_int32_t entryhi, u_int32_t entrylo)
     return idx;
 }
 
+/*
+ * TLB_FindEntry()
+ * Index of the first valid entry mapping the physical page, in any address space. -1 if there is none
+ */
 int TLB_FindEntry(u_int32_t entrylo)
 {
     int spl = splhigh();
@@ -160,24 +218,163 @@ int TLB_FindEntry(u_int32_t entrylo)
 
     for(idx=0; idx<NUM_TLB; idx++) {
         TLB_Read(&ehi, &elo, idx);
-		if(entrylo == (elo & TLBLO_PPAGE) ) {
+        if( (elo & TLBLO_VALID) && (entrylo & TLBLO_PPAGE) == (elo & TLBLO_PPAGE) ) {
+            splx(spl);
             return idx;
         }
     }
-    return -1;
 
     splx(spl);
+    return -1;
 }
 
 void TLB_Invalidate(int idx)
 {
     int spl = splhigh();
+    u_int32_t ehi, elo;
 
+    TLB_Read(&ehi, &elo, idx);
 	TLB_Write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
     
     splx(spl);
 }
 
+/*
+ * TLB_ProbeVaddr()
+ * Index of the entry mapping vaddr in the current address space, -1 if there is none
+ */
+int TLB_ProbeVaddr(u_int32_t vaddr)
+{
+    int spl = splhigh();
+    int idx;
+
+    idx = TLB_Probe((vaddr & TLBHI_VPAGE) | (tlb_curasid << 6), 0);
+
+    splx(spl);
+    return idx;
+}
+
+/*
+ * TLB_InvalidateVaddr()
+ * Shoot down the mapping of vaddr in the current address space
+ */
+void TLB_InvalidateVaddr(u_int32_t vaddr)
+{
+    int spl = splhigh();
+    int idx;
+
+    idx = TLB_Probe((vaddr & TLBHI_VPAGE) | (tlb_curasid << 6), 0);
+    if(idx >= 0) {
+        TLB_Write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+    }
+
+    splx(spl);
+}
+
+/*
+ * TLB_InvalidateVaddrAsid()
+ * Shoot down the mapping of vaddr in the address space tagged with asid, which need not be
+ * the current one. The probe matches on the ASID we give it.
+ */
+void TLB_InvalidateVaddrAsid(u_int32_t vaddr, u_int32_t asid)
+{
+    int spl = splhigh();
+    int idx;
+
+    assert(asid < NUM_ASID);
+
+    idx = TLB_Probe((vaddr & TLBHI_VPAGE) | (asid << 6), 0);
+    if(idx >= 0) {
+        TLB_Write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+    }
+
+    splx(spl);
+}
+
+/*
+ * TLB_InvalidatePaddr()
+ * Shoot down every entry mapping the physical page. A shared page may be mapped by several
+ * address spaces, so this looks at all ASIDs. Returns the number of entries invalidated.
+ */
+int TLB_InvalidatePaddr(paddr_t paddr)
+{
+    int spl = splhigh();
+    int i, count = 0;
+    u_int32_t ehi, elo;
+
+    for(i=0; i<NUM_TLB; i++) {
+        TLB_Read(&ehi, &elo, i);
+        if( (elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) == (paddr & TLBLO_PPAGE) ) {
+            TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            count++;
+        }
+    }
+
+    splx(spl);
+    return count;
+}
+
+/*
+ * TLB_WriteProtectPaddr()
+ * Clear the dirty bit of every entry mapping the physical page. The mappings stay valid for
+ * reads, the next write to the page takes a readonly fault.
+ */
+void TLB_WriteProtectPaddr(paddr_t paddr)
+{
+    int spl = splhigh();
+    int i;
+    u_int32_t ehi, elo;
+
+    for(i=0; i<NUM_TLB; i++) {
+        TLB_Read(&ehi, &elo, i);
+        if( (elo & TLBLO_VALID) && (elo & TLBLO_DIRTY) && (elo & TLBLO_PPAGE) == (paddr & TLBLO_PPAGE) ) {
+            TLB_Write(ehi, elo & ~TLBLO_DIRTY, i);
+        }
+    }
+
+    splx(spl);
+}
+
+/*
+ * TLB_WriteProtectAsid()
+ * Clear the dirty bit of every entry tagged with asid.
+ */
+void TLB_WriteProtectAsid(u_int32_t asid)
+{
+    int spl = splhigh();
+    int i;
+    u_int32_t ehi, elo;
+
+    for(i=0; i<NUM_TLB; i++) {
+        TLB_Read(&ehi, &elo, i);
+        if( (elo & TLBLO_VALID) && (elo & TLBLO_DIRTY) && ((ehi & TLBHI_PID) >> 6) == asid ) {
+            TLB_Write(ehi, elo & ~TLBLO_DIRTY, i);
+        }
+    }
+
+    splx(spl);
+}
+
+/*
+ * TLB_InvalidateAsid()
+ * Invalidate every entry tagged with asid. Used when an address space goes away.
+ */
+void TLB_InvalidateAsid(u_int32_t asid)
+{
+    int spl = splhigh();
+    int i;
+    u_int32_t ehi, elo;
+
+    for(i=0; i<NUM_TLB; i++) {
+        TLB_Read(&ehi, &elo, i);
+        if( (elo & TLBLO_VALID) && ((ehi & TLBHI_PID) >> 6) == asid ) {
+            TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+
+    splx(spl);
+}
+
 
 /*
  * TLB_Stat()
@@ -5,6 +5,7 @@
 #include <machine/pcb.h>
 #include <machine/spl.h>
 #include <vm.h>
+#include <addrspace.h>
 #include <thread.h>
 #include <curthread.h>
 #include <syscall.h>
@@ -201,6 +202,20 @@ mips_trap(struct trapframe *tf)
 	/* Make sure interrupts are off */
 	splhigh();
 
+#if !OPT_DUMBVM
+	/*
+	 * Going back to user mode inside the restartable atomic sequence. Another process may have
+	 * run since it started, so it starts over. It ends with its only store, so a store that
+	 * faulted has not happened yet either.
+	 */
+	if (!iskern && curthread != NULL && curthread->t_vmspace != NULL) {
+		struct addrspace *as = curthread->t_vmspace;
+		if (tf->tf_epc >= as->as_ras_start && tf->tf_epc < as->as_ras_end) {
+			tf->tf_epc = as->as_ras_start;
+		}
+	}
+#endif
+
 	/*
 	 * Restore previous context's curspl value.
 	 *
@@ -673,6 +673,18 @@ emufs_fsync(struct vnode *v)
 	return 0;
 }
 
+/*
+ * VOP_MMAP
+ * Files can be mapped, the VM system reads and writes the pages with VOP_READ and VOP_WRITE.
+ */
+static
+int
+emufs_mmap(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
 /*
  * VOP_TRUNCATE
  */
@@ -853,7 +865,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_file_gettype,
 	emufs_tryseek,
 	emufs_fsync,
-	UNIMP,   /* mmap */
+	emufs_mmap,
 	emufs_truncate,
 	NOTDIR,  /* namefile */
 
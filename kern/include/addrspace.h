@@ -16,24 +16,10 @@
 
 
 struct vnode;
+struct lock;
+struct vm_region;
 
-/*
- * Definition of as_region
- * 
- * 4 regions in the user address space: code, data, heap, and stack
- * Each region has its own start address and size as well as a set of permissions
- * Permission types: executable, writable, and readable.
- * We keep new and old flags for now for some reason. We can get rid of them later if needed.
- */
-struct as_region {
-	vaddr_t vbase;
-	size_t npages;
-	permissions_t permissions;
-	/* Will need a lot more information for ondemand paging */
-	struct vnode *file;
-	struct uio uio;
-};
-/* define the region */
+/* print the regions of an addrspace and the pages mapped in them */
 void region_dump(struct addrspace *as) ;
 
 /* Address space ID typdef */
@@ -48,6 +34,8 @@ typedef u_int32_t asid_t;
  * 		(2) Data segment
  * 		(3) Heap
  * 		(4) Stack
+ * Each of these is a region, see region.h. A region knows its permissions and where its pages come
+ * from, so adding another kind of mapping is a matter of adding a region.
  * 
  * There are a few ways in that our VM system is different from DUMBVM
  * 		(1) To support user level malloc(), we need allocate space for the heap
@@ -68,13 +56,18 @@ struct addrspace {
 #else
 	/* If gypsies moved into the VM business */
 	pagetable_t as_pagetable;	/* page table */
-	struct as_region *as_code;	/* code segment */
-	struct as_region *as_data;	/* data segment */
-	vaddr_t as_heapstart;		/* start of heap */
-	vaddr_t as_heapend;			/* end of heap */
-	vaddr_t as_stackptr;		/* stackptr */
+	struct vm_region **as_regions;	/* regions sorted by address */
+	int as_nregions;			/* regions in use */
+	int as_maxregions;			/* size of as_regions */
+	struct vm_region *as_heap;	/* heap region, moved by sbrk */
+	vaddr_t as_heapend;			/* end of heap. The heap region ends on the page boundary after it */
+	u_int32_t as_commit;		/* heap pages charged with swap_commit() */
+	size_t as_heaplimit;		/* most bytes the heap may grow to, see sys_sbrk */
 	asid_t as_asid;				/* addrspace tags for the TLB */
-	int as_asid_set;
+	u_int32_t as_asid_gen;		/* generation as_asid belongs to, see as_activate */
+	struct lock *as_lock;		/* serializes faults, sbrk and fork on this addrspace */
+	vaddr_t as_ras_start;		/* restartable atomic sequence of the program, see sys___ras */
+	vaddr_t as_ras_end;
 #endif
 };
 
@@ -82,8 +75,7 @@ struct addrspace {
 /*
  * Functions in addrspace.c:
  *    
- *    as_bitmap_bootstrap - initializes the bitmap for ASIDs and 
- * 							  the mutex for the structure
+ *    as_asid_bootstrap - initializes ASID allocation
  *    as_create - create a new empty address space. You need to make 
  *                sure this gets called in all the right places. You
  *                may find you want to change the argument list. May
@@ -113,11 +105,25 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_heap - set up the heap region, right after the highest
+ *                region defined so far.
+ *
+ *    as_syncregion - write the dirty pages of a shared mapping back to
+ *                its file.
+ *
+ *    as_freerange - free the pages mapped in a range of addresses.
+ *
+ *    as_removeregion - free the pages of a region and remove it.
+ *
+ *    as_invalidatevaddr - shoot down the TLB entry of a page, in any
+ *                address space.
  */
-void              as_bitmap_bootstrap(void);
+void              as_asid_bootstrap(void);
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(struct addrspace *);
+void              as_invalidatevaddr(struct addrspace *as, vaddr_t vaddr);
 void              as_destroy(struct addrspace *);
 
 int               as_define_region(struct addrspace *as, 
@@ -129,12 +135,10 @@ int               as_define_region(struct addrspace *as,
 int		  		  as_prepare_load(struct addrspace *as);
 int		  		  as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
-void 			  as_define_heap(struct addrspace *as);
-
-int is_vaddrcode(struct addrspace *as, vaddr_t vaddr);
-int is_vaddrdata(struct addrspace *as, vaddr_t vaddr);
-int is_vaddrheap(struct addrspace *as, vaddr_t vaddr);
-int is_vaddrstack(struct addrspace *as, vaddr_t vaddr);
+int 			  as_define_heap(struct addrspace *as);
+int               as_syncregion(struct addrspace *as, struct vm_region *region);
+int               as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end);
+int               as_removeregion(struct addrspace *as, struct vm_region *region);
 
 
 /*
@@ -145,12 +149,14 @@ int is_vaddrstack(struct addrspace *as, vaddr_t vaddr);
  *    load_elf_od - load an ELF user program executable on demand.
  * 					This means we don't allocate all the pages at once, only
  * 					on page faults
+ *    load_pages_od - read npages pages of a file backed region, starting at
+ * 					page vaddr, into a kernel buffer. Used by the page fault handler.
  */
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
 int load_elf_od(struct vnode *v, vaddr_t *entrypoint);
 int load_segment_od(struct vnode *v, off_t offset, vaddr_t vaddr, size_t memsize, size_t filesize, int is_executable);
-int load_page_od(struct vnode *v, struct uio u, off_t p_offset);
+int load_pages_od(struct vm_region *region, vaddr_t vaddr, int npages, char *buf);
 
 #endif /* _ADDRSPACE_H_ */
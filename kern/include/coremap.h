@@ -19,6 +19,7 @@
 #define _COREMAP_H_
 
 struct pte;
+struct vnode;
 
 /* 
  * ppagestate_t, physical page state type
@@ -26,11 +27,17 @@ struct pte;
  * S_FREE: Page is not allocated    
  * S_USER: User allocated page
  * S_KERN: Direct mapped kernel pages
+ * S_BUSY: User page with I/O in flight (page in, page out) or not mapped yet. Hidden from the 
+ *         replacement policy. Threads that need the page wait for it with coremap_busy_wait()
+ * S_ZERO: Free page that was zeroed by the idle loop. It sits in the zero pool, off the buddy
+ *         free lists, until an anonymous fault takes it
  */
 typedef enum {
     S_FREE,
     S_USER,
     S_KERN,
+    S_BUSY,
+    S_ZERO,
 } ppagestate_t;
 
 
@@ -49,11 +56,64 @@ struct coremap_entry {
     /* age table entry associated with this coremap entry. NULL if this is a kernel entry */
     struct pte *pt_entry;
 
-    /* referenced bit used for lru clock page evict algo */
+    /* page table leaves only: number of page tables sharing this leaf, see pt_unshare() */
+    int pt_refs;
+
+    /* referenced bit, set when the page is referenced and cleared by the replacement policy */
     int referenced;
+
+    /* 
+     * Virtual address and address space the page was last mapped at. Only used to order
+     * clustered page outs, the owner is never dereferenced.
+     */
+    vaddr_t vaddr;
+    const void *owner;
+
+    /* set if the page was brought in by swap readahead and has not been referenced yet */
+    int readahead;
+
+    /* 
+     * Pages of shared file mappings only: where the page is written back to. The file is not
+     * referenced, the region the page is mapped in holds a reference for as long as the page exists.
+     */
+    struct vnode *file;
+    off_t fileoff;
+    size_t filelen;
+
+    /* Replacement policy bookkeeping, see replacement.h */
+    u_int32_t rp_age;
+    u_int32_t rp_lastref;
+    int rp_queue;
+    int rp_next;
+    int rp_prev;
+    int rp_seen;
+
+    /* 
+     * Buddy allocator bookkeeping. Only meaningful for the first page of a free block:
+     * buddy_order is the order of the free block (-1 if this page does not head a free block),
+     * buddy_next/buddy_prev link the block into the free list of that order (-1 terminates).
+     * Pages in the zero pool are linked through buddy_next/buddy_prev as well.
+     */
+    int buddy_order;
+    int buddy_next;
+    int buddy_prev;
 };
 
 
+/*
+ * Buddy allocator parameters.
+ * Free physical pages are kept in blocks of 2^order pages, for order 0 to BUDDY_MAX_ORDER.
+ * Blocks are aligned relative to the first available page, not to physical address 0.
+ */
+#define BUDDY_MAX_ORDER 10
+
+/*
+ * Most pages the idle loop keeps zeroed. Pool pages count as free memory, and the idle loop only
+ * adds to the pool while more than PAGEOUT_HIGH_WATERMARK pages are free.
+ */
+#define ZEROPOOL_MAX 32
+
+
 /*
  * Functions that provide abstraction to the coremap structure
  * Read coremap.c for more information on how each function is implemented
@@ -61,22 +121,66 @@ struct coremap_entry {
 
 extern struct coremap_entry *coremap;
 
+/* Range of pages that can be allocated, first_avail_ppage up to but not including last_avail_ppage */
+extern int first_avail_ppage;
+extern int last_avail_ppage;
+
 /* Initialize coremap structure */
 void    coremap_bootstrap();
 
-/* Allocates a physical page if available */
+/* Allocates a physical page if available. User pages start out S_BUSY, see coremap_busy_unmark() */
 paddr_t get_ppages(int npages, int is_kernel, struct pte *pt_entry);
 
 /* Deallocate a physical page */
 void    free_ppages(paddr_t paddr);
 
+/* Number of free physical pages, including the zero pool */
+int     coremap_freecount();
+
+/* 
+ * Zero pool. coremap_zero_idle() zeroes one free page for the pool, it is called by the scheduler
+ * when there is nothing to run. coremap_zero_get() takes a busy, zeroed user page out of the pool,
+ * or returns 0 if the pool is empty. coremap_zero_count() is the number of pages in the pool.
+ */
+int     coremap_zero_idle();
+paddr_t coremap_zero_get(struct pte *pt_entry);
+int     coremap_zero_count();
+
 /* Debugging */
 void    coremap_stat();
 
 /* Functions to help with swapping */
 struct pte *coremap_swap_pageout();
+struct pte *coremap_swap_nextdirty();
 int         coremap_swap_createspace(int npages);
 
-void coremap_lruclock_update(paddr_t ppageaddr);
+/* Let the replacement policy know that a user page was referenced at vaddr in the current address space */
+void coremap_page_referenced(paddr_t ppageaddr, vaddr_t vaddr);
+
+/* 
+ * Make the next reference to a user page fault, so coremap_page_referenced() sees it. Shoots down
+ * its TLB entries and keeps the UTLB miss handler from refilling them from the page table.
+ */
+void coremap_page_watch(paddr_t ppageaddr);
+
+/* The page table entry of a user page moved, see pt_unshare() */
+void coremap_set_ptentry(paddr_t ppageaddr, struct pte *pt_entry);
+
+/* A busy user page belongs to the len bytes at offset in v, see swap_pageclean() */
+void coremap_set_file(paddr_t ppageaddr, struct vnode *v, off_t offset, size_t len);
+
+/* Mark a user page as brought in by readahead, so we can tell whether the readahead paid off */
+void coremap_readahead_mark(paddr_t ppageaddr);
+
+/* 
+ * Per page busy bits. A busy page is hidden from the replacement policy and the pageout daemon,
+ * and nobody but the thread that marked it may change its page table entry or contents.
+ * coremap_busy_wait() returns 1 if it had to sleep, in which case the caller has to look the 
+ * page up again since it may have been evicted or freed in the meantime.
+ */
+void coremap_busy_mark(paddr_t ppageaddr);
+void coremap_busy_unmark(paddr_t ppageaddr);
+int  coremap_busy_wait(paddr_t ppageaddr);
+int  coremap_is_busy(paddr_t ppageaddr);
 
 #endif /* _COREMAP_H_ */
@@ -0,0 +1,36 @@
+/*
+ * Futexes: sleeping on a word of user memory.
+ *
+ * futex_wait() puts the caller to sleep if a user word still holds the value it expects, and
+ * futex_wake() wakes the processes sleeping on a word. User level locks (see mutex.h in libc) only
+ * come in here when they have to wait, and don't spin away their time slice.
+ *
+ * Waiters are keyed by the frame holding the word plus its offset, not by the virtual address. So
+ * processes that map the same frame at different addresses (shared memory segments, shared file
+ * mappings inherited through fork, pages still shared copy on write after fork) meet on the same
+ * key. Separate mmaps of a file get frames of their own and don't meet, unrelated processes have
+ * to use shmget.
+ *
+ * A frame that goes away (evicted or freed) takes its key along, so everybody waiting in it is
+ * woken. That is a spurious wakeup as far as the waiter knows, it looks at the
+ * word again and waits on the page's new frame if it has to.
+ *
+ * All of these run with interrupts off.
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/* Number of hash chains. All waiters in a frame are on the same chain */
+#define FUTEX_BUCKETS 32
+
+/* Sleep if the word at uaddr holds val. Returns EAGAIN if it doesn't */
+int futex_wait(vaddr_t uaddr, int val);
+
+/* Wake up to n processes sleeping on the word at uaddr. Returns the number woken in woken */
+int futex_wake(vaddr_t uaddr, int n, int *woken);
+
+/* The frame at paddr is going away, wake everyone waiting in it */
+void futex_pagegone(paddr_t paddr);
+
+#endif /* _FUTEX_H_ */
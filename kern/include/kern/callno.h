@@ -41,6 +41,18 @@
 #define SYS_stat         30
 #define SYS_lstat        31
 #define SYS_sleep        32
+#define SYS___spawn      33
+#define SYS___mmap       34
+#define SYS_munmap       35
+#define SYS_shmget       36
+#define SYS_shmat        37
+#define SYS_shmdt        38
+#define SYS_pagesend     39
+#define SYS_pagerecv     40
+#define SYS_futex_wait   41
+#define SYS_futex_wake   42
+#define SYS___ras        43
+#define SYS_shmctl       44
 /*CALLEND*/
 
 
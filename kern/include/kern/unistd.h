@@ -34,6 +34,24 @@
 #define SEEK_CUR      1      /* Seek relative to current position in file */
 #define SEEK_END      2      /* Seek relative to end of file */
 
+/* Codes for mmap: or one of MAP_SHARED and MAP_PRIVATE into the PROT_ bits */
+#define PROT_NONE     0      /* Pages may not be accessed */
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+#define MAP_SHARED    0x10   /* Writes go to the file and are seen by everyone mapping it */
+#define MAP_PRIVATE   0x20   /* Writes are private to the process */
+#define MAP_FAILED    ((void *)-1)   /* Returned by mmap on error */
+
+/* Codes for shmget and shmat */
+#define IPC_PRIVATE   0      /* Key of a new segment nobody else can look up */
+#define IPC_CREAT     0x200  /* Create the segment if it does not exist */
+#define IPC_EXCL      0x400  /* With IPC_CREAT, fail if the segment exists */
+#define SHM_RDONLY    0x1000 /* Attach the segment read only */
+
+/* Codes for shmctl */
+#define IPC_RMID      0      /* Remove the segment once nobody has it attached */
+
 /* The codes for ioctl are in kern/ioctl.h */
 /* The codes for stat/fstat/lstat are in kern/stat.h */
 
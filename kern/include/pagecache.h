@@ -0,0 +1,52 @@
+/*
+ * Page cache of read only file pages.
+ *
+ * Every process running the same program would otherwise read its own copy of every text page.
+ * Instead, pages of read only program segments (VR_IMAGE regions) that lie entirely within the file
+ * go through a cache keyed by (vnode, file offset). The first process to fault a page loads it into
+ * a shared entry (see pagetable.h) and puts the entry into the cache. Everyone after it maps the
+ * same entry, and the same frame, without any I/O.
+ *
+ * mmap()ed files are left out. Nothing updates a cached page when a shared mapping writes its file
+ * back, so their cached pages could go stale.
+ *
+ * The cache holds a share of its entries, like the kernel does with the zero page, and a reference
+ * to the vnode of each. A page nobody maps any more stays cached until it is evicted, so running a
+ * program again finds its text still in memory. Evicting a page that processes still map drops it
+ * like any other file page, and the next fault reads it back into the cached entry. Evicting a
+ * page that only the cache holds removes it from the cache for good.
+ *
+ * All of these run with interrupts off.
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+struct pte;
+struct vnode;
+
+/* Number of hash chains */
+#define PAGECACHE_BUCKETS 64
+
+/* 
+ * A new shared entry for a page that may go into the cache. It is an ordinary shared entry until
+ * pagecache_insert(), and can be freed with pte_destroy() until then. Returns NULL if out of memory.
+ */
+struct pte *pagecache_entry_create(void);
+
+/* The cached entry for the page at offset in v, or NULL */
+struct pte *pagecache_lookup(struct vnode *v, off_t offset);
+
+/*
+ * Put a loaded entry into the cache. The caller's share of the entry becomes a share on top of
+ * the cache's. Returns EEXIST if somebody cached the page first, the entry stays the caller's then.
+ */
+int pagecache_insert(struct vnode *v, off_t offset, struct pte *entry);
+
+/* Remove an entry that has neither sharers nor a frame from the cache and free it */
+void pagecache_release(struct pte *entry);
+
+/* Number of pages in the cache */
+int pagecache_count(void);
+
+#endif /* _PAGECACHE_H_ */
@@ -12,7 +12,6 @@
 
 #include <permissions.h>
 #include <machine/vm.h>
-#include "opt-twolevelpagetable.h"
 
 
 
@@ -25,11 +24,16 @@
 /* 
  * The swap state of page
  *
- * NONE:    Page exists nowhere 
+ * NONE:    Page exists nowhere, or only in its file if the pte has PTE_FILE set
  * PRESENT: Page exists in memory
  * SWAPPED: Page exists in swap storage only
  * DIRTY:   Page exists in both swap storage and memory, but are not the same
  * CLEAN:   Page exists in both swap storage and memory and as identical
+ *
+ * Pages with PTE_FILE set came from a file, and their file takes the place of swap storage. They
+ * are CLEAN as long as they match the file, an eviction drops them (NONE with no frame) and the
+ * next fault reads them again. Only pages of shared mappings are ever DIRTY, they are written back
+ * to the file. Private pages stop being file pages on their first write, and are PRESENT from then on.
  */
 typedef enum {
     PTE_NONE,
@@ -40,119 +44,203 @@ typedef enum {
 } swapstate_t;
 
 
+/*
+ * A pte is two words. The first is laid out like the low word of a TLB entry, with the frame in
+ * the top 20 bits, so a refill only has to mask off our bits to load it:
+ *
+ *      31            12  11         10       9      8         7        6      5     3   2     0
+ *     |  frame number  | NOREFILL | CACHED | FILE | OUTOFLINE | SHARED | INUSE | state | perms |
+ *
+ * The second word is the swap slot. A page table slot mapping a shared page has PTE_SHARED set and
+ * holds the address of the shared entry in its second word instead.
+ *
+ * The UTLB miss handler in exception.S refills the TLB straight from the page table, and hardcodes
+ * this layout along with the layout of the tree below. Keep them in sync.
+ *
+ * Share counts are not kept in the pte. A shared entry is the head of a struct pte_shared, which is
+ * only allocated for pages that are actually shared, so the page table itself stays 8 bytes a page.
+ */
 struct pte {
-	paddr_t ppageaddr;              /* Physical address mapping */
-    permissions_t permissions;      /* permissions for access */
-
-    /* following information is used for demand paging */
-    swapstate_t swap_state;
+    u_int32_t pte_word;             /* frame, flags, swap state and permissions, see above */
     u_int32_t swap_location;        /* swap location on disk */
+};
 
-    /* following information is used to implement copy on write */
-    int num_sharers;                /* counts how many threads are sharing this pte. If thsi is 0, pte is not shared */
+#define PTE_FRAME       0xfffff000
+#define PTE_PERMMASK    0x00000007
+#define PTE_STATEMASK   0x00000038
+#define PTE_STATESHIFT  3
+#define PTE_INUSE       0x00000040  /* page table slots only: the slot maps a page */
+#define PTE_SHARED      0x00000080  /* page table slots only: swap_location is the shared entry */
+#define PTE_OUTOFLINE   0x00000100  /* this pte is the head of a struct pte_shared */
+#define PTE_FILE        0x00000200  /* the page is backed by its file rather than swap, see above */
+#define PTE_CACHED      0x00000400  /* shared entries only: the entry is in the page cache, see pagecache.h */
+#define PTE_NOREFILL    0x00000800  /* the next reference has to go through vm_fault, see coremap_page_watch() */
+#define PTE_PAGEBITS    (PTE_FRAME | PTE_NOREFILL | PTE_FILE | PTE_STATEMASK | PTE_PERMMASK)
+
+/* read the fields of a pte */
+#define PTE_PADDR(e)    ((paddr_t)((e)->pte_word & PTE_FRAME))
+#define PTE_STATE(e)    ((swapstate_t)(((e)->pte_word & PTE_STATEMASK) >> PTE_STATESHIFT))
+#define PTE_PERMS(e)    ((permissions_t)((e)->pte_word & PTE_PERMMASK))
+
+/* update the fields of a pte. The new value is evaluated before the entry is read */
+#define PTE_SET_PADDR(e, p) do { \
+        u_int32_t _v = (p) & PTE_FRAME; \
+        (e)->pte_word = ((e)->pte_word & ~PTE_FRAME) | _v; \
+    } while(0)
+#define PTE_SET_STATE(e, s) do { \
+        u_int32_t _v = ((u_int32_t)(s) << PTE_STATESHIFT) & PTE_STATEMASK; \
+        (e)->pte_word = ((e)->pte_word & ~PTE_STATEMASK) | _v; \
+    } while(0)
+#define PTE_SET_PERMS(e, p) do { \
+        u_int32_t _v = (u_int32_t)(p) & PTE_PERMMASK; \
+        (e)->pte_word = ((e)->pte_word & ~PTE_PERMMASK) | _v; \
+    } while(0)
+
+/* a pte that lives outside of a page table, for pages that are shared */
+struct pte_shared {
+    struct pte ps_pte;              /* must come first, this is the entry everybody uses */
+    int ps_sharers;                 /* how many more address spaces share the page. 0 if not shared */
 };
 
-/* create and destroy a pte */
+/* create and destroy a pte that lives outside of a page table, for pages that are shared */
 struct pte *pte_init();
 void pte_destroy(struct pte *entry); 
 
-/* Copy a pte entry */
+/* share count of an entry. Entries in a page table are never shared */
+int pte_sharers(struct pte *entry);
+void pte_addsharer(struct pte *entry);
+void pte_dropsharer(struct pte *entry);
+
+/* Copy the page information of a pte entry */
 void pte_copy(struct pte *src, struct pte *dest);
 
 
 
 /***********************************************
- * Different implementations of the page table
+ * The page table
  ***********************************************/
-#if !OPT_TWOLEVELPAGETABLE
 
 /*
- * A slower, but more space efficient implementation of the page table.
- * The layout of the page table is a linked list with each node holding an array.
- * We map the top 16 bits using a linked list, then the bottom 4 bits using an array.
- * These numbers are hardcoded and can be adjusted and experiemented with.
- * With this method, a page table uses substantially less memory. And for the 
- * common case, increases the maximum number of memory accesses from 3 to 6
+ * A three level radix tree indexed by the virtual page number. The 19 bits of a user page number
+ * are split 5/5/9. The top level is part of struct pagetable, the middle level is a small array of
+ * leaf pointers, and a leaf is one page holding 512 ptes inline. Levels below the top are allocated
+ * on demand, so a lookup is at most three indexed loads and most faults don't allocate anything.
+ *
+ * Private pages live in their slot, and coremap entries point right at it. A shared page (copy on
+ * write after fork, the zero page) has a pte of its own allocated with pte_init(), and the slots of
+ * all sharers point at it (PTE_SHARED). pt_get() hides the difference.
+ *
+ * Leaves themselves are shared after fork, with the number of page tables using a leaf kept in its
+ * coremap entry. Every page in a shared leaf is shared as well. Whatever adds, removes or writes
+ * to a page first has to get a private copy of the leaf with pt_unshare(). pt_alloc() and
+ * pt_add_shared() do that on their own. Paging in and out works on shared leaves like it does on
+ * shared entries.
  */
-
-struct pte_container {
-    u_int32_t first_idx;
-    struct pte **pte_array;
-    struct pte_container *next;
+#define PT_TOP_BITS         5
+#define PT_DIR_BITS         5
+#define PT_LEAF_BITS        9
+#define PT_TOP_ENTRIES      (1 << PT_TOP_BITS)
+#define PT_DIR_ENTRIES      (1 << PT_DIR_BITS)
+#define PT_LEAF_ENTRIES     (1 << PT_LEAF_BITS)
+
+#define PT_LEAF_SHIFT       PAGE_OFFSET
+#define PT_DIR_SHIFT        (PT_LEAF_SHIFT + PT_LEAF_BITS)
+#define PT_TOP_SHIFT        (PT_DIR_SHIFT + PT_DIR_BITS)
+
+#define PT_TOP_INDEX(vaddr)     ((vaddr) >> PT_TOP_SHIFT)
+#define PT_DIR_INDEX(vaddr)     (((vaddr) >> PT_DIR_SHIFT) & (PT_DIR_ENTRIES - 1))
+#define PT_LEAF_INDEX(vaddr)    (((vaddr) >> PT_LEAF_SHIFT) & (PT_LEAF_ENTRIES - 1))
+#define PT_INDEX_TO_VADDR(top, dir, leaf) \
+    ( ((vaddr_t)(top) << PT_TOP_SHIFT) | ((vaddr_t)(dir) << PT_DIR_SHIFT) | ((vaddr_t)(leaf) << PT_LEAF_SHIFT) )
+
+struct pt_leaf {
+    struct pte pl_slots[PT_LEAF_ENTRIES];
 };
 
-#define PT_FIRST_INDEX_OFFSET            16
-#define PT_SECOND_INDEX_OFFSET           12
-#define PT_VADDR_TO_FIRST_INDEX(vaddr)   (vaddr>>PT_FIRST_INDEX_OFFSET)
-#define PT_VADDR_TO_SECOND_INDEX(vaddr)  ( (vaddr>>PT_SECOND_INDEX_OFFSET) & 0x0000000f )
-#define PT_PTE_ARRAY_NUM_ENTRIES         16
-#define PT_INDEX_TO_VADDR(idx1, idx2)    ( (idx1<<PT_FIRST_INDEX_OFFSET) | (idx2<<PT_SECOND_INDEX_OFFSET) )
-
-
-typedef struct pte_container* pagetable_t;
-
+struct pt_dir {
+    struct pt_leaf *pd_leaves[PT_DIR_ENTRIES];
+};
 
-#else
+struct pagetable {
+    struct pt_dir *pt_dirs[PT_TOP_ENTRIES];
+};
 
-/*
- * This implements a two level page table.
- * 
- * In this specific case, there are 2^19 user level pages that we need to potentially provide a mapping for.
- * The first page table will have 2^9 (512) entries, each with a pointer to another table with 2^10 (1024) entries.
- * This covers all 19 bits we need to describe the virtual page number. The second layer of tables is created on demand.
- * Each of the entries in one of the tables with 512 entries is a page table entry, with a ton of useful information about the page.
- * 
- * This shouldnt be used until we get a better page table implementation going.
- */
+typedef struct pagetable* pagetable_t;
 
 /*
- * Machine dependant stuff
- * Hardcoded sizes of the first and second layer. Really depends on the machine.
- * Here, the first and second layer cover 19 bits, which is enough to index from MIPS_KUSEG to MIPS_KSEG0
+ * Iterator over the mapped pages of a page table, in address order:
+ *
+ *      struct pt_iter it;
+ *      for(pt_iter_begin(pt, &it); pt_iter_vaddr(&it) != 0; pt_iter_next(&it)) {
+ *          entry = pt_iter_pte(&it);
+ *          ...
+ *      }
+ *
+ * Every step picks up at the current slot, so a whole walk is linear in the size of the table.
+ * Pages may be removed during the walk. A page added during the walk is only seen if it lies
+ * ahead of the iterator.
  */
-#define PT_FIRST_LAYER_SIZE 512
-#define PT_SECOND_LAYER_SIZE 1024
-#define PT_SECOND_LAYER_OFFSET 10
-#define PT_SECOND_LAYER_MASK 0x000003ff     /* bottom 10 bits */
-
-u_int32_t pt_vaddr_to_first_index(vaddr_t addr);
-u_int32_t pt_vaddr_to_second_index(vaddr_t addr);
-vaddr_t idx_to_vaddr(u_int32_t first_idx, u_int32_t second_idx);
-
-/* pagetable definition */
-typedef struct pte*** pagetable_t;     
-
+struct pt_iter {
+    pagetable_t pi_pt;
+    u_int32_t pi_top;
+    u_int32_t pi_dir;
+    u_int32_t pi_idx;
+    struct pt_leaf *pi_leaf;        /* leaf of the current slot, NULL once the walk is done */
+};
 
-#endif /* OPT_TWOLEVELPAGETABLE */
 
+/* initialize a new page table */
+pagetable_t pt_init();
 
+/* 
+ * Reserve the slot for vaddr for a private page. Returns the empty entry to fill in, or NULL if
+ * the page table could not grow. The slot must be free.
+ */
+struct pte *pt_alloc(pagetable_t pt, vaddr_t vaddr);
 
-/************************************************************************************
- * The higher level functions for the page table should be he same for the 
- * two page table implementations, as they're used throughout the rest of the kernel
- ************************************************************************************/
+/* Map vaddr to a shared entry. Does not touch the share count. Returns ENOMEM on error */
+int pt_add_shared(pagetable_t pt, vaddr_t vaddr, struct pte *shared);
 
-/* initialize a new page table */
-pagetable_t pt_init();
+/* 
+ * Give pt a private copy of the leaf mapping vaddr, if it shares it with other page tables. Has
+ * to be done before a page in the leaf is written or removed. Returns ENOMEM on error.
+ */
+int pt_unshare(pagetable_t pt, vaddr_t vaddr);
 
-/* add entry into the page table */
-int pt_add(pagetable_t pt, vaddr_t vaddr, struct pte *entry);
+/* Is the page at vaddr shared with another page table, either through its leaf or its entry */
+int pt_isshared(pagetable_t pt, vaddr_t vaddr);
 
 /* get pte entry */
 struct pte *pt_get(pagetable_t pt, vaddr_t vaddr);
 
-/* get the next populated vaddr */
-vaddr_t pt_getnext(pagetable_t pt, vaddr_t vaddr);
 
 /* copy a page table deep */
 int pt_copy(pagetable_t src, pagetable_t dest);
 
-/* copy a page table shallow */
+/* copy a page table shallow, the two share all leaves until one of them changes a leaf */
 int pt_copy_shallow(pagetable_t src, pagetable_t dest);
 
-/* remove entry from the page table */
+/* remove entry from the page table. Frees nothing but the slot. The leaf must not be shared */
 void pt_remove(pagetable_t pt, vaddr_t vaddr);
 
+/* position the iterator on the first mapped page */
+void pt_iter_begin(pagetable_t pt, struct pt_iter *it);
+
+/* position the iterator on the first mapped page at or above vaddr */
+void pt_iter_from(pagetable_t pt, vaddr_t vaddr, struct pt_iter *it);
+
+/* move on to the next mapped page */
+void pt_iter_next(struct pt_iter *it);
+
+/* the vaddr of the current page, 0 once the walk is done */
+vaddr_t pt_iter_vaddr(struct pt_iter *it);
+
+/* the entry of the current page, as pt_get() would return it */
+struct pte *pt_iter_pte(struct pt_iter *it);
+
+/* pt_remove() the current page. The iterator stays put until the next pt_iter_next() */
+void pt_iter_remove(struct pt_iter *it);
+
 /* destroy page table */
 void pt_destroy(pagetable_t pt);
 
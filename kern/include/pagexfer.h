@@ -0,0 +1,29 @@
+/*
+ * Zero copy page transfer between processes.
+ *
+ * A sender donates a page aligned range of its address space to a receiver. Nothing is copied,
+ * not even through a kernel buffer: the page table entries are unlinked from the sender's page
+ * table and linked into the receiver's, and the frames, swap slots and shared entries behind them
+ * go with them. The sender's range reads as zeros afterwards, like freshly allocated memory.
+ *
+ * A transfer is a rendezvous. The receiver names the range the pages go to and waits for a sender,
+ * the sender names the receiver by pid and waits until it is ready to receive. Both ranges have
+ * to lie in anonymous writable memory (the heap, the stack), and as many pages move as fit in the
+ * smaller of the two.
+ *
+ * All of these run with interrupts off.
+ */
+
+#ifndef _PAGEXFER_H_
+#define _PAGEXFER_H_
+
+/* Move the pages at [addr, addr+len) to the process pid. Returns the bytes moved in moved */
+int pagexfer_send(pid_t pid, vaddr_t addr, size_t len, size_t *moved);
+
+/* Wait for a sender and take its pages at [addr, addr+len). Returns the bytes moved in moved */
+int pagexfer_recv(vaddr_t addr, size_t len, size_t *moved);
+
+/* A process is exiting, senders waiting for it give up */
+void pagexfer_exit(void);
+
+#endif /* _PAGEXFER_H_ */
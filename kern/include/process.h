@@ -21,6 +21,9 @@ int     proc_addentry(struct thread *thread, pid_t *retval);
 /* Returns 1 if a pid is available, 0 if not */
 int     proc_pid_avail();
 
+/* Returns 1 if the process with the pid exists and has not exited, 0 if not */
+int     proc_alive(pid_t pid);
+
 /* Delete process from process table */
 void    proc_deleteentry(pid_t pid); 
 
@@ -56,6 +59,9 @@ int     proc_waitpid(pid_t pid, int *status);
 /* Helper function for sys_execv() */ 
 int     proc_execv(char *program, int argc, char **argv);
 
+/* Helper function for sys___spawn() */
+int     proc_spawn(char *program, int argc, char **argv, pid_t *ret_val);
+
 
 #endif /* _PROCESS_H_ */
 
@@ -0,0 +1,113 @@
+/*
+ * Regions of a user address space.
+ *
+ * An address space is a set of regions, each a page aligned range of virtual addresses with one set
+ * of permissions and a pager that knows where the pages of the region come from:
+ *
+ *      anon:   zero filled memory that lives in swap once evicted. The heap and the stack
+ *      file:   pages are read from a file on their first fault. The segments of the executable,
+ *              and files mapped with mmap()
+ *      guard:  nothing may ever be mapped here. Any fault is a segfault
+ *      shm:    a shared memory segment. The pages belong to the segment, see shm.h
+ *
+ * The regions of an addrspace are kept in an array sorted by address, so finding the region of a
+ * fault is a binary search. Regions never overlap, but may be empty (the heap before the first
+ * sbrk, the stack before it is touched).
+ *
+ * A region with VR_GROWSDOWN set also owns the gap between it and the region below it. A fault in
+ * the gap is handled by the region, and the region grows down to the faulting page. This is how
+ * the stack grows.
+ *
+ * All of these need the as_lock of the addrspace, or the addrspace to be private to the caller.
+ */
+
+#ifndef _REGION_H_
+#define _REGION_H_
+
+#include <permissions.h>
+#include <machine/vm.h>
+
+struct addrspace;
+struct vnode;
+struct vm_region;
+struct shm_segment;
+
+/*
+ * What a region is backed by:
+ *
+ *      pg_fault:   map the page at faultaddress, which has no page table entry yet.
+ *                  Same return values as vm_fault()
+ *      pg_copy:    the region was copied into a new addrspace, take whatever references the copy
+ *                  needs. May be NULL
+ *      pg_destroy: the region is going away, drop its references. May be NULL
+ */
+struct vm_pager {
+    const char *pg_name;
+    int  (*pg_fault)(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype);
+    int  (*pg_copy)(struct vm_region *src, struct vm_region *dest);
+    void (*pg_destroy)(struct vm_region *region);
+};
+
+extern const struct vm_pager vm_anonpager;
+extern const struct vm_pager vm_filepager;
+extern const struct vm_pager vm_guardpager;
+extern const struct vm_pager vm_shmpager;
+
+/* region flags */
+#define VR_GROWSDOWN    0x1     /* faults in the gap below the region grow it down */
+#define VR_MMAP         0x2     /* created by mmap(), may be removed by munmap() */
+#define VR_SHARED       0x4     /* writes are seen by all who map the region, and go back to the file if there is one */
+#define VR_IMAGE        0x8     /* a segment of the program image, set by the ELF loader. Read only ones use the page cache */
+
+struct vm_region {
+    vaddr_t vr_start;               /* first page of the region */
+    vaddr_t vr_end;                 /* end of the region, page aligned, not included */
+    permissions_t vr_perms;
+    int vr_flags;
+    const struct vm_pager *vr_pager;
+
+    /* file backed regions only, set with region_setfile() */
+    struct vnode *vr_file;
+    vaddr_t vr_filestart;           /* address of the first byte that comes from the file */
+    off_t vr_fileoff;               /* offset of that byte in the file */
+    size_t vr_filesize;             /* bytes read from the file, everything past them is zero */
+
+    /* shared memory regions only */
+    struct shm_segment *vr_shm;
+};
+
+/*
+ * Add the region [start, end) to the address space. Both are rounded out to page boundaries.
+ * Returns the new region in ret. Returns EINVAL if it overlaps another region, ENOMEM if out of memory.
+ */
+int region_add(struct addrspace *as, vaddr_t start, vaddr_t end, permissions_t perms,
+                const struct vm_pager *pager, int flags, struct vm_region **ret);
+
+/*
+ * The region that vaddr belongs to, or NULL if it is not mapped. This includes the gap below a
+ * region that grows down, so the region returned may start above vaddr.
+ */
+struct vm_region *region_find(struct addrspace *as, vaddr_t vaddr);
+
+/* Move the end of a region. Returns ENOMEM if the region would run into the one above it */
+int region_setend(struct addrspace *as, struct vm_region *region, vaddr_t end);
+
+/* Back a region by a file. The filesize bytes at offset in v show up at vaddr, the rest reads as zeros */
+void region_setfile(struct vm_region *region, struct vnode *v, vaddr_t vaddr, off_t offset, size_t filesize);
+
+/* 
+ * Find room for len bytes, as high up as possible but below the stack. Returns the start in ret,
+ * or ENOMEM if no gap is big enough.
+ */
+int region_findgap(struct addrspace *as, size_t len, vaddr_t *ret);
+
+/* Remove a region. Its pages must be gone already */
+void region_remove(struct addrspace *as, struct vm_region *region);
+
+/* Copy all regions of src into dest, which has none yet */
+int region_copyall(struct addrspace *src, struct addrspace *dest);
+
+/* Remove all regions */
+void region_destroyall(struct addrspace *as);
+
+#endif /* _REGION_H_ */
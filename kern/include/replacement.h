@@ -0,0 +1,48 @@
+/*
+ * Page replacement policies.
+ *
+ * The coremap asks the current policy which user page to evict. Each policy keeps its own
+ * bookkeeping in the rp_* fields of the coremap entries and is told about every user page
+ * that gets allocated, referenced or freed:
+ *
+ *      rp_reset:   rebuild the policy state from the coremap. Called when switching policies.
+ *      rp_select:  return the coremap index of the page to evict, -1 if there is nothing to evict.
+ *      rp_access:  a user page was referenced. We only find out about this on TLB faults, so
+ *                  policies that clear a referenced bit also shoot down the page's TLB entries.
+ *      rp_alloc:   a user page was just allocated.
+ *      rp_free:    a user page is about to be freed.
+ *
+ * Available policies:
+ *      random:     start at a random page and take the first user page found (the original policy)
+ *      clock:      second chance using the referenced bit
+ *      wsclock:    clock that leaves pages used within the last WSCLOCK_WINDOW faults alone and
+ *                  prefers clean pages, so evicting does not cost a disk write
+ *      aging:      8 bit aging counters, shifted on every eviction. Evicts the lowest counter
+ *      2q:         simplified 2Q. New pages go on a FIFO queue and are promoted to an LRU queue
+ *                  when referenced again, so pages only touched once are evicted first
+ *
+ * All hooks are called with interrupts off.
+ */
+
+#ifndef _REPLACEMENT_H_
+#define _REPLACEMENT_H_
+
+struct replacement_policy {
+    const char *rp_name;
+    void (*rp_reset)(void);
+    int  (*rp_select)(void);
+    void (*rp_access)(int idx);
+    void (*rp_alloc)(int idx);
+    void (*rp_free)(int idx);
+};
+
+/* The policy currently in use */
+extern struct replacement_policy *replacement_policy;
+
+/* Select the policy to use by name. Returns EINVAL if there is no such policy */
+int  replacement_setpolicy(const char *name);
+
+/* Print the names of all policies */
+void replacement_listpolicies();
+
+#endif /* _REPLACEMENT_H_ */
@@ -0,0 +1,52 @@
+/*
+ * System V style shared memory segments.
+ *
+ * A segment is a named piece of anonymous memory. Every page of it is a shared entry (see
+ * pagetable.h) that belongs to the segment, and attaching the segment maps those same entries into
+ * the address space, through a region with the shm pager. So a segment is paged in and out like
+ * any shared page, and every process attached sees the same frame or the same swap slot.
+ *
+ * The segment holds one share of each of its pages, and every address space that has the page
+ * mapped one more. Pages are created on their first fault, zero filled. A segment lives as long
+ * as it is attached somewhere: fork attaches the child as well, and the segment and all of its
+ * pages are freed when the last region attached to it goes away. A segment that was never
+ * attached stays until shm_remove() (shmctl IPC_RMID). Removing a segment takes it out of the
+ * table right away, so its id and key are free again, and frees it once it is not attached.
+ *
+ * Everything runs with interrupts off.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+struct pte;
+
+/* Most segments that can exist at once, and the largest segment */
+#define SHM_MAX         32
+#define SHM_MAXPAGES    1024
+
+struct shm_segment {
+    int shm_id;                     /* index in the segment table */
+    int shm_key;                    /* IPC_PRIVATE segments can't be looked up */
+    size_t shm_size;                /* size asked for when it was created */
+    int shm_npages;
+    int shm_nattach;                /* regions attached, in all address spaces */
+    struct pte **shm_pages;         /* entries of the pages, NULL until a page is first touched */
+};
+
+/*
+ * Find the segment with the given key, or create it, as shmget() does. Returns the id of the
+ * segment in id.
+ */
+int shm_get(int key, size_t size, int flags, int *id);
+
+/* Attach to the segment with the given id. Returns NULL if there is none */
+struct shm_segment *shm_attach(int id);
+
+/* Detach from a segment. The last one frees it */
+void shm_detach(struct shm_segment *seg);
+
+/* Remove the segment with the given id, as shmctl(IPC_RMID) does. Returns EINVAL if there is none */
+int shm_remove(int id);
+
+#endif /* _SHM_H_ */
@@ -16,12 +16,51 @@
  *     So swapping is actual writing to the disk. Evicting is the process of clearing the TLB and updating 
  *     the page tables.
  * 
+ * pageout daemon:
+ *     The pageout thread sleeps until the number of free pages drops below PAGEOUT_LOW_WATERMARK.
+ *     It then evicts pages until PAGEOUT_HIGH_WATERMARK pages are free, and afterwards cleans up to
+ *     PAGEOUT_CLEAN_BATCH dirty pages so the next evictions don't need to write to disk at all.
+ * 
+ * clustering:
+ *     Dirty pages are written out in clusters of up to SWAP_CLUSTER_SIZE pages. Each cluster gets a run
+ *     of adjacent swap slots, sorted by address space and virtual address, and is written in one request.
+ * 
+ * readahead:
+ *     A swap fault also brings in the swapped pages that follow the faulting page, as long as their swap
+ *     slots are close by and there is free memory to spare. Runs of adjacent slots are read in one request.
+ *     The readahead pages are only added to the page table, the first reference maps them into the TLB.
+ *     The number of pages read ahead grows by one for every readahead page that gets used and is halved
+ *     for every one that is freed unused.
+ *     alloc_upage() still falls back to swap_pageout() if memory runs out before the daemon catches up.
+ * 
  * synchronization:
- *     Why do we turn off interrupts and also use locks at the same time? The answer is as follows. When 
- *     we do I/O with the swap disk, we actually need to acquire the lock for the swap file. This means that
- *     there is a possibility out prog could be put to sleep on the lock... which defeats the reason why
- *     we set interrupts off to begin with. This is why we should protect vm_fault and swap operations 
- *     with locks as well as interrupts.
+ *     Everything runs with interrupts off, so on our single CPU the VM structures only change under us
+ *     when we sleep, which happens on disk I/O and when we wait for a lock or a page. What may change 
+ *     across a sleep is layered:
+ *         1) as_lock, one per address space, serializes faults, sbrk and fork on that address space. 
+ *            Only its holder adds or removes page table entries.
+ *         2) A user page with I/O in flight is marked busy in the coremap (S_BUSY). Only the thread that
+ *            marked it touches the page or its page table entry until it is unmarked, everybody else 
+ *            waits with coremap_busy_wait() and looks the page up again. Frames are handed out busy and
+ *            unmarked once they are mapped. Evictions of other address spaces' pages only go through
+ *            busy pages, so they don't need that address space's lock.
+ *         3) swap_slot_lock protects the swap slot bitmap, swap_cluster_lock the cluster buffer.
+ *     A fault on a resident page, or in another address space, goes ahead while a thread waits for the
+ *     swap disk.
+ * 
+ * swap slots:
+ *     A page gets its swap slot the first time it is written out, by swap_pageclean() or a clustered
+ *     write, and keeps it until it is freed. Pages that are never evicted never use swap, so sbrk() and
+ *     faults don't touch the swap bitmap at all.
+ * 
+ * overcommit:
+ *     Since slots are handed out late, a full swap disk only shows up when a page has to be written.
+ *     Growing the heap is charged against a commit limit of all swap slots plus all user frames,
+ *     under one of two policies, picked with the overcommit menu command:
+ *         strict:     the heaps of all processes together never exceed the commit limit, so sbrk()
+ *                     and fork() fail with ENOMEM instead of the pager running out of swap later
+ *         heuristic:  only a single request bigger than the whole commit limit is refused. Large
+ *                     sparse heaps are cheap, but touching all of them can run the swap disk full
  * 
  * when do we evict?
  *     This is a question of optimization. When moving a page from the swap file to the physical memory,
@@ -29,18 +68,26 @@
  * 
  */
 
-/* make this lock external... we now put a lock on all operations that may affect the swapping system */
-struct lock;
+struct pte;
+struct addrspace;
+
+/* Free page watermarks for the pageout daemon, in pages */
+#define PAGEOUT_LOW_WATERMARK   8
+#define PAGEOUT_HIGH_WATERMARK  16
+
+/* Maximum number of dirty pages the pageout daemon cleans each time it runs */
+#define PAGEOUT_CLEAN_BATCH     16
+
+/* Maximum number of pages written to the swap disk in one request */
+#define SWAP_CLUSTER_SIZE       8
 
 /* 
- * So when to use this lock?
- * This is basically the only structure standing between a lot of synchronization issues
- * Use this whenever allocating ANYTHING. Basically the states between the pagetable, coremap,
- * and TLB need to be synchronized... otherwise bad things will happen
+ * Bounds for the swap readahead window, in pages. Only pages whose swap slot is within
+ * SWAP_READAHEAD_DISTANCE of the faulting page's slot are read ahead.
  */
-extern struct lock *swap_lock;
-
-struct pte;
+#define SWAP_READAHEAD_MIN      1
+#define SWAP_READAHEAD_MAX      16
+#define SWAP_READAHEAD_DISTANCE 32
 
 /* 
  * Initialize swap disk and all its pertaining fields
@@ -48,6 +95,16 @@ struct pte;
  */
 void swap_bootstrap();
 
+/*
+ * Start the pageout daemon. Called in main after swap_bootstrap
+ */
+void pageout_bootstrap();
+
+/*
+ * Wake the pageout daemon if free memory is below the low watermark
+ */
+void pageout_wakeup();
+
 /* Given a swapfile location, read the swap page into physical page */
 int swap_read(u_int32_t swap_location, paddr_t ppage);
 
@@ -60,10 +117,34 @@ int swap_write(u_int32_t swap_location, paddr_t ppage);
 int swap_pageout();
 
 /*
- * Given a page table entry, get it back into memory.
+ * Given a page table entry, get it back into memory. Returns EAGAIN if another thread brought it
+ * in while we slept, the fault should be retried then.
  */
 int swap_pagein(struct pte *entry);
 
+/*
+ * Same as swap_pagein, but also read ahead the swapped pages following vaddr in the address space
+ */
+int swap_pagein_readahead(struct addrspace *as, vaddr_t vaddr, struct pte *entry);
+
+/*
+ * Feedback for the adaptive readahead window. A hit grows the window, a miss shrinks it
+ */
+void swap_readahead_hit();
+void swap_readahead_miss();
+int  swap_readahead_window();
+
+/*
+ * Given a page table entry, write the page to the swap disk if needed so it is clean. 
+ * These and swap_pageevict() need the page to be marked busy.
+ */
+int swap_pageclean(struct pte *entry);
+
+/*
+ * Clean several pages, writing them to adjacent swap locations in one request
+ */
+int swap_pagecleancluster(struct pte **entries, int npages);
+
 /*
  * Given a page table entry, evict the page from the coremap
  */
@@ -77,16 +158,25 @@ void swap_pageevict(struct pte *entry);
 int swap_createspace(int npages);
 
 /*
- * Allocate pages on demand.
- * Reserve a space in swap disk.
+ * Charge npages of anonymous memory against the commit limit, see overcommit above. Returns ENOMEM
+ * if the overcommit policy refuses them. swap_uncommit() gives them back.
+ */
+int  swap_commit(u_int32_t npages);
+void swap_uncommit(u_int32_t npages);
+
+/*
+ * Pick the overcommit policy by name, "strict" or "heuristic". Returns EINVAL for an unknown name.
+ * Print the policies, marking the current one, and the pages committed.
  */
-int swap_allocpage_od(struct pte *entry);
+int  swap_setovercommit(const char *name);
+void swap_listovercommit();
 
 /*
  * Use to free a page from the swap disk
  */
 void swap_diskfree(u_int32_t swap_location);
 int  swap_diskalloc(u_int32_t *swap_location);
+int  swap_diskalloc_cluster(int npages, u_int32_t *start);
 
 
 #endif /* _SWAP_H_ */
@@ -30,6 +30,34 @@ int sys__exit(int exitcode);
 
 int sys_execv(const char *program, char **args, pid_t *retval);
 
+int sys___spawn(const char *program, char **args, pid_t *retval);
+
 int sys_sbrk(intptr_t amount, pid_t *retval);
 
+/* System calls related to memory mappings */
+int sys___mmap(const char *path, off_t offset, size_t len, int flags, int32_t *retval);
+
+int sys_munmap(vaddr_t addr, size_t len);
+
+/* System calls related to shared memory */
+int sys_shmget(int key, size_t size, int flags, int32_t *retval);
+
+int sys_shmat(int shmid, vaddr_t addr, int flags, int32_t *retval);
+
+int sys_shmdt(vaddr_t addr);
+
+int sys_shmctl(int shmid, int cmd);
+
+/* System calls that move pages between processes */
+int sys_pagesend(pid_t pid, vaddr_t addr, size_t len, int32_t *retval);
+
+int sys_pagerecv(vaddr_t addr, size_t len, int32_t *retval);
+
+/* System calls for user level synchronization */
+int sys_futex_wait(vaddr_t addr, int val);
+
+int sys_futex_wake(vaddr_t addr, int n, int32_t *retval);
+
+int sys___ras(vaddr_t start, vaddr_t end);
+
 #endif /* _SYSCALL_H_ */
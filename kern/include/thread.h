@@ -84,6 +84,9 @@ void thread_shutdown(void);
 /* Returns number of active threads */
 int thread_count(void);
 
+/* Mark the current thread as a kernel daemon, excluded from thread_count() */
+void thread_daemonize(void);
+
 /*
  * Make a new thread, which will start executing at "func".  The
  * "data" arguments (one pointer, one integer) are passed to the
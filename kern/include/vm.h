@@ -17,6 +17,7 @@
 
 struct addrspace;
 struct pte;
+struct vm_region;
 
 /* Initialization function */
 void vm_bootstrap(void);
@@ -24,31 +25,73 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* general fault handlers */
+/* 
+ * general fault handlers, for pages that have a page table entry. Pages that don't are handed to
+ * the pager of their region, see region.h
+ */
 int vm_readfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, 
-                    int is_pagefault, int is_stack, int is_swapped, int is_shared);
+                    int is_swapped, int is_shared);
 
 int vm_writefault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, 
-                    int is_pagefault, int is_stack, int is_swapped, int is_shared);
+                    int is_swapped, int is_shared);
 
 int vm_readonlyfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, 
-                    int is_pagefault, int is_stack, int is_swapped, int is_shared);
+                    int is_swapped, int is_shared);
 
 /* specefic fault handlers */
-int vm_stackfault(struct addrspace *as, vaddr_t faultaddress);
 int vm_swapfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, int faulttype);
 int vm_copyonwritefault( struct addrspace *as, struct pte *old_faultentry, vaddr_t faultaddress);
-int vm_lodfault(struct addrspace *as, vaddr_t faultaddress, int faulttype);
-int vm_allocstackheap(struct addrspace *as, vaddr_t faultaddress);
+int vm_zerofault(struct addrspace *as, vaddr_t faultaddress);
+
+/* page faults of anonymous and file backed regions */
+int vm_anonfault(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype);
+int vm_lodfault(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype);
+
+/* read a file page that was dropped on eviction back in */
+int vm_filepagein(struct addrspace *as, struct vm_region *region, struct pte *entry, vaddr_t faultpage);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void    free_kpages(vaddr_t addr);
 
-/* Allocate/free user pages */
+/* Allocate/free user pages. New pages are busy until the caller unmarks them */
+paddr_t alloc_uframe(struct pte *entry);
+paddr_t alloc_uzeroframe(struct pte *entry);
 void    alloc_upage(struct pte *entry);
 void    free_upage(struct pte *entry);
 
+/* 
+ * VM statistics, printed and reset by the vmstat menu command.
+ * Updated with interrupts off.
+ */
+struct vmstat {
+    u_int32_t vs_faults;        /* calls to vm_fault */
+    u_int32_t vs_swapins;       /* pages read from the swap disk */
+    u_int32_t vs_swapouts;      /* pages written to the swap disk */
+    u_int32_t vs_evictions;     /* pages evicted from memory */
+    u_int32_t vs_clusterwrites; /* multi page writes to the swap disk */
+    u_int32_t vs_ra_pages;      /* pages brought in by swap readahead */
+    u_int32_t vs_ra_hits;       /* readahead pages that were referenced */
+    u_int32_t vs_ra_misses;     /* readahead pages freed without being referenced */
+    u_int32_t vs_faultaround;   /* extra ELF pages loaded by fault-around */
+    u_int32_t vs_zerofaults;    /* pages mapped to the zero page */
+    u_int32_t vs_zeroidle;      /* pages zeroed by the idle loop */
+    u_int32_t vs_zerohits;      /* zero filled pages taken from the zero pool */
+    u_int32_t vs_zeromisses;    /* zero filled pages that had to be cleared at fault time */
+    u_int32_t vs_ptsplits;      /* shared page table leaves copied on the first change */
+    u_int32_t vs_filereads;     /* file pages read back in after they were dropped */
+    u_int32_t vs_filewrites;    /* pages of shared mappings written back to their file */
+    u_int32_t vs_filedrops;     /* clean file pages dropped instead of written to swap */
+    u_int32_t vs_pchits;        /* read only file pages mapped from the page cache */
+    u_int32_t vs_pcreclaims;    /* pages removed from the page cache when they were evicted */
+    u_int32_t vs_xferpages;     /* pages moved between address spaces by pagexfer */
+};
+
+extern struct vmstat vmstat;
+
+void vmstat_print(void);
+void vmstat_reset(void);
+
 /* Debug function */
 #if OPT_DUMBVM
 void region_dump(struct addrspace *as);
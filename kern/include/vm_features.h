@@ -10,8 +10,35 @@
 
 #define COPY_ON_WRITE_ENABLE 1
 
-#define LRU_CLOCK 0
+/* Page replacement policy used at boot. Can be changed at runtime with the vmpolicy menu command */
+#define REPLACEMENT_POLICY_DEFAULT "random"
 
-#define TLB_ASID_ENABLE 0
+#define TLB_ASID_ENABLE 1
+
+/* Refill the TLB straight from the page table in the UTLB miss handler, see exception.S */
+#define TLB_REFILL_WALK_ENABLE 1
+
+#define PAGEOUT_DAEMON_ENABLE 1
+
+#define SWAP_READAHEAD_ENABLE 1
+
+/* Largest heap a process may grow with sbrk, in bytes. Every new addrspace starts with this limit */
+#define HEAP_LIMIT_DEFAULT (64*1024*1024)
+
+/* Overcommit policy used at boot, "strict" or "heuristic". Can be changed at runtime with the overcommit menu command */
+#define OVERCOMMIT_POLICY_DEFAULT "heuristic"
+
+/* Number of pages loaded together on a load on demand fault */
+#define FAULTAROUND_ENABLE 1
+#define FAULTAROUND_PAGES 8
+
+/* Map untouched heap, stack and bss pages to a shared zero page on reads, see vm_zerofault */
+#define ZERO_PAGE_ENABLE 1
+
+/* Zero free pages in the idle loop for anonymous faults, see coremap_zero_idle */
+#define ZERO_POOL_ENABLE 1
+
+/* Share read only program segments, like program text, between processes, see pagecache.h */
+#define PAGE_CACHE_ENABLE 1
 
 #endif /* _VM_FEATURES_H_ */
@@ -94,6 +94,7 @@ boot(void)
 	vfs_bootstrap();
 	dev_bootstrap();
 	swap_bootstrap();
+	pageout_bootstrap();
 	kprintf_bootstrap();
 
 
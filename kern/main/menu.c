@@ -19,6 +19,11 @@
 #include "opt-net.h"
 #include <process.h>
 #include <machine/spl.h>
+#include <vm.h>
+#if !OPT_DUMBVM
+#include <replacement.h>
+#include <swap.h>
+#endif
 
 #define _PATH_SHELL "/bin/sh"
 
@@ -383,6 +388,87 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+/*
+ * Command for printing or resetting VM statistics.
+ */
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstat_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: vmstat [reset]\n");
+		return EINVAL;
+	}
+
+	vmstat_print();
+
+	return 0;
+}
+
+/*
+ * Command for selecting the page replacement policy.
+ * Can be given on the boot command line like any other menu command.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		replacement_listpolicies();
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy [policy]\n");
+		return EINVAL;
+	}
+
+	result = replacement_setpolicy(args[1]);
+	if (result) {
+		kprintf("vmpolicy: unknown policy %s\n", args[1]);
+		replacement_listpolicies();
+		return result;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for selecting the overcommit policy, and showing how much
+ * memory is committed.
+ */
+static
+int
+cmd_overcommit(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		swap_listovercommit();
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: overcommit [strict|heuristic]\n");
+		return EINVAL;
+	}
+
+	result = swap_setovercommit(args[1]);
+	if (result) {
+		kprintf("overcommit: unknown policy %s\n", args[1]);
+		swap_listovercommit();
+		return result;
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -453,6 +539,11 @@ static const char *opsmenu[] = {
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
+#if !OPT_DUMBVM
+	"[vmstat]  VM statistics             ",
+	"[vmpolicy] Page replacement policy  ",
+	"[overcommit] Overcommit policy      ",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -573,6 +664,11 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if !OPT_DUMBVM
+	{ "vmstat",	cmd_vmstat },
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "overcommit",	cmd_overcommit },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -20,6 +20,8 @@
 #include <vfs.h>
 #include <pagetable.h>
 #include <vm_features.h>
+#include <vm.h>
+#include <pagexfer.h>
 
 /* Lock to synchronize the process table */
 static struct lock *process_lock;
@@ -94,6 +96,17 @@ int proc_pid_avail()
 }
 
 
+/* Check if a process is still running */
+int proc_alive(pid_t pid)
+{
+    assert(curspl>0);
+    if( pid <= 0 || pid >= MAX_PID || process_table[pid] == NULL ) {
+        return 0;
+    }
+    return !process_table[pid]->t_exitflag;
+}
+
+
 /* Delete an entry from the process table */
 void proc_deleteentry(pid_t pid)
 {
@@ -348,6 +361,11 @@ void proc_exit(int exitcode)
 
     V(curthread->t_exitsem);        // Now others waiting for this pid can continue with their lives
 
+#if !OPT_DUMBVM
+    /* Processes waiting to send pages to us would wait forever */
+    pagexfer_exit();
+#endif
+
     /* Apparently we need to change the status of this processes children... ADOPTION!! */
     int index;
     struct thread *child;
@@ -368,16 +386,14 @@ void proc_exit(int exitcode)
 
 
 /*
- * Helper function for sys_execv()
- * Refer to syscall_impl.c for the full description of the system call
+ * Load a program for sys_execv() and sys___spawn()
  * 
  * Strategy for implementation:
- *      1. Create a new address space for the program, we should save the current one in case of failure
+ *      1. Create a new address space for the program, the caller keeps the current one in case of failure
  *      2. Activate new address space 
  *      3. Load the ELF file
  *      4. Define the stack in the user space
- *      5. Destroy old address space
- *      6. Push arguments onto the user stack (tricky!)   
+ *      5. Push arguments onto the user stack (tricky!)   
  *           (i) Have to watch out for memory alignment
  *           (ii) Have to allocate room for both the actual strings, as well as the pointers to them
  *                This means that we have a bunch of null terminated strings on the stack followed by an array of pointers
@@ -392,10 +408,13 @@ void proc_exit(int exitcode)
  *                                     .
  *                             ----- argv_0 -----  -> STACK_PTR   
  *                NOTE: argv_0 is usually the program name, but we don't enforce this
- *      7. Call md_usermode to get into usermode. Should not return from there
+ * 
+ * On success the new address space is curthread's and active, and the old one is left alone.
+ * On failure the old one is current again.
  */ 
-int proc_execv(char *program, int argc, char **argv){
-    int spl = splhigh();
+static int proc_load(char *program, int argc, char **argv, vaddr_t *ret_entrypoint, vaddr_t *ret_stackptr)
+{
+    assert(curspl>0);
 
     struct vnode *v;
     vaddr_t entrypoint, stackptr;
@@ -406,7 +425,7 @@ int proc_execv(char *program, int argc, char **argv){
     /* Open the file */
     err = vfs_open(program, O_RDONLY, &v);
     if(err) {
-        goto execv_failed;
+        return err;
     }
 
     /* save current addrspace, use it in case loading a file fails */
@@ -417,8 +436,7 @@ int proc_execv(char *program, int argc, char **argv){
     if(curthread->t_vmspace == NULL) {
         vfs_close(v);
         curthread->t_vmspace = cur_addrspace;       /* Restore old addrspace */
-        err = ENOMEM;
-        goto execv_failed;
+        return ENOMEM;
     }
 
     /* activate new addrspace */
@@ -431,23 +449,25 @@ int proc_execv(char *program, int argc, char **argv){
     else{
         err = load_elf(v, &entrypoint);
     }
+
+    /* file backed regions hold their own reference to the executable */
+    vfs_close(v);
     if(err) {
-        vfs_close(v);
-        as_destroy(curthread->t_vmspace);
-        curthread->t_vmspace = cur_addrspace;
-        goto execv_failed;
+        goto load_failed;
     }   
 
     /* Define the user stack in the address space */
     err = as_define_stack(curthread->t_vmspace, &stackptr);
     if(err){
-        as_destroy(curthread->t_vmspace);
-        curthread->t_vmspace = cur_addrspace;
-        goto execv_failed;
+        goto load_failed;
     }
 
     /* Push actual strings onto the stack, keep memory aligned! */
     char **user_argv = kmalloc(argc*sizeof(char *));
+    if(user_argv == NULL) {
+        err = ENOMEM;
+        goto load_failed;
+    }
 
     int len;
     for( idx = 0; idx < argc; idx++ ){
@@ -457,9 +477,7 @@ int proc_execv(char *program, int argc, char **argv){
         err = copyout((const void *)argv[idx], (userptr_t)(stackptr), (size_t)len);        /* copy out the string to the stack */
         if( err ){
             kfree(user_argv);
-            as_destroy(curthread->t_vmspace);
-            curthread->t_vmspace = cur_addrspace;
-            goto execv_failed;
+            goto load_failed;
         } 
         user_argv[idx] = (char *)stackptr;   /* update to point towards the string */
     }
@@ -470,20 +488,59 @@ int proc_execv(char *program, int argc, char **argv){
 
     /* Copy the array over to the stack */
     err = copyout((const void *)user_argv, (userptr_t)stackptr, (size_t) (argc*sizeof(char *)) );
+    kfree(user_argv);
     if(err){
-        kfree(user_argv);
-        as_destroy(curthread->t_vmspace);
-        curthread->t_vmspace = cur_addrspace;
-        goto execv_failed;
+        goto load_failed;
     }
 
-    /* Deallocate everything */
-    kfree(user_argv);
+    *ret_entrypoint = entrypoint;
+    *ret_stackptr = stackptr;
+    return 0;
+
+load_failed:
+    as_destroy(curthread->t_vmspace);
+    curthread->t_vmspace = cur_addrspace;
+    as_activate(curthread->t_vmspace);
+    return err;
+}
+
+/* free the program and arguments handed to proc_execv() and proc_spawn() */
+static void proc_freeargs(char *program, int argc, char **argv)
+{
+    int idx;
     for(idx=0; idx<=argc; idx++) {
         kfree(argv[idx]);
     }
     kfree(argv);
     kfree(program);
+}
+
+
+/*
+ * Helper function for sys_execv()
+ * Refer to syscall_impl.c for the full description of the system call
+ * 
+ * Strategy for implementation:
+ *      1. Load the program into a new address space with proc_load()
+ *      2. Destroy old address space
+ *      3. Call md_usermode to get into usermode. Should not return from there
+ */ 
+int proc_execv(char *program, int argc, char **argv){
+    int spl = splhigh();
+
+    vaddr_t entrypoint, stackptr;
+    struct addrspace *cur_addrspace = curthread->t_vmspace;
+    int err;
+
+    err = proc_load(program, argc, argv, &entrypoint, &stackptr);
+    if(err) {
+        proc_freeargs(program, argc, argv);
+        splx(spl);
+        return err;
+    }
+
+    /* Deallocate everything */
+    proc_freeargs(program, argc, argv);
     as_destroy(cur_addrspace);      /* destroy old addrspace */
 
 	/* Warp to user mode. */
@@ -493,15 +550,91 @@ int proc_execv(char *program, int argc, char **argv){
 	/* md_usermode does not return */
 	panic("md_usermode returned\n");
 	return EINVAL;
+}
 
-execv_failed:
-    /* Deallocate everything */
-    for(idx=0; idx<=argc; idx++) {
-        kfree(argv[idx]);
+
+/* Where a spawned process starts in user mode, handed from proc_spawn() to the child */
+struct spawn_start {
+    int ss_argc;
+    vaddr_t ss_stackptr;
+    vaddr_t ss_entrypoint;
+};
+
+/* The child of proc_spawn() starts here. Its address space is ready to go */
+static void proc_spawnentry(void *start, unsigned long child_addrspace)
+{
+    struct spawn_start ss = *(struct spawn_start *)start;
+    kfree(start);
+
+    curthread->t_vmspace = (struct addrspace *)child_addrspace;
+    as_activate(curthread->t_vmspace);
+
+    md_usermode(ss.ss_argc, (userptr_t)ss.ss_stackptr, ss.ss_stackptr, ss.ss_entrypoint);
+    panic("md_usermode returned\n");
+}
+
+/*
+ * Helper function for sys___spawn()
+ * Refer to syscall_impl.c for the full description of the system call
+ * 
+ * Strategy for implementation:
+ *      1. Load the program into a new address space with proc_load(), just like execv does. This
+ *         makes it our current address space for a moment, so the arguments can be copied out
+ *      2. Switch back to our own address space. It is never copied, this is the point of spawn
+ *      3. Create a thread that starts in proc_spawnentry(), switches to the new address space
+ *         and jumps to user mode. It gets its pid from thread_fork() like a forked child
+ */
+int proc_spawn(char *program, int argc, char **argv, pid_t *ret_val)
+{
+    int spl = splhigh();
+
+    int err;
+    struct addrspace *parent_addrspace = curthread->t_vmspace;
+    struct addrspace *child_addrspace;
+    struct thread *child_thread;
+    struct spawn_start *start;
+
+    /* Don't bother loading anything if there is no pid for the child */
+    lock_acquire(process_lock);
+    if(!proc_pid_avail()) {
+        err = EAGAIN;
+        goto spawn_failed;
     }
-    kfree(argv);
-    kfree(program);
+
+    start = (struct spawn_start *)kmalloc(sizeof(struct spawn_start));
+    if(start == NULL) {
+        err = ENOMEM;
+        goto spawn_failed;
+    }
+    start->ss_argc = argc;
+
+    err = proc_load(program, argc, argv, &start->ss_entrypoint, &start->ss_stackptr);
+    if(err) {
+        kfree(start);
+        goto spawn_failed;
+    }
+    child_addrspace = curthread->t_vmspace;
+    curthread->t_vmspace = parent_addrspace;
+    as_activate(curthread->t_vmspace);
+
+    err = thread_fork("Child of spawn", (void *)start, (unsigned long)child_addrspace, proc_spawnentry, &child_thread);
+    if(err) {
+        as_destroy(child_addrspace);
+        kfree(start);
+        goto spawn_failed;
+    }
+    child_thread->t_waitflag = 1;
+
+    lock_release(process_lock);
+    proc_freeargs(program, argc, argv);
+    splx(spl);
+
+    *ret_val = child_thread->t_pid;
+    return 0;
+
+spawn_failed:
+    lock_release(process_lock);
+    proc_freeargs(program, argc, argv);
     splx(spl);
     return err;
 }
-
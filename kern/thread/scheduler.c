@@ -11,6 +11,9 @@
 #include <thread.h>
 #include <machine/spl.h>
 #include <queue.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vm_features.h>
 
 /*
  *  Scheduler data
@@ -91,6 +94,15 @@ scheduler(void)
 	assert(curspl>0);
 	
 	while (q_empty(runqueue)) {
+#if !OPT_DUMBVM
+		/* 
+		 * Nothing to run, so zero a free page for the zero pool. One page per trip, so 
+		 * interrupts wait for at most one page to be cleared.
+		 */
+		if(ZERO_POOL_ENABLE) {
+			coremap_zero_idle();
+		}
+#endif
 		cpu_idle();
 	}
 
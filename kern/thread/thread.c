@@ -31,16 +31,31 @@ struct array *zombies;
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
+/* Number of kernel daemon threads that never exit. Not reported by thread_count(). */
+static int numdaemons;
+
 /* Lock to help aid race condition between destroy and exit */
 static struct semaphore *thread_exit_mutex;
 
 /*
- * Returns number of active threads
+ * Returns number of active threads, not counting kernel daemons
  */
 int
 thread_count(void)
 {
-	return numthreads;
+	return numthreads - numdaemons;
+}
+
+/*
+ * Mark the current thread as a kernel daemon. Daemons run for the lifetime of
+ * the system, so code waiting for all other threads to finish should not wait on them.
+ */
+void
+thread_daemonize(void)
+{
+	int spl = splhigh();
+	numdaemons++;
+	splx(spl);
 }
 
 /*
@@ -21,6 +21,7 @@
 #include <machine/tlb.h>
 #include <pagetable.h>
 #include <vm_features.h>
+#include <region.h>
 
 
 /*
@@ -244,7 +245,10 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	*entrypoint = eh.e_entry;
 
 #if !OPT_DUMBVM
-	as_define_heap(curthread->t_vmspace);
+	result = as_define_heap(curthread->t_vmspace);
+	if (result) {
+		return result;
+	}
 #endif
 
 	return 0;
@@ -353,7 +357,10 @@ int load_elf_od(struct vnode *v, vaddr_t *entrypoint){
 	
 	}
 	/* Now we have to initialize the heap */
-	as_define_heap(curthread->t_vmspace);
+	result = as_define_heap(curthread->t_vmspace);
+	if (result) {
+		return result;
+	}
 
 	/* Load the segments on demand */
 	for (i=0; i<eh.e_phnum; i++) {
@@ -405,7 +412,9 @@ int load_segment_od(struct vnode *v, off_t offset, vaddr_t vaddr,
 	     				size_t memsize, size_t filesize,
 	    				int is_executable)
 {
-	struct uio u;
+	struct vm_region *region;
+
+	(void)is_executable;
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
@@ -415,83 +424,61 @@ int load_segment_od(struct vnode *v, off_t offset, vaddr_t vaddr,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
-	u.uio_iovec.iov_ubase = (userptr_t)vaddr;
-	u.uio_iovec.iov_len = memsize;   // length of the memory space
-	u.uio_resid = filesize;          // amount to actually read
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = curthread->t_vmspace;
-
-	/* Check whether we are working with as_code or as_data segment */
-	int is_code_seg = is_vaddrcode(curthread->t_vmspace, vaddr);
-	int is_data_seg = is_vaddrdata(curthread->t_vmspace, vaddr);
-	
-	/* the addrspace resides in the code region/segment */
-	if(is_code_seg){
-		curthread->t_vmspace->as_code->file = v;
-		curthread->t_vmspace->as_code->uio = u;
-	}
-	else if(is_data_seg) {
-		curthread->t_vmspace->as_data->file = v;
-		curthread->t_vmspace->as_data->uio = u;
+	/* as_define_region() made a file backed region for the segment, the pages come from v */
+	region = region_find(curthread->t_vmspace, vaddr);
+	if (region == NULL || region->vr_pager != &vm_filepager) {
+		return ENOEXEC;
 	}
+	region_setfile(region, v, vaddr, offset, filesize);
 
 	return 0;			
 
 }
 
 
-int load_page_od(struct vnode *v, struct uio u, off_t p_offset)
+/*
+ * load_pages_od()
+ * 
+ * Fill buf with the contents of npages pages of a file backed region, starting at the page aligned
+ * address vaddr. The part of the window backed by the file is read with a single VOP_READ,
+ * everything else (bss, or bytes outside the segment on partial pages) is zeroed.
+ */
+int load_pages_od(struct vm_region *region, vaddr_t vaddr, int npages, char *buf)
 {
-	int result, fillamt;
-	size_t filesize, memsize, file_to_read, new_memsize;
+	int result;
+	struct uio ku;
+	vaddr_t segstart = region->vr_filestart;
+	vaddr_t fileend = segstart + region->vr_filesize;
+	vaddr_t winend = vaddr + npages*PAGE_SIZE;
+	vaddr_t readstart, readend;
 
-	u.uio_iovec.iov_ubase += p_offset;
-	u.uio_offset += p_offset;
+	assert((vaddr & ~(vaddr_t)PAGE_FRAME) == 0);
 
-	new_memsize = u.uio_iovec.iov_len - p_offset;
-	if( new_memsize > PAGE_SIZE){
-		u.uio_iovec.iov_len = PAGE_SIZE;	
-	}
-	else {
-		u.uio_iovec.iov_len = new_memsize;
-	}
+	/* Part of the window that comes from the file */
+	readstart = (vaddr > segstart) ? vaddr : segstart;
+	readend = (winend < fileend) ? winend : fileend;
 
-	file_to_read = u.uio_resid;	
-	if( ((int)file_to_read - (int)p_offset) < 0){
-		u.uio_resid = 0;
-	}
-	else {
-		if((file_to_read - p_offset) > PAGE_SIZE){
-			u.uio_resid = PAGE_SIZE;	
-		}
-		else {
-			u.uio_resid = file_to_read - p_offset;	
-		}
+	if(readstart >= readend) {
+		bzero(buf, npages*PAGE_SIZE);
+		return 0;
 	}
 
-	result = VOP_READ(v, &u);
+	/* zero before and after the file data */
+	bzero(buf, readstart - vaddr);
+	bzero(buf + (readend - vaddr), winend - readend);
+
+	mk_kuio(&ku, buf + (readstart - vaddr), readend - readstart, 
+			region->vr_fileoff + (readstart - segstart), UIO_READ);
+	result = VOP_READ(region->vr_file, &ku);
 	if (result) {
 		return result;
 	}
 
-	if (u.uio_resid != 0) {
+	if (ku.uio_resid != 0) {
 		/* short read; problem with executable? */
 		kprintf("ELF: short read on segment - file truncated?\n");
 		return ENOEXEC;
 	}
 
-	memsize = u.uio_iovec.iov_len;
-	filesize = u.uio_resid;
-	/* Fill the rest of the memory space (if any) with zeros */
-	fillamt = memsize - filesize;
-	if (fillamt > 0) {
-		DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n", 
-		      (unsigned long) fillamt);
-		u.uio_resid += fillamt;
-		result = uiomovezeros(fillamt, &u);
-	}	
-
-	return result;
+	return 0;
 }
@@ -56,10 +56,11 @@ runprogram(char *progname, char **argv, unsigned long size_args)
 	else {
 		result = load_elf(v, &entrypoint);
 	}
-	
+
+	/* Done with the file. File backed regions hold their own reference to it */
+	vfs_close(v);
 	if (result) {
 		/* thread_exit destroys curthread->t_vmspace */
-		vfs_close(v);
 		return result;
 	}
 
@@ -67,7 +68,6 @@ runprogram(char *progname, char **argv, unsigned long size_args)
 	result = as_define_stack(curthread->t_vmspace, &stackptr);
 	if (result) {
 		/* thread_exit destroys curthread->t_vmspace */
-		vfs_close(v);
 		return result;
 	}
     
@@ -19,12 +19,21 @@
 #include <curthread.h>
 #include <process.h>
 #include <addrspace.h>
+#include <region.h>
+#include <shm.h>
+#include <pagexfer.h>
+#include <futex.h>
 #include <pagetable.h>
 #include <coremap.h>
 #include <vm.h>
 #include <machine/spl.h>
+#include <machine/tlb.h>
 #include <swap.h>
 #include <synch.h>
+#include <vm_features.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <kern/stat.h>
 
 /*
  * System call for write.
@@ -220,18 +229,23 @@ int sys___time(time_t *seconds, unsigned long *nanoseconds, time_t *retval)
 int sys_fork(struct trapframe *tf, pid_t *ret_val) 
 {
 	int spl = splhigh();
-	lock_acquire(swap_lock);
+
+	/* Nobody may fault on or change the parent's pages while they are being shared */
+	struct lock *as_lock = curthread->t_vmspace->as_lock;
+	lock_acquire(as_lock);
 
 	int child_pid;	
 	
 	int err = proc_fork(tf, &child_pid);
 	if(err) {
 		*ret_val = -1;
+		lock_release(as_lock);
+		splx(spl);
 		return err;
 	}
 	*ret_val = child_pid;
 
-	lock_release(swap_lock);
+	lock_release(as_lock);
 	splx(spl);
 	return 0;
 }
@@ -330,43 +344,17 @@ int sys__exit(int exitcode)
 }
 
 
-/*
- * System call for execv.
- * 
- * Takes two parameters: 
- * 		1. pointer to the string that represents the program path
- * 		2. array of null terminated strings that hold the arguments of the program.
- * 		   The array itsself should also be terminated by a NULL pointer
- * 
- * Returns two values only if execv fails:
- * 		1. retval returns -1 if failed, otherwise exec should not return
- * 		2. function returns errno to be handled by mips_syscall()
- * 		NOTE: On success execv should NOT return as the next program is executing!
- * 
- * Valid Error codes to be returned:
- * 
- * ENODEV	The device prefix of program did not exist.
- * ENOTDIR	A non-final component of program was not a directory.
- * ENOENT	program did not exist.
- * EISDIR	program is a directory. 
- * ENOEXEC	program is not in a recognizable executable file format, was for the wrong platform, or contained invalid fields. 
- * ENOMEM	Insufficient virtual memory is available.
- * E2BIG	The total size of the argument strings is too large.
- * EIO	A hard I/O error occurred.
- * EFAULT	One of the args is an invalid pointer.
- * 
- * Strategy for implementation:
- * 		1. Arguments are copied from user space into kernel space and checked for validity
- * 		2. Once arguments are valid, call proc_execv() to handle the rest
- */
-
 /* Maximum program length */
 const int MAX_ARGLEN = 64;		// maximum number of characters in an argument
 const int MAX_ARGNUM = 32;		// maximum number of arguments
 
-int sys_execv(const char *user_program, char **args, pid_t *retval){
-	int spl = splhigh();
-
+/*
+ * Copy the program path and argument array of execv or spawn into the kernel.
+ * On success, program and the NULL terminated argv are kmalloc'ed, and argv holds argc strings.
+ * On failure nothing is left allocated.
+ */
+static int copyin_program(const char *user_program, char **args, char **ret_program, int *ret_argc, char ***ret_argv)
+{
 	int err = 0; 		/* Error code, if exists */
 	int argc = 0;		/* Number of arguments, gotta count the length of args */
 	char **argv;		/* dynamically allocate the array once we have a grasp at what argc is */
@@ -378,21 +366,21 @@ int sys_execv(const char *user_program, char **args, pid_t *retval){
 	err = copyinstr( (const_userptr_t) user_program, program, MAX_ARGLEN, &program_len);
 	if(err) {
 		kfree(program);
-		goto execv_failed;
+		return err;
 	}
 
 	/* Gotta pass badcall!! */
 	/* Check if arg contains at least one thing */
 	if(args == NULL) {
-		err = EFAULT;
-		goto execv_failed;
+		kfree(program);
+		return EFAULT;
 	}
 	/* Check to see if args is a valid pointer */
 	char *test_valid_pointer;
 	err = copyin( (const_userptr_t)args, (void *)&test_valid_pointer, sizeof(char **) );
 	if(err) {
 		kfree(program);
-		goto execv_failed;
+		return err;
 	}
 
 	/* generate argv */
@@ -414,7 +402,7 @@ int sys_execv(const char *user_program, char **args, pid_t *retval){
 				}
 				kfree(argv);
 				kfree(program);
-				goto execv_failed;
+				return err;
 			}
 		} else {
 			argv[argc] = NULL;		/* Terminate argv with a null pointer */
@@ -428,11 +416,59 @@ int sys_execv(const char *user_program, char **args, pid_t *retval){
 			}
 			kfree(argv);
 			kfree(program);
-			err = E2BIG;
-			goto execv_failed;
+			return E2BIG;
 		}
 	}
 	assert(argv[argc] == NULL);		/* This must be true */
+
+	*ret_program = program;
+	*ret_argc = argc;
+	*ret_argv = argv;
+	return 0;
+}
+
+/*
+ * System call for execv.
+ * 
+ * Takes two parameters: 
+ * 		1. pointer to the string that represents the program path
+ * 		2. array of null terminated strings that hold the arguments of the program.
+ * 		   The array itsself should also be terminated by a NULL pointer
+ * 
+ * Returns two values only if execv fails:
+ * 		1. retval returns -1 if failed, otherwise exec should not return
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 		NOTE: On success execv should NOT return as the next program is executing!
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * ENODEV	The device prefix of program did not exist.
+ * ENOTDIR	A non-final component of program was not a directory.
+ * ENOENT	program did not exist.
+ * EISDIR	program is a directory. 
+ * ENOEXEC	program is not in a recognizable executable file format, was for the wrong platform, or contained invalid fields. 
+ * ENOMEM	Insufficient virtual memory is available.
+ * E2BIG	The total size of the argument strings is too large.
+ * EIO	A hard I/O error occurred.
+ * EFAULT	One of the args is an invalid pointer.
+ * 
+ * Strategy for implementation:
+ * 		1. Arguments are copied from user space into kernel space and checked for validity
+ * 		2. Once arguments are valid, call proc_execv() to handle the rest
+ */
+
+int sys_execv(const char *user_program, char **args, pid_t *retval){
+	int spl = splhigh();
+
+	int err;
+	int argc;
+	char **argv;
+	char *program;
+
+	err = copyin_program(user_program, args, &program, &argc, &argv);
+	if(err) {
+		goto execv_failed;
+	}
 	
 	/* argc and argv have been prepared properly, time to launch proc_execv */
 	err = proc_execv(program, argc, argv);
@@ -447,6 +483,53 @@ execv_failed:
 	return err;
 }
 
+
+/*
+ * System call for spawn.
+ * 
+ * Takes the same parameters as execv, but runs the program in a new child process and returns its
+ * pid, like fork followed by execv in the child. The difference is that the address space of the
+ * caller is never copied: the child starts out with a fresh address space holding the program.
+ * 
+ * Returns:
+ * 		1. retval returns the pid of the child, -1 if failed
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * All the errors of execv, plus
+ * EAGAIN	Too many processes already exist.
+ * 
+ * Errors in loading the program are returned to the caller, there is no child in that case.
+ */
+int sys___spawn(const char *user_program, char **args, pid_t *retval){
+	int spl = splhigh();
+
+	int err;
+	int argc;
+	char **argv;
+	char *program;
+
+	err = copyin_program(user_program, args, &program, &argc, &argv);
+	if(err) {
+		goto spawn_failed;
+	}
+
+	/* proc_spawn() frees the arguments */
+	err = proc_spawn(program, argc, argv, retval);
+	if(err) {
+		goto spawn_failed;
+	}
+
+	splx(spl);
+	return 0;
+
+spawn_failed:
+	*retval = -1;
+	splx(spl);
+	return err;
+}
+
 /*
  * The "break" is the end address of a process's heap region
  * The sbrk call adjusts the "break" by the amount amount. It returns the old "break"
@@ -460,154 +543,579 @@ execv_failed:
  *  EINVAL	The request would move the "break" below its initial value.
  * 
  * Strategy for implementation:
- * 	Round to the nearest page, then allocate space on the heap accordingly.
+ * 	Only the break moves, in constant time for any amount up to as_heaplimit. Growing charges the new
+ * 	pages against the commit limit, and vm_fault allocates them on their first access. Shrinking
+ * 	frees whatever pages were touched in one walk of the page table.
  */
 #if !OPT_DUMBVM
 
 int sys_sbrk(intptr_t amount, pid_t *retval)
 {
 	int spl = splhigh();
-	lock_acquire(swap_lock);
 
-	size_t i;
-	struct pte *new_entry;
-	vaddr_t vaddr;
 	int err;
 
 	/* Retrieve current address space */
 	struct addrspace *as = curthread->t_vmspace;
 	assert(as != NULL);								/* This is a user process, it must have an addrspace */
-	vaddr_t heapstart = as->as_heapstart;
+	lock_acquire(as->as_lock);
+
+	vaddr_t heapstart = as->as_heap->vr_start;
 	vaddr_t old_heapend = as->as_heapend;
 	size_t old_heapsize = ((old_heapend - heapstart + PAGE_SIZE-1) >> PAGE_OFFSET); /* size of heap in pages */
 
 	/* Ensure that amount is not too negative. The operations looks weird because we are working with unsigned values */
 	if( (amount < 0) && (old_heapend - heapstart < (unsigned)amount*-1) ){
 		*retval = -1;
-		lock_release(swap_lock);
+		lock_release(as->as_lock);
 		splx(spl);
 		return EINVAL;	
 	} 
 
-	/* Anything more than this is too large for one allocation */
-	if(amount > 8*8192) {
+	/* The heap may not grow past the limit of the process. This also keeps the new end from wrapping around */
+	if( (amount > 0) && ((size_t)amount > as->as_heaplimit - (old_heapend - heapstart)) ){
 		*retval = -1;
-		lock_release(swap_lock);
+		lock_release(as->as_lock);
 		splx(spl);
 		return ENOMEM;
 	}
 
-	/* Check if we should be allocating or freeing memory */
-	if(amount == 0) 
+	vaddr_t new_heapend = old_heapend + amount;
+	size_t new_heapsize = ((new_heapend - heapstart + PAGE_SIZE-1) >> PAGE_OFFSET);
+
+	if(new_heapsize > old_heapsize) 
 	{
-		*retval = old_heapend;
-		lock_release(swap_lock);
-		splx(spl);
-		return 0;
+		/* The heap must not run into the region above it */
+		err = region_setend(as, as->as_heap, new_heapend);
+		if(err) {
+			*retval = -1;
+			lock_release(as->as_lock);
+			splx(spl);
+			return ENOMEM;
+		}
+
+		/* The new pages count against the commit limit, see the overcommit policy in swap.h */
+		err = swap_commit(new_heapsize - old_heapsize);
+		if(err) {
+			region_setend(as, as->as_heap, old_heapend);
+			*retval = -1;
+			lock_release(as->as_lock);
+			splx(spl);
+			return ENOMEM;
+		}
+		as->as_commit += new_heapsize - old_heapsize;
+
+		/* 
+		 * Let vm_fault allocate pages on demand. Reads map the zero page and the first write
+		 * gets a frame. A page only gets a swap slot once it is written out, so pages that are
+		 * never evicted cost no swap, and pages that are never written cost no memory either.
+		 */
 	}
-	else if(amount > 0) 
+	else if(new_heapsize < old_heapsize)
 	{
-		/* Let vm_fault allocate pages on demand */
-		// as->as_heapend += amount;
-		// *retval = old_heapend;
-		// lock_release(swap_lock);
-		// splx(spl);
-		// return 0;
-
-		/* Check to see if allocation requires a new page */
-		vaddr_t new_heapend = old_heapend + amount;
-		vaddr_t new_heapsize = ((new_heapend - heapstart + PAGE_SIZE-1) >> PAGE_OFFSET);
-
-		if(new_heapsize == old_heapsize) 
-		{
-			as->as_heapend += amount;
-			*retval = old_heapend;
-			lock_release(swap_lock);
+		/* Only the pages that were touched are in the page table, free them all in one walk */
+		err = as_freerange(as, heapstart + new_heapsize*PAGE_SIZE, heapstart + old_heapsize*PAGE_SIZE);
+		if(err) {
+			*retval = -1;
+			lock_release(as->as_lock);
 			splx(spl);
-			return 0;
+			return err;
 		}
-		else
-		{
-			size_t num_pages_requested = new_heapsize - old_heapsize;
-			/* Allocate the pages requested by the user */
-			for(i=0; i<num_pages_requested; i++) {
-				vaddr = ((old_heapend + i*PAGE_SIZE + PAGE_SIZE-1) & PAGE_FRAME);
-
-				new_entry = pte_init();
-				if(new_entry == NULL) {
-					goto sbrk_failed;
-				}
+		region_setend(as, as->as_heap, new_heapend);
 
-				err = swap_allocpage_od(new_entry);
-				if(err) {
-					pte_destroy(new_entry);
-					goto sbrk_failed;
-				}
-				new_entry->permissions = set_permissions(1, 1, 0);
+		swap_uncommit(old_heapsize - new_heapsize);
+		as->as_commit -= old_heapsize - new_heapsize;
+	}
 
-				pt_add(as->as_pagetable, vaddr, new_entry);
-			}
-			/* Update heap breakpoint */
-			as->as_heapend += amount;
-			*retval = old_heapend;
-			lock_release(swap_lock);
-			splx(spl);
-			return 0;
+	as->as_heapend = new_heapend;
+	*retval = old_heapend;
+	lock_release(as->as_lock);
+	splx(spl);
+	return 0;
+}
 
-		sbrk_failed:
-			/* Allocate failed along the way. Free all allocated pages */
-			for(i=0; i < num_pages_requested; i++){
-				vaddr = ((old_heapend + i*PAGE_SIZE + PAGE_SIZE-1) & PAGE_FRAME);
-				new_entry = pt_get(as->as_pagetable, vaddr);
-				if(new_entry == NULL) {
-					continue;
-				}
 
-				free_upage(new_entry);
-				pt_remove(as->as_pagetable, vaddr);
-			}
-			*retval = -1;
-			lock_release(swap_lock);
-			splx(spl);
-			return ENOMEM;	
+/*
+ * System call for mmap. The libc mmap() is a wrapper around this.
+ * 
+ * Maps len bytes of the file at path, starting at offset, into the address space and returns the
+ * address of the mapping. flags holds the PROT_ bits the mapping is accessed with, and exactly one
+ * of MAP_SHARED and MAP_PRIVATE. We have no file descriptors, so the file is given by its path.
+ * 
+ * The pages are read from the file on their first access. Writes to a shared mapping go back to
+ * the file when the page is evicted, on munmap() and on exit. Writes to a private mapping stay
+ * in the process. The part of the mapping past the end of the file reads as zeros and is never
+ * written back.
+ * 
+ * Returns:
+ * 		1. retval returns the address of the mapping, MAP_FAILED if failed
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	len is 0, offset is not page aligned, or flags are invalid
+ * EFAULT	path is an invalid pointer
+ * ENODEV	path is not a file that can be mapped
+ * ENOMEM	There is no room in the address space for the mapping
+ * Any error of vfs_open()
+ */
+int sys___mmap(const char *path, off_t offset, size_t len, int flags, int32_t *retval)
+{
+	int spl = splhigh();
+
+	int err;
+	int shared;
+	char *kpath;
+	size_t filesize;
+	vaddr_t start;
+	struct stat st;
+	struct vnode *v;
+	struct vm_region *region;
+	permissions_t perms;
+
+	struct addrspace *as = curthread->t_vmspace;
+	assert(as != NULL);
+
+	*retval = (int32_t)MAP_FAILED;
+
+	/* Check the arguments */
+	if( ((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0) ) {
+		splx(spl);
+		return EINVAL;
+	}
+	if( (flags & ~(PROT_READ | PROT_WRITE | PROT_EXEC | MAP_SHARED | MAP_PRIVATE)) != 0 ) {
+		splx(spl);
+		return EINVAL;
+	}
+	if(len == 0 || len > USERTOP || offset < 0 || (offset & ~PAGE_FRAME) != 0) {
+		splx(spl);
+		return EINVAL;
+	}
+	shared = ((flags & MAP_SHARED) != 0);
+	perms = set_permissions((flags & PROT_READ) != 0, (flags & PROT_WRITE) != 0, (flags & PROT_EXEC) != 0);
+
+	/* Open the file. Shared writable mappings write to it */
+	kpath = kmalloc(PATH_MAX*sizeof(char));
+	if(kpath == NULL) {
+		splx(spl);
+		return ENOMEM;
+	}
+	err = copyinstr( (const_userptr_t)path, kpath, PATH_MAX, NULL );
+	if(err) {
+		kfree(kpath);
+		splx(spl);
+		return err;
+	}
+	err = vfs_open(kpath, (shared && is_writeable(perms)) ? O_RDWR : O_RDONLY, &v);
+	kfree(kpath);
+	if(err) {
+		splx(spl);
+		return err;
+	}
+
+	err = VOP_MMAP(v);
+	if(err) {
+		goto mmap_failed;
+	}
+	err = VOP_STAT(v, &st);
+	if(err) {
+		goto mmap_failed;
+	}
+
+	/* bytes of the mapping that come from the file */
+	filesize = 0;
+	if(offset < st.st_size) {
+		filesize = st.st_size - offset;
+		if(filesize > len) {
+			filesize = len;
 		}
 	}
-	else if(amount < 0)
-	{
-		/* Check to see if deallocation allows us to free a page */
-		vaddr_t new_heapend = old_heapend + amount;
-		size_t new_heapsize = ((new_heapend - heapstart + PAGE_SIZE-1) >> PAGE_OFFSET);
-		if(new_heapsize == old_heapsize) {
-			as->as_heapend += amount;
-			*retval = old_heapend;
-			lock_release(swap_lock);
+
+	/* Put the mapping in the highest gap that fits */
+	lock_acquire(as->as_lock);
+	err = region_findgap(as, len, &start);
+	if(err) {
+		lock_release(as->as_lock);
+		goto mmap_failed;
+	}
+	err = region_add(as, start, start + len, perms, &vm_filepager, VR_MMAP | (shared ? VR_SHARED : 0), &region);
+	if(err) {
+		lock_release(as->as_lock);
+		goto mmap_failed;
+	}
+	region_setfile(region, v, start, offset, filesize);
+	lock_release(as->as_lock);
+
+	/* the region has a reference of its own */
+	vfs_close(v);
+
+	*retval = start;
+	splx(spl);
+	return 0;
+
+mmap_failed:
+	vfs_close(v);
+	splx(spl);
+	return err;
+}
+
+
+/*
+ * System call for munmap.
+ * 
+ * Removes the mapping at addr. Dirty pages of a shared mapping are written back to the file first.
+ * Only whole mappings can be removed, so addr and len have to be the address and length of a
+ * mapping returned by mmap().
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	There is no mapping at addr, or it is not len bytes long
+ * ENOMEM	Out of memory while unsharing the page table after fork
+ * Any error of writing a dirty page back to the file, the mapping is left in place then
+ */
+int sys_munmap(vaddr_t addr, size_t len)
+{
+	int spl = splhigh();
+
+	int err;
+	struct vm_region *region;
+
+	struct addrspace *as = curthread->t_vmspace;
+	assert(as != NULL);
+	lock_acquire(as->as_lock);
+
+	region = region_find(as, addr);
+	if(region == NULL || !(region->vr_flags & VR_MMAP) || region->vr_start != addr || 
+		len == 0 || region->vr_end != ((addr + len + PAGE_SIZE - 1) & PAGE_FRAME)) {
+		lock_release(as->as_lock);
+		splx(spl);
+		return EINVAL;
+	}
+
+	/* 
+	 * Shared mappings write back what changed. If a page can't be written the mapping stays, with
+	 * the pages that failed still dirty, so their data isn't lost and a later munmap can try again.
+	 */
+	if(region->vr_flags & VR_SHARED) {
+		err = as_syncregion(as, region);
+		if(err) {
+			lock_release(as->as_lock);
 			splx(spl);
-			return 0;
+			return err;
 		}
-		else
-		{
-			size_t num_pages_dealloc = old_heapsize - new_heapsize;
+	}
 
-			for(i=0; i<num_pages_dealloc; i++) {
-				vaddr = ((old_heapend - i*PAGE_SIZE) & PAGE_FRAME);
-				new_entry = pt_get(as->as_pagetable, vaddr);
+	err = as_removeregion(as, region);
 
-				if(new_entry == NULL) {
-					continue;
-				}
+	lock_release(as->as_lock);
+	splx(spl);
+	return err;
+}
 
-				free_upage(new_entry);
-				pt_remove(as->as_pagetable, vaddr);
-			}
+/*
+ * System call for shmget.
+ * 
+ * Returns the id of the shared memory segment with the given key, creating it if IPC_CREAT is in
+ * flags. IPC_PRIVATE always creates a new segment, which can only be found through its id. A new
+ * segment is size bytes long and reads as zeros. An existing one has to be at least size bytes.
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EEXIST	IPC_CREAT and IPC_EXCL are set, and the segment exists
+ * ENOENT	There is no segment with the key, and IPC_CREAT is not set
+ * EINVAL	size is 0 or too big for a new segment, or bigger than the existing segment
+ * ENOSPC	All segments are in use
+ * ENOMEM	Out of memory
+ */
+int sys_shmget(int key, size_t size, int flags, int32_t *retval)
+{
+	int err, id;
 
-			as->as_heapend += amount;
-			*retval = old_heapend;
-			lock_release(swap_lock);
-			splx(spl);
-			return 0;
+	if( (flags & ~(IPC_CREAT | IPC_EXCL)) != 0 ) {
+		return EINVAL;
+	}
+
+	err = shm_get(key, size, flags, &id);
+	if(err) {
+		return err;
+	}
+
+	*retval = id;
+	return 0;
+}
+
+
+/*
+ * System call for shmat.
+ * 
+ * Attaches the segment shmid to the address space and returns the address it is at. If addr is
+ * not NULL the segment goes there, otherwise in the highest gap that fits. With SHM_RDONLY the
+ * segment can only be read. A fork attaches the child as well.
+ * 
+ * Returns:
+ * 		1. retval returns the address of the segment, MAP_FAILED if failed
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	There is no segment shmid, addr is not page aligned or overlaps a region, or flags are invalid
+ * ENOMEM	There is no room in the address space for the segment
+ */
+int sys_shmat(int shmid, vaddr_t addr, int flags, int32_t *retval)
+{
+	int spl = splhigh();
+
+	int err;
+	size_t len;
+	struct shm_segment *seg;
+	struct vm_region *region;
+
+	struct addrspace *as = curthread->t_vmspace;
+	assert(as != NULL);
+
+	*retval = (int32_t)MAP_FAILED;
+
+	if( (flags & ~SHM_RDONLY) != 0 || (addr & ~PAGE_FRAME) != 0 ) {
+		splx(spl);
+		return EINVAL;
+	}
+
+	seg = shm_attach(shmid);
+	if(seg == NULL) {
+		splx(spl);
+		return EINVAL;
+	}
+	len = seg->shm_npages * PAGE_SIZE;
+
+	lock_acquire(as->as_lock);
+	if(addr == 0) {
+		err = region_findgap(as, len, &addr);
+		if(err) {
+			goto shmat_failed;
 		}
 	}
-	panic("Should not reach here");
+	else if(addr + len < addr) {
+		err = EINVAL;
+		goto shmat_failed;
+	}
+
+	/* Writers share the pages in place, readers just see them */
+	if(flags & SHM_RDONLY) {
+		err = region_add(as, addr, addr + len, set_permissions(1, 0, 0), &vm_shmpager, 0, &region);
+	}
+	else {
+		err = region_add(as, addr, addr + len, set_permissions(1, 1, 0), &vm_shmpager, VR_SHARED, &region);
+	}
+	if(err) {
+		goto shmat_failed;
+	}
+	region->vr_shm = seg;
+	lock_release(as->as_lock);
+
+	*retval = addr;
+	splx(spl);
+	return 0;
+
+shmat_failed:
+	lock_release(as->as_lock);
+	shm_detach(seg);
+	splx(spl);
+	return err;
+}
+
+
+/*
+ * System call for shmdt.
+ * 
+ * Detaches the segment attached at addr. The segment and its contents go away with the last
+ * process that has it attached, see also shmctl.
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	No segment is attached at addr
+ * ENOMEM	Out of memory while unsharing the page table after fork
+ */
+int sys_shmdt(vaddr_t addr)
+{
+	int spl = splhigh();
+
+	int err;
+	struct vm_region *region;
+
+	struct addrspace *as = curthread->t_vmspace;
+	assert(as != NULL);
+	lock_acquire(as->as_lock);
+
+	region = region_find(as, addr);
+	if(region == NULL || region->vr_pager != &vm_shmpager || region->vr_start != addr) {
+		lock_release(as->as_lock);
+		splx(spl);
+		return EINVAL;
+	}
+
+	err = as_removeregion(as, region);
+
+	lock_release(as->as_lock);
+	splx(spl);
+	return err;
+}
+
+/*
+ * System call for shmctl.
+ * 
+ * Only IPC_RMID, which removes the segment shmid. Its id and key can't be used to find it any
+ * more and may be given to a new segment. The segment itself goes away right now if nobody has it
+ * attached, or else with the last process that detaches.
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	There is no segment shmid, or cmd is not IPC_RMID
+ */
+int sys_shmctl(int shmid, int cmd)
+{
+	if(cmd != IPC_RMID) {
+		return EINVAL;
+	}
+	return shm_remove(shmid);
+}
+
+/*
+ * System call for pagesend.
+ * 
+ * Moves the pages at [addr, addr+len) to the process pid, which takes them with pagerecv().
+ * Waits until pid is ready to receive. Nothing is copied, the pages themselves change hands,
+ * and the range reads as zeros here afterwards. addr and len have to be page aligned, and the
+ * range has to be anonymous writable memory (heap or stack).
+ * 
+ * Returns:
+ * 		1. retval returns the number of bytes moved, which is less than len if the receiver asked for less
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	addr or len is not page aligned, len is 0, pid is the caller, or pid does not exist or
+ * 			exited while we waited
+ * EFAULT	The range is not anonymous writable memory
+ * ENOMEM	Out of memory before the first page moved
+ */
+int sys_pagesend(pid_t pid, vaddr_t addr, size_t len, int32_t *retval)
+{
+	int err;
+	size_t moved;
+
+	err = pagexfer_send(pid, addr, len, &moved);
+	if(err) {
+		return err;
+	}
+
+	*retval = moved;
+	return 0;
+}
+
+
+/*
+ * System call for pagerecv.
+ * 
+ * Waits for another process to pagesend() to us, and takes its pages at [addr, addr+len). What
+ * was mapped there before is freed. addr and len have to be page aligned, and the range has to be
+ * anonymous writable memory (heap or stack).
+ * 
+ * Returns:
+ * 		1. retval returns the number of bytes received, which is less than len if the sender sent less
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	addr or len is not page aligned, or len is 0
+ * EFAULT	The range is not anonymous writable memory
+ * ENOMEM	Out of memory before the first page moved
+ */
+int sys_pagerecv(vaddr_t addr, size_t len, int32_t *retval)
+{
+	int err;
+	size_t moved;
+
+	err = pagexfer_recv(addr, len, &moved);
+	if(err) {
+		return err;
+	}
+
+	*retval = moved;
+	return 0;
+}
+
+/*
+ * System call for futex_wait.
+ * 
+ * Sleeps until somebody calls futex_wake() on addr, if the word at addr still holds val. The
+ * check and going to sleep are atomic, so a wakeup can't get lost in between. The caller may be
+ * woken without a futex_wake(), and has to look at the word again either way.
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EAGAIN	The word does not hold val
+ * EINVAL	addr is not word aligned
+ * EFAULT	addr is an invalid pointer
+ */
+int sys_futex_wait(vaddr_t addr, int val)
+{
+	return futex_wait(addr, val);
+}
+
+
+/*
+ * System call for futex_wake.
+ * 
+ * Wakes up to n processes sleeping in futex_wait() on the word at addr. Processes that map the
+ * same page somewhere else are woken as well.
+ * 
+ * Returns:
+ * 		1. retval returns the number of processes woken
+ * 		2. function returns errno to be handled by mips_syscall()
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	addr is not word aligned
+ * EFAULT	addr is an invalid pointer
+ */
+int sys_futex_wake(vaddr_t addr, int n, int32_t *retval)
+{
+	int err, woken;
+
+	err = futex_wake(addr, n, &woken);
+	if(err) {
+		return err;
+	}
+
+	*retval = woken;
+	return 0;
+}
+
+
+/*
+ * System call for __ras. libc calls this before its first atomic operation.
+ * 
+ * Registers the restartable atomic sequence of the program, the code at [start, end). A process
+ * that is interrupted or faults inside the sequence goes back to its start, so the sequence runs
+ * as if nothing else ran in between. This is how user level code gets atomic operations without
+ * turning interrupts off. The sequence may end with a store, but may not store anything before.
+ * It is inherited by fork and forgotten by execv.
+ * 
+ * Valid Error codes to be returned:
+ * 
+ * EINVAL	start and end are not a short range of user addresses
+ */
+int sys___ras(vaddr_t start, vaddr_t end)
+{
+	struct addrspace *as = curthread->t_vmspace;
+	assert(as != NULL);
+
+	if(start >= end || end > USERTOP || end - start > PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	as->as_ras_start = start;
+	as->as_ras_end = end;
 	return 0;
 }
 
@@ -15,7 +15,6 @@
 #include <synch.h>
 #include <machine/spl.h>
 #include <pagetable.h>
-#include <bitmap.h>
 #include <permissions.h>
 #include <vm_features.h>
 #include <curthread.h>
@@ -25,44 +24,38 @@
 #include <elf.h>
 #include <vfs.h>
 #include <swap.h>
+#include <region.h>
 
 
-/* current active address space id */
-static asid_t curaddrspace;
-
-/* flag to indicate whether or not to check we should be checking for specific asids */
-static int curaddrspace_flag = 0;
-
-/* bitmap for maintaining ASIDs */
-static struct bitmap *as_bitmap;
-
-/* synchronization primitive for the asid bitmap */
-static struct semaphore *as_bitmap_mutex = NULL;
+/*
+ * ASID allocation.
+ * ASIDs are handed out in order from 1 to NUM_ASID-1 and never returned. Every address space
+ * remembers the generation its ASID came from. When we run out, the generation is bumped and the
+ * TLB flushed, which invalidates all handed out ASIDs at once; address spaces from an old generation
+ * get a fresh ASID the next time they are activated. ASID 0 is left for when ASIDs are disabled.
+ */
+static u_int32_t as_asid_generation = 1;
+static asid_t as_asid_next = 1;
 
 
 /* 
- * Create the addrspace ASID bitmap 
+ * Initialize ASID allocation
  */
 void
-as_bitmap_bootstrap(void){
-	as_bitmap =  bitmap_create((u_int32_t)NUM_ASID);	
-	as_bitmap_mutex = sem_create("as bitmap mutex", 1);
-	if(as_bitmap == NULL || as_bitmap_mutex == NULL) {
-		panic("Address space bitmap could not be initialized");
-	} 
+as_asid_bootstrap(void){
+	as_asid_generation = 1;
+	as_asid_next = 1;
+	TLB_SetAsid(0);
 }
 
 
 /*
  * Initializes the datastructures for the addrspace
- * The regions as well as the actual page table
+ * The actual page table. There are no regions until the program is loaded
  */
 struct addrspace *
 as_create(void)
 {
-	int err;
-	u_int32_t index;
-
 	/* A little bit redundant but the readability is worth it I think */
 	struct addrspace *as = (struct addrspace *)kmalloc(sizeof(struct addrspace));
 	if (as==NULL) {
@@ -75,52 +68,27 @@ as_create(void)
 		return NULL;
 	}
 
-	as->as_code = (struct as_region *)kmalloc(sizeof(struct as_region));
-	if(as->as_code == NULL) {
+	as->as_lock = lock_create("as_lock");
+	if(as->as_lock == NULL) {
 		pt_destroy(as->as_pagetable);
 		kfree(as);
 		return NULL;
 	}
 
-	as->as_data = (struct as_region *)kmalloc(sizeof(struct as_region));
-	if(as->as_data == NULL) {
-		kfree(as->as_code);
-		pt_destroy(as->as_pagetable);
-		kfree(as);
-		return NULL;
-	}
+	/* No ASID yet, one is assigned when the addrspace is first activated */
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
 
-	/* Attempt to get an available asid. If possible. */
-	if(TLB_ASID_ENABLE) {
-		P(as_bitmap_mutex);
-		err = bitmap_alloc(as_bitmap, &index);
-		if(err){
-			as->as_asid = NUM_ASID; /* Set to invalid asid just in case */
-			as->as_asid_set = 0;	
-		}
-		else {
-			as->as_asid = index;
-			as->as_asid_set = 1;
-		}
-		V(as_bitmap_mutex);
-	}
-	else {
-		as->as_asid = NUM_ASID; /* Set to invalid asid just in case */
-		as->as_asid_set = 0;	
-	}
-
-	/* Initialize everything */
-	as->as_code->vbase = 0;
-	as->as_code->npages = 0;
-	as->as_code->permissions = set_permissions(0, 0, 0);
-
-	as->as_data->vbase = 0;
-	as->as_data->npages = 0;
-	as->as_data->permissions = set_permissions(0, 0, 0);
-
-	as->as_heapstart = 0;
+	/* Initialize everything, the region array is allocated with the first region */
+	as->as_regions = NULL;
+	as->as_nregions = 0;
+	as->as_maxregions = 0;
+	as->as_heap = NULL;
 	as->as_heapend = 0;
-	as->as_stackptr = 0;
+	as->as_commit = 0;
+	as->as_heaplimit = HEAP_LIMIT_DEFAULT;
+	as->as_ras_start = 0;
+	as->as_ras_end = 0;
 
 	return as;
 }
@@ -128,35 +96,42 @@ as_create(void)
 
 /*
  * Destroy address space
- * pt_destroy() handles destroying all the pte's
+ * pt_destroy() handles destroying all the pte's. Shared mappings are written back first, and the
+ * regions go last, since pages of shared mappings rely on the region's reference to their file.
  */
 void
 as_destroy(struct addrspace *as)
 {
 	assert(as!=NULL);
 
+	int r;
 	int spl = splhigh();
 
-	int lock_held_prior = lock_do_i_hold(swap_lock);
-	lock_acquire(swap_lock);
+	/* Drop the TLB entries tagged with our ASID, it may still be current if we are exiting */
+	if(TLB_ASID_ENABLE && as->as_asid_gen == as_asid_generation) {
+		TLB_InvalidateAsid(as->as_asid);
+	}
 
-	/* Give up the addrspace id */
-	if(TLB_ASID_ENABLE) {
-		P(as_bitmap_mutex);
-		if(as->as_asid_set) {
-			bitmap_unmark(as_bitmap, as->as_asid);
+	for(r=0; r<as->as_nregions; r++) {
+		if((as->as_regions[r]->vr_flags & VR_SHARED) && as->as_regions[r]->vr_file != NULL) {
+			as_syncregion(as, as->as_regions[r]);
 		}
-		V(as_bitmap_mutex);
 	}
 
-	kfree(as->as_code);
-	kfree(as->as_data);
+	/* Stop the UTLB miss handler from walking the page table we are about to free */
+	if(TLB_GetPagetable() == as->as_pagetable) {
+		TLB_SetPagetable(NULL);
+	}
+
 	pt_destroy(as->as_pagetable);
+	region_destroyall(as);
+	swap_uncommit(as->as_commit);
+	if(as->as_regions != NULL) {
+		kfree(as->as_regions);
+	}
+	lock_destroy(as->as_lock);
 	kfree(as);
 
-	if(!lock_held_prior) {
-		lock_release(swap_lock);
-	}
 	splx(spl);
 }
 
@@ -180,77 +155,65 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	int err; //int idx;
 	vaddr_t vaddr;
+	struct pt_iter old_it, new_it;
+	struct vm_region *region;
 	int spl = splhigh();
 
-	assert(lock_do_i_hold(swap_lock));
-	//lock_acquire(swap_lock);
+	assert(lock_do_i_hold(old->as_lock));
 
 	/* Allocate space for new addrspace */
 	struct addrspace *new;
 	new = as_create();
 	if (new==NULL) {
-		//lock_release(swap_lock);
 		splx(spl);
 		return ENOMEM;
 	}
 
-	/* Copy over virtual address fields */
-	new->as_code->vbase = old->as_code->vbase;
-	new->as_code->npages = old->as_code->npages;
-	new->as_code->permissions = old->as_code->permissions;
-	new->as_code->file = old->as_code->file;
-	new->as_code->uio = old->as_code->uio;
-
-	new->as_data->vbase = old->as_data->vbase;
-	new->as_data->npages = old->as_data->npages;
-	new->as_data->permissions = old->as_data->permissions;
-	new->as_data->file = old->as_data->file;
-	new->as_data->uio = old->as_data->uio;
-
-	new->as_heapstart = old->as_heapstart;
+	/* Copy over the regions */
+	err = region_copyall(old, new);
+	if(err) {
+		as_destroy(new);
+		splx(spl);
+		return err;
+	}
 	new->as_heapend = old->as_heapend;
-	new->as_stackptr = old->as_stackptr;
+	new->as_heaplimit = old->as_heaplimit;
+	new->as_ras_start = old->as_ras_start;
+	new->as_ras_end = old->as_ras_end;
+
+	/* The child's heap is as big as ours, under the strict policy it may not fit */
+	err = swap_commit(old->as_commit);
+	if(err) {
+		as_destroy(new);
+		splx(spl);
+		return err;
+	}
+	new->as_commit = old->as_commit;
 
 
 	if(COPY_ON_WRITE_ENABLE && SWAPPING_ENABLE) {
-		/* Copy the page table shallow. They share the same page table entries! */
+		/* 
+		 * Copy the page table shallow. The two page tables share their leaves, so this only costs as much
+		 * as the directories. A leaf is copied when either side first writes to a page in it, and the
+		 * pages themselves are copied by vm_fault after that.
+		 */
 		err = pt_copy_shallow(old->as_pagetable, new->as_pagetable);
 		if(err) {
 			as_destroy(new);
-			//lock_release(swap_lock);
 			splx(spl);
 			return err;
 		}
 
-		vaddr = 0;
-		while(1) {
-			/* Should never be a page with vaddr_t 0 */
-			vaddr = pt_getnext(new->as_pagetable, vaddr);
-			if(vaddr==0) {
-				break; /* Been through all the pages */
-			}
-			assert(vaddr < USERTOP); /* Should not ever go over user virtual address space */
-
-			/* Get PTE from old as and new as */
-			struct pte *old_entry = pt_get(old->as_pagetable, vaddr);
-			struct pte *new_entry = pt_get(new->as_pagetable, vaddr);
-			assert(old_entry == new_entry); /* sanity check that shallow copy worked */
-
-			/* This is all we have to do. Let vm_fault do the work */
-			old_entry->num_sharers += 1;
-
-			// /* Lets update TLB entries here properly, all current TLB entries should be dirty=0 so we can catch readonly faults */
-			// if(old_entry->swap_state != PTE_SWAPPED) {
-			// 	assert(old_entry->swap_state != PTE_NONE);
-			// 	idx = TLB_FindEntry(old_entry->ppageaddr);
-			// 	if(idx >= 0) {
-			// 		TLB_WriteDirty(idx, 0);
-			// 	}
-			// }
+		/* 
+		 * The only writable TLB entries for these pages belong to the old addrspace. Write protect them so
+		 * we catch the writes on readonly faults, the translations stay valid for reads.
+		 */
+		if(!TLB_ASID_ENABLE) {
+			TLB_WriteProtectAsid(TLB_GetAsid());
+		}
+		else if(old->as_asid_gen == as_asid_generation) {
+			TLB_WriteProtectAsid(old->as_asid);
 		}
-
-		/* We have to shoot down all pages to make sure that we can catch those write on readonly faults! */
-		TLB_Flush();
 	}
 	else {
 
@@ -262,25 +225,21 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		err = pt_copy(old->as_pagetable, new->as_pagetable);
 		if(err) {
 			as_destroy(new);
-			//lock_release(swap_lock);
 			splx(spl);
 			return ENOMEM;
 		}
 
-		/* Set every single virtual address mapping to 0, this will change when we do copy on write */
-		vaddr = 0;
-		while(1) {
-			/* Should never be a page with vaddr_t 0 */
-			vaddr = pt_getnext(new->as_pagetable, vaddr);
-			if(vaddr==0) {
-				break; /* Been through all the pages */
-			}
-			assert(vaddr < USERTOP); /* Should not ever go over user virtual address space */
+		/* 
+		 * Set every single virtual address mapping to 0, this will change when we do copy on write.
+		 * File pages that were dropped stay dropped, the copy reads them from the file like we would.
+		 */
+		for(pt_iter_begin(new->as_pagetable, &new_it); pt_iter_vaddr(&new_it) != 0; pt_iter_next(&new_it)) {
+			assert(pt_iter_vaddr(&new_it) < USERTOP); /* Should not ever go over user virtual address space */
 
 			/* Initialize all the pages */
-			struct pte *entry = pt_get(new->as_pagetable, vaddr);
-			entry->ppageaddr = 0;
-			entry->swap_state = PTE_NONE;
+			struct pte *entry = pt_iter_pte(&new_it);
+			PTE_SET_PADDR(entry, 0);
+			PTE_SET_STATE(entry, PTE_NONE);
 			entry->swap_location = 0;
 		}
 
@@ -288,114 +247,114 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		* Allocate a new physical page for every virtual page in the page table
 		* This will be deprecated later when we do copy on write!
 		*/
-		vaddr = 0;
-		while(1) {
-			/* Should never be a page with vaddr_t 0 */
-			vaddr = pt_getnext(new->as_pagetable, vaddr);
-			if(vaddr==0) {
-				break; /* Been through all the pages */
-			}
+		pt_iter_begin(old->as_pagetable, &old_it);
+		pt_iter_begin(new->as_pagetable, &new_it);
+		for(; (vaddr = pt_iter_vaddr(&new_it)) != 0; pt_iter_next(&old_it), pt_iter_next(&new_it)) {
 			assert(vaddr < USERTOP); /* Should not ever go over user virtual address space */
 
-			/* Get PTE from old as and new as */
-			struct pte *old_entry = pt_get(old->as_pagetable, vaddr);
-			struct pte *new_entry = pt_get(new->as_pagetable, vaddr);
+			/* Both tables map the same pages, so the two walks stay in step */
+			assert(pt_iter_vaddr(&old_it) == vaddr);
+			struct pte *old_entry = pt_iter_pte(&old_it);
+			struct pte *new_entry = pt_iter_pte(&new_it);
+
+			/* Shared memory is not copied, the child maps the pages of the segment on its first fault */
+			region = region_find(new, vaddr);
+			if(region != NULL && region->vr_pager == &vm_shmpager) {
+				pt_iter_remove(&new_it);
+				continue;
+			}
+
+			if(PTE_STATE(old_entry) == PTE_NONE) {
+				continue;
+			}
+
+			/* The copy is an anonymous page */
+			new_entry->pte_word &= ~PTE_FILE;
 			
 
 			if(SWAPPING_ENABLE) 
 			{
 				/* If the old page is not present, we have to swap it in */
-				if(old_entry->swap_state == PTE_SWAPPED) {
+				while(PTE_STATE(old_entry) == PTE_SWAPPED) {
 					err = swap_pagein(old_entry);
+					if(err == EAGAIN) {
+						continue;
+					}
 					if(err) {
 						as_destroy(new);
-						//lock_release(swap_lock);
 						splx(spl);
 						return err;
 					}
 				}
 
 				/* Check if we can get a physical page. If we do we use memmove */
-				new_entry->ppageaddr = get_ppages(1, 0, new_entry);
-				if(new_entry->ppageaddr != 0) {
+				PTE_SET_PADDR(new_entry, get_ppages(1, 0, new_entry));
+				if(PTE_PADDR(new_entry) != 0) {
 					/* Move from one physical page to another */
-					memmove((void *)PADDR_TO_KVADDR(new_entry->ppageaddr),
-							(const void *)PADDR_TO_KVADDR(old_entry->ppageaddr), 
+					memmove((void *)PADDR_TO_KVADDR(PTE_PADDR(new_entry)),
+							(const void *)PADDR_TO_KVADDR(PTE_PADDR(old_entry)), 
 							PAGE_SIZE);
-					new_entry->swap_state = PTE_PRESENT;
+					PTE_SET_STATE(new_entry, PTE_PRESENT);
 					new_entry->swap_location = 0;
+					coremap_busy_unmark(PTE_PADDR(new_entry));
 				}
 				else {
-					/* Allocate swap space, and use swap_write to copy */
-					err = swap_allocpage_od(new_entry);
+					/* No frame, the copy goes straight to a swap slot of its own */
+					err = swap_diskalloc(&new_entry->swap_location);
 					if(err) {
 						as_destroy(new);
-						//lock_release(swap_lock);
 						splx(spl);
 						return err;
 					}
-					/* Now copy from old entry to swap file */
-					err = swap_write(new_entry->swap_location, old_entry->ppageaddr);
+					PTE_SET_STATE(new_entry, PTE_SWAPPED);
+					err = swap_write(new_entry->swap_location, PTE_PADDR(old_entry));
 					if(err) {
 						as_destroy(new);
-						//lock_release(swap_lock);
 						splx(spl);
 						return err;
 					}
 				}
 
 				/* Update permissions */
-				if( is_vaddrcode(new, vaddr) )
-					new_entry->permissions = new->as_code->permissions;
-				else if( is_vaddrdata(new, vaddr) )
-					new_entry->permissions = new->as_data->permissions;
-				else if( is_vaddrheap(new, vaddr) )
-					new_entry->permissions = set_permissions(1, 1, 0); /* Heap permissions */
-				else if( is_vaddrstack(new, vaddr) )
-					new_entry->permissions = set_permissions(1, 1, 0); /* Stack permissions */
-				else {
+				region = region_find(new, vaddr);
+				if(region == NULL) {
 					panic("Unknown region. Memory is not managed properly.");
 				}
+				PTE_SET_PERMS(new_entry, region->vr_perms);
 			}
 			else
 			{
 				/* Allocate a page */
 				alloc_upage(new_entry);		/* ask for 1 user-page */
 
-				if(new_entry->ppageaddr == 0) {
+				if(PTE_PADDR(new_entry) == 0) {
 					as_destroy(new);
 					splx(spl);
 					return ENOMEM;
 				}
 				/* Update permissions */
-				if( is_vaddrcode(new, vaddr) )
-					new_entry->permissions = new->as_code->permissions;
-				else if( is_vaddrdata(new, vaddr) )
-					new_entry->permissions = new->as_data->permissions;
-				else if( is_vaddrheap(new, vaddr) )
-					new_entry->permissions = set_permissions(1, 1, 0); /* Heap permissions */
-				else if( is_vaddrstack(new, vaddr) )
-					new_entry->permissions = set_permissions(1, 1, 0); /* Stack permissions */
-				else {
+				region = region_find(new, vaddr);
+				if(region == NULL) {
 					panic("Unknown region. Memory is not managed properly.");
 				}
-				new_entry->swap_state = PTE_PRESENT;
+				PTE_SET_PERMS(new_entry, region->vr_perms);
+				PTE_SET_STATE(new_entry, PTE_PRESENT);
 				new_entry->swap_location = 0;
 
 				/*
 				* Copy contents of all pages
 				* We do this by converting all physical pages to kernel addresses, then using memmove()
 				*/
-				memmove((void *)PADDR_TO_KVADDR(new_entry->ppageaddr),
-						(const void *)PADDR_TO_KVADDR(old_entry->ppageaddr), 
+				memmove((void *)PADDR_TO_KVADDR(PTE_PADDR(new_entry)),
+						(const void *)PADDR_TO_KVADDR(PTE_PADDR(old_entry)), 
 						PAGE_SIZE);
 					
-				assert(old_entry->ppageaddr != new_entry->ppageaddr);
+				assert(PTE_PADDR(old_entry) != PTE_PADDR(new_entry));
+				coremap_busy_unmark(PTE_PADDR(new_entry));
 			}
 		}
 	}
 
-	//lock_release(swap_lock);
 	*ret = new;
 	splx(spl);
 	return 0;
@@ -422,8 +381,7 @@ as_prepare_load(struct addrspace *as)
 	}
 	else {
 		/* Do a sanity check */
-		assert(as->as_code->npages != 0);
-		assert(as->as_code->vbase != 0);
+		assert(as->as_nregions != 0);
 
 		int spl = splhigh();
 
@@ -431,69 +389,41 @@ as_prepare_load(struct addrspace *as)
 		* We have to allocate memory for code and data segments
 		* Do this by adding entries into the page table
 		*/
-		unsigned i;
-		struct pte *entry;
+		int r;
 		vaddr_t vpageaddr;
+		struct pte *entry;
+		struct vm_region *region;
 
-		/* Code segment */
-		for(i=0; i<as->as_code->npages; i++) {	
-			lock_acquire(swap_lock);
+		for(r=0; r<as->as_nregions; r++) {
+			region = as->as_regions[r];
 
-			entry = pte_init();
-			if(entry == NULL) {
-				splx(spl);
-				return ENOMEM;
-			}
-			vpageaddr = (as->as_code->vbase + (i*PAGE_SIZE));
-
-			alloc_upage(entry);
-			if(entry->ppageaddr == 0) {
-				pte_destroy(entry);
-				lock_release(swap_lock);
-				splx(spl);
-				return ENOMEM;
-			}
+			for(vpageaddr=region->vr_start; vpageaddr<region->vr_end; vpageaddr+=PAGE_SIZE) {	
+				lock_acquire(as->as_lock);
 
-			/* entry->ppageaddr is updated by alloc_upage */
-			entry->permissions = set_permissions(1, 1, 1); /* RWX */
-			entry->swap_state = PTE_PRESENT;
-			entry->swap_location = 0;
+				entry = pt_alloc(as->as_pagetable, vpageaddr);
+				if(entry == NULL) {
+					lock_release(as->as_lock);
+					splx(spl);
+					return ENOMEM;
+				}
 
-			/* add entry to page table */
-			pt_add(as->as_pagetable, vpageaddr, entry);
+				alloc_upage(entry);
+				if(PTE_PADDR(entry) == 0) {
+					pt_remove(as->as_pagetable, vpageaddr);
+					lock_release(as->as_lock);
+					splx(spl);
+					return ENOMEM;
+				}
 
-			lock_release(swap_lock);
-		}
+				/* the frame is filled in by alloc_upage */
+				PTE_SET_PERMS(entry, set_permissions(1, 1, 1)); /* RWX */
+				PTE_SET_STATE(entry, PTE_PRESENT);
+				entry->swap_location = 0;
 
-		/* Data segment */
-		for(i=0; i<as->as_data->npages; i++) {
-			lock_acquire(swap_lock);
+				coremap_busy_unmark(PTE_PADDR(entry));
 
-			entry = pte_init();
-			if(entry == NULL) {
-				lock_release(swap_lock);
-				splx(spl);
-				return ENOMEM;
-			}
-			vpageaddr = (as->as_data->vbase + (i*PAGE_SIZE));
-
-			alloc_upage(entry);
-			if(entry->ppageaddr == 0) {
-				pte_destroy(entry);
-				lock_release(swap_lock);
-				splx(spl);
-				return ENOMEM;
+				lock_release(as->as_lock);
 			}
-
-			/* entry->ppageaddr is updated by alloc_upage */
-			entry->permissions = set_permissions(1, 1, 1); /* RWX */
-			entry->swap_state = PTE_PRESENT;
-			entry->swap_location = 0;
-
-			/* add entry to page table */
-			pt_add(as->as_pagetable, vpageaddr, entry);
-
-			lock_release(swap_lock);
 		}
 
 		splx(spl);
@@ -506,70 +436,62 @@ as_prepare_load(struct addrspace *as)
  * as_activate()
  * 
  * DUMBVM does this by flushing the entire TLB. This actually makes the context switch slow.
- * A better way is to not flush the TLB, but have address space ID's that identify each address space 
- * accompanied by a global variable that lets the kernel know what is the current address space, and what
- * TLB entries to look at upon a fault.
+ * With TLB_ASID_ENABLE, every TLB entry is tagged with the ASID of its address space and the hardware
+ * only matches entries of the current ASID, so switching is just a matter of loading the new ASID.
+ * Entries of other address spaces stay in the TLB for when they run again.
  * 
- * To be very careful, if we ever have to deal with addrspaces that were not allocated an ID we flush
- * Duplicate entries in the TLB is a fatal fault.
- * 
- * This is untested. If it doesn't work, just switch to the default of invalidating everything
+ * An address space whose ASID is from an old generation (or that never had one) gets a new ASID here.
+ * If there are none left, we start a new generation and flush the TLB, as stale entries for recycled
+ * ASIDs would otherwise match.
  */
 void
 as_activate(struct addrspace *as)
 {
-	int i, spl;
+	int spl;
 
-	/* This area is critical as we are handling tlb as well as writing to curaddrspace globals */
+	/* This area is critical as we are handling tlb as well as writing to the asid globals */
 	spl = splhigh();
 
-	/* set the uio */
-	if(LOAD_ON_DEMAND_ENABLE) {
-		(as->as_code->uio).uio_space = curthread->t_vmspace;
-		(as->as_data->uio).uio_space = curthread->t_vmspace;
-	}
-
 	if(!TLB_ASID_ENABLE) {
 		TLB_Flush();
 	}
 	else {
-		/* Handle all 4 cases, curaddrspace_flag lets us know if the previous addrspace had an ID or not */
-		if(curaddrspace_flag){
-			if(as->as_asid_set) {
-				curaddrspace = as->as_asid;
-				curaddrspace_flag = 1;
-				/* Invalidate all TLB entries by setting their valid bits to 0 */
-				for(i=0; i<NUM_TLB; i++) {
-					u_int32_t asid = TLB_ReadAsid(i);
-					if(asid != curaddrspace) {
-						TLB_WriteValid(i, 0); /* Set valid bit to 0 */
-					}
-					else {
-						TLB_WriteValid(i, 1); /* Entry belongs to us, set valid bit to 1 */
-					}
-				}
-			}
-			else {
-				curaddrspace = NUM_ASID; /* Set to invalid id just in case */
-				curaddrspace_flag = 0;	 /* Current address space doesn't have an ID */
-				/* Flush the TLB, can't risk duplicate entries in the TLB */
-				TLB_Flush();
-			}
-		}
-		else{
-			if(as->as_asid_set) {
-				curaddrspace = as->as_asid;
-				curaddrspace_flag = 1;
-				/* Even tho this addrspace has an ID, we can't risk duplicate entries from before, so flush */
-				TLB_Flush();
-			}
-			else {
-				curaddrspace = NUM_ASID; /* Set to invalid id just in case */
-				curaddrspace_flag = 0;	 /* Current address space doesn't have an ID */
-				/* Flush the TLB, can't risk duplicate entries in the TLB */
+		if(as->as_asid_gen != as_asid_generation) {
+			if(as_asid_next >= NUM_ASID) {
+				/* Out of ASIDs, recycle all of them */
+				as_asid_generation++;
+				as_asid_next = 1;
 				TLB_Flush();
 			}
+			as->as_asid = as_asid_next++;
+			as->as_asid_gen = as_asid_generation;
 		}
+		TLB_SetAsid(as->as_asid);
+	}
+
+	if(TLB_REFILL_WALK_ENABLE) {
+		TLB_SetPagetable(as->as_pagetable);
+	}
+
+	splx(spl);
+}
+
+/*
+ * as_invalidatevaddr()
+ * Shoot down the translation of vaddr in as, which need not be the running addrspace. Without
+ * ASIDs the TLB only holds entries of the running one, and an addrspace whose ASID is from an
+ * older generation has none left.
+ */
+void
+as_invalidatevaddr(struct addrspace *as, vaddr_t vaddr)
+{
+	int spl = splhigh();
+
+	if(as == curthread->t_vmspace) {
+		TLB_InvalidateVaddr(vaddr);
+	}
+	else if(TLB_ASID_ENABLE && as->as_asid_gen == as_asid_generation) {
+		TLB_InvalidateVaddrAsid(vaddr, as->as_asid);
 	}
 
 	splx(spl);
@@ -582,41 +504,22 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment.
+ *
+ * Segments are file backed regions. load_segment_od() tells the region which part of the
+ * executable it comes from.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	size_t npages; 
-
-	/* Align the region. First, the base... */
-	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
-
-	/* ...and now the length. */
-	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
-
-	npages = sz / PAGE_SIZE;
-
-	if(as->as_code->vbase == 0){
-		as->as_code->vbase = vaddr;
-		as->as_code->npages = npages;
-		as->as_code->permissions = set_permissions(readable, writeable, executable);
-		return 0;		
-	}
-
-	if(as->as_data->vbase == 0){
-		as->as_data->vbase = vaddr;
-		as->as_data->npages = npages;
-		as->as_data->permissions = set_permissions(readable, writeable, executable);
-		return 0;		
+	/* region_add() aligns the region */
+	if(sz == 0 || vaddr + sz < vaddr) {
+		return EINVAL;
 	}
 
-	panic("Too many regions! Not supported");
-	return 0;
+	return region_add(as, vaddr, vaddr + sz, set_permissions(readable, writeable, executable), 
+						&vm_filepager, VR_IMAGE, NULL);
 }
 
 
@@ -632,22 +535,17 @@ as_complete_load(struct addrspace *as)
 		return 0;
 	}
 	else {
-		unsigned i;
+		int r;
 		struct pte *entry;
 		vaddr_t addr;
+		struct vm_region *region;
 
-		/* Code segment */
-		for(i=0; i<as->as_code->npages; i++) {
-			addr = (as->as_code->vbase + (i*PAGE_SIZE)); 
-			entry = pt_get(as->as_pagetable, addr);
-			entry->permissions = as->as_code->permissions;
-		}
-
-		/* Data segment */
-		for(i=0; i<as->as_data->npages; i++) {
-			addr = (as->as_data->vbase + (i*PAGE_SIZE)); 
-			entry = pt_get(as->as_pagetable, addr);
-			entry->permissions = as->as_data->permissions;
+		for(r=0; r<as->as_nregions; r++) {
+			region = as->as_regions[r];
+			for(addr=region->vr_start; addr<region->vr_end; addr+=PAGE_SIZE) {
+				entry = pt_get(as->as_pagetable, addr);
+				PTE_SET_PERMS(entry, region->vr_perms);
+			}
 		}
 
 		return 0;
@@ -655,66 +553,151 @@ as_complete_load(struct addrspace *as)
 }
 
 /*
- * Initialize the stack pointer
+ * Set up the stack. The stack region starts out empty at the top of the user address space and
+ * grows down on faults, as far as USERSTACKBASE. A guard region below that keeps the heap from
+ * growing into it.
  */
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	int err;
+
+	err = region_add(as, USERSTACKBASE - PAGE_SIZE, USERSTACKBASE, set_permissions(0, 0, 0), 
+						&vm_guardpager, 0, NULL);
+	if(err) {
+		return err;
+	}
+
+	err = region_add(as, USERTOP, USERTOP, set_permissions(1, 1, 0), &vm_anonpager, VR_GROWSDOWN, NULL);
+	if(err) {
+		return err;
+	}
+
 	/* Initial user-level stack pointer */
-	as->as_stackptr = USERTOP;
 	*stackptr = USERSTACK;
 	
 	return 0;
 }
 
 /* 
- * Initialize the heap
+ * Initialize the heap. It starts out empty right after the highest region, the data segment.
  */
-void
+int
 as_define_heap(struct addrspace *as) {
-	as->as_heapstart = as->as_data->vbase + PAGE_SIZE*as->as_data->npages;
-	as->as_heapend = as->as_heapstart;
-}
+	vaddr_t heapstart = 0;
+	int err;
 
+	if(as->as_nregions > 0) {
+		heapstart = as->as_regions[as->as_nregions-1]->vr_end;
+	}
 
-/* Simple helpers to determine the region of memory that we reside in */
-int is_vaddrcode(struct addrspace *as, vaddr_t vaddr)
-{
-	vaddr_t region_start = as->as_code->vbase;
-	vaddr_t region_end = as->as_code->vbase + (as->as_code->npages)*PAGE_SIZE;
-	if( (vaddr >= region_start) && (vaddr < region_end) ) {
-		return 1;
+	err = region_add(as, heapstart, heapstart, set_permissions(1, 1, 0), &vm_anonpager, 0, &as->as_heap);
+	if(err) {
+		return err;
 	}
+	as->as_heapend = heapstart;
 	return 0;
 }
 
-int is_vaddrdata(struct addrspace *as, vaddr_t vaddr)
+
+/*
+ * as_syncregion()
+ * Write the dirty pages of a shared mapping back to the file. Pages being paged out are waited for,
+ * the pageout daemon may be cleaning them already. Returns the first error, after trying every page.
+ */
+int
+as_syncregion(struct addrspace *as, struct vm_region *region)
 {
-	vaddr_t region_start = as->as_data->vbase;
-	vaddr_t region_end = as->as_data->vbase + (as->as_data->npages)*PAGE_SIZE;
-	if( (vaddr >= region_start) && (vaddr < region_end) ) {
-		return 1;
+	int err, result = 0;
+	vaddr_t page;
+	struct pte *entry;
+	int spl = splhigh();
+
+	assert(region->vr_flags & VR_SHARED);
+
+	for(page=region->vr_start; page<region->vr_end; page+=PAGE_SIZE) {
+		entry = pt_get(as->as_pagetable, page);
+		if(entry == NULL) {
+			continue;
+		}
+		while(PTE_PADDR(entry) != 0 && coremap_is_busy(PTE_PADDR(entry))) {
+			coremap_busy_wait(PTE_PADDR(entry));
+		}
+		if(PTE_STATE(entry) != PTE_DIRTY) {
+			continue;
+		}
+
+		coremap_busy_mark(PTE_PADDR(entry));
+		err = swap_pageclean(entry);
+		coremap_busy_unmark(PTE_PADDR(entry));
+		if(err && result == 0) {
+			result = err;
+		}
 	}
-	return 0;
+
+	splx(spl);
+	return result;
 }
 
-int is_vaddrheap(struct addrspace *as, vaddr_t vaddr)
+/*
+ * as_freerange()
+ * Free every page mapped in [start, end), which must be page aligned. Only the mapped pages are
+ * visited, so a huge sparse range costs no more than the pages it has. Nothing is written back.
+ * Returns ENOMEM if the page table can't be unshared after fork, and frees nothing in that case.
+ */
+int
+as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
 {
-	vaddr_t region_start = as->as_heapstart;
-	vaddr_t region_end = as->as_heapend;
-	if( (vaddr >= region_start) && (vaddr < region_end) ) {
-		return 1;
+	int err;
+	vaddr_t vaddr;
+	struct pt_iter it;
+	int spl = splhigh();
+
+	assert(lock_do_i_hold(as->as_lock));
+
+	/* The pages may still be shared with a parent or child through the page table */
+	for(pt_iter_from(as->as_pagetable, start, &it); (vaddr = pt_iter_vaddr(&it)) != 0 && vaddr < end; pt_iter_next(&it)) {
+		err = pt_unshare(as->as_pagetable, vaddr);
+		if(err) {
+			splx(spl);
+			return err;
+		}
+	}
+
+	for(pt_iter_from(as->as_pagetable, start, &it); (vaddr = pt_iter_vaddr(&it)) != 0 && vaddr < end; pt_iter_next(&it)) {
+		/* The page may still be mapped in the TLB */
+		TLB_InvalidateVaddr(vaddr);
+
+		free_upage(pt_iter_pte(&it));
+		pt_iter_remove(&it);
 	}
+
+	splx(spl);
 	return 0;
 }
 
-int is_vaddrstack(struct addrspace *as, vaddr_t vaddr)
+/*
+ * as_removeregion()
+ * Free every page of a region and remove the region. Nothing is written back, shared mappings
+ * have to be synced first. Returns ENOMEM if the page table can't be unshared after fork, and
+ * leaves the region alone in that case.
+ */
+int
+as_removeregion(struct addrspace *as, struct vm_region *region)
 {
-	vaddr_t region_start = as->as_stackptr;
-	vaddr_t region_end = USERSTACK;
-	if( (vaddr >= region_start) && (vaddr < region_end) ) {
-		return 1;
+	int err;
+	int spl = splhigh();
+
+	assert(lock_do_i_hold(as->as_lock));
+
+	err = as_freerange(as, region->vr_start, region->vr_end);
+	if(err) {
+		splx(spl);
+		return err;
 	}
+	region_remove(as, region);
+
+	splx(spl);
 	return 0;
 }
 
@@ -724,44 +707,36 @@ void region_dump(struct addrspace *as)
 {
 #if !OPT_DUMBVM
 
-	unsigned i, j;
+	int r;
+	unsigned j;
+	vaddr_t page;
 	u_int32_t *vaddr;
 	struct pte *entry;
+	struct vm_region *region;
 
 	int spl = splhigh();
-	/* Print segments */
-	kprintf("Printing Code Segment \n\n");
-	for(i=0; i<as->as_code->npages; i++) {
-		kprintf("Page %d:\n", i);
-		/* Get the physical page */
-		entry = pt_get(as->as_pagetable, (as->as_code->vbase+i*PAGE_SIZE) );
-		assert(entry != NULL);
-
-		/* Convert address to kernel virtual address and cast it to a pointer */
-		vaddr = (u_int32_t *)PADDR_TO_KVADDR(entry->ppageaddr);
-
-		/* 4096/32 = 128 */
-		for(j=0; j<(PAGE_SIZE/sizeof(u_int32_t)); j++) {
-			kprintf("%x", vaddr[j]);
-		}
-		kprintf("\n");
-	}
-
-	kprintf("Printing Data Segment \n\n");
-	for(i=0; i<as->as_data->npages; i++) {
-		kprintf("Page %d:\n", i);
-		/* Get the physical page */
-		entry = pt_get(as->as_pagetable, (as->as_data->vbase+i*PAGE_SIZE) );
-		assert(entry != NULL);
+	/* Print regions */
+	for(r=0; r<as->as_nregions; r++) {
+		region = as->as_regions[r];
+		kprintf("Printing %s region 0x%x - 0x%x\n\n", region->vr_pager->pg_name, region->vr_start, region->vr_end);
+
+		for(page=region->vr_start; page<region->vr_end; page+=PAGE_SIZE) {
+			/* Get the physical page, skip pages that aren't in memory */
+			entry = pt_get(as->as_pagetable, page);
+			if(entry == NULL || PTE_PADDR(entry) == 0) {
+				continue;
+			}
+			kprintf("Page 0x%x:\n", page);
 
-		/* Convert address to kernel virtual address and cast it to a pointer */
-		vaddr = (u_int32_t *)PADDR_TO_KVADDR(entry->ppageaddr);
+			/* Convert address to kernel virtual address and cast it to a pointer */
+			vaddr = (u_int32_t *)PADDR_TO_KVADDR(PTE_PADDR(entry));
 
-		/* 4096/32 = 128 */
-		for(j=0; j<(PAGE_SIZE/sizeof(u_int32_t)); j++) {
-			kprintf("%x", vaddr[j]);
+			/* 4096/32 = 128 */
+			for(j=0; j<(PAGE_SIZE/sizeof(u_int32_t)); j++) {
+				kprintf("%x", vaddr[j]);
+			}
+			kprintf("\n");
 		}
-		kprintf("\n");
 	}
 
 	splx(spl);
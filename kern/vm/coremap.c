@@ -6,28 +6,224 @@
 #include <curthread.h>
 #include <vm.h>
 #include <machine/spl.h>
+#include <machine/tlb.h>
 #include <coremap.h>
 #include <pagetable.h>
 #include <swap.h>
 #include <vm_features.h>
+#include <replacement.h>
+#include <futex.h>
 
 /* coremap structure, an array allocated at runtime */
 struct coremap_entry *coremap;
 
 /* first available page. All pages up to and including the coremap are fixed, and should not be deallocated... */
-static int first_avail_ppage = 0;
+int first_avail_ppage = 0;
 
 /* one after the last available page */
-static int last_avail_ppage = 0;
+int last_avail_ppage = 0;
 
-/* for page replacement */
-static int prev_swap_page = 0;
+/* where the pageout daemon's search for dirty pages resumes */
+static int clean_hand = 0;
 
-/* stores the index of the coremap entry the clock hand points at */
-int clock_hand = 0;
+/*
+ * Buddy allocator state. buddy_free_head[order] is the coremap index of the first free block
+ * of 2^order pages, or -1 if there is none. buddy_free_cnt[order] counts the blocks on each list.
+ */
+static int buddy_free_head[BUDDY_MAX_ORDER+1];
+static int buddy_free_cnt[BUDDY_MAX_ORDER+1];
+
+/* total number of free pages, kept up to date by the buddy allocator */
+static int num_free_ppages = 0;
+
+/* 
+ * The zero pool, a list of S_ZERO pages linked through buddy_next/buddy_prev. These pages are not
+ * counted in num_free_ppages.
+ */
+static int zeropool_head = -1;
+static int zeropool_cnt = 0;
+
+
+/****************************************************************************************
+ ****** Buddy allocator helpers *********************************************************
+ ****************************************************************************************/
+
+/*
+ * buddy_list_add()/buddy_list_remove()
+ * Push/unlink the free block headed by coremap index idx on/from the free list of the given order.
+ */
+static void buddy_list_add(int idx, int order)
+{
+    coremap[idx].buddy_order = order;
+    coremap[idx].buddy_prev = -1;
+    coremap[idx].buddy_next = buddy_free_head[order];
+    if(buddy_free_head[order] != -1) {
+        coremap[buddy_free_head[order]].buddy_prev = idx;
+    }
+    buddy_free_head[order] = idx;
+    buddy_free_cnt[order]++;
+}
+
+static void buddy_list_remove(int idx)
+{
+    int order = coremap[idx].buddy_order;
+    assert(order >= 0 && order <= BUDDY_MAX_ORDER);
+
+    if(coremap[idx].buddy_prev != -1) {
+        coremap[coremap[idx].buddy_prev].buddy_next = coremap[idx].buddy_next;
+    }
+    else {
+        buddy_free_head[order] = coremap[idx].buddy_next;
+    }
+    if(coremap[idx].buddy_next != -1) {
+        coremap[coremap[idx].buddy_next].buddy_prev = coremap[idx].buddy_prev;
+    }
+
+    coremap[idx].buddy_order = -1;
+    coremap[idx].buddy_next = -1;
+    coremap[idx].buddy_prev = -1;
+    buddy_free_cnt[order]--;
+}
+
+/*
+ * buddy_free_block()
+ * Give a block of 2^order pages starting at coremap index idx back to the allocator.
+ * The block is merged with its buddy for as long as the buddy is a free block of the same order.
+ */
+static void buddy_free_block(int idx, int order)
+{
+    int num_avail = last_avail_ppage - first_avail_ppage;
+    int rel = idx - first_avail_ppage;
+    int buddy;
+
+    while(order < BUDDY_MAX_ORDER) {
+        buddy = rel ^ (1 << order);
+        if(buddy + (1 << order) > num_avail) {
+            break;
+        }
+        if(coremap[buddy + first_avail_ppage].buddy_order != order) {
+            break;
+        }
+        /* buddy is free and the same size, take it off its list and merge */
+        buddy_list_remove(buddy + first_avail_ppage);
+        if(buddy < rel) {
+            rel = buddy;
+        }
+        order++;
+    }
+
+    buddy_list_add(rel + first_avail_ppage, order);
+}
+
+/*
+ * buddy_free_range()
+ * Free npages starting at coremap index idx. The range is broken into the largest aligned
+ * blocks that fit, each of which is coalesced with its neighbours.
+ */
+static void buddy_free_range(int idx, int npages)
+{
+    int rel = idx - first_avail_ppage;
+    int end = rel + npages;
+    int order;
+
+    while(rel < end) {
+        order = BUDDY_MAX_ORDER;
+        while( (rel & ((1 << order) - 1)) != 0 || rel + (1 << order) > end ) {
+            order--;
+        }
+        buddy_free_block(rel + first_avail_ppage, order);
+        rel += (1 << order);
+    }
+}
+
+/*
+ * buddy_find()
+ * Order of the smallest non-empty free list that can hold a block of the given order.
+ * Returns BUDDY_MAX_ORDER+1 if there is none.
+ */
+static int buddy_find(int order)
+{
+    int cur_order;
+    for(cur_order=order; cur_order<=BUDDY_MAX_ORDER; cur_order++) {
+        if(buddy_free_head[cur_order] != -1)
+            break;
+    }
+    return cur_order;
+}
+
+/*
+ * buddy_order_for()
+ * Smallest order whose block holds npages. Returns -1 if npages is too large.
+ */
+static int buddy_order_for(int npages)
+{
+    int order = 0;
+    while((1 << order) < npages) {
+        order++;
+        if(order > BUDDY_MAX_ORDER) {
+            return -1;
+        }
+    }
+    return order;
+}
+
+
+/****************************************************************************************
+ ****** Zero pool helpers ***************************************************************
+ ****************************************************************************************/
+
+static void zeropool_add(int idx)
+{
+    coremap[idx].state = S_ZERO;
+    coremap[idx].num_pages_allocated = 0;
+    coremap[idx].pt_entry = NULL;
+    coremap[idx].buddy_prev = -1;
+    coremap[idx].buddy_next = zeropool_head;
+    if(zeropool_head != -1) {
+        coremap[zeropool_head].buddy_prev = idx;
+    }
+    zeropool_head = idx;
+    zeropool_cnt++;
+}
+
+static void zeropool_remove(int idx)
+{
+    assert(coremap[idx].state == S_ZERO);
+
+    if(coremap[idx].buddy_prev != -1) {
+        coremap[coremap[idx].buddy_prev].buddy_next = coremap[idx].buddy_next;
+    }
+    else {
+        zeropool_head = coremap[idx].buddy_next;
+    }
+    if(coremap[idx].buddy_next != -1) {
+        coremap[coremap[idx].buddy_next].buddy_prev = coremap[idx].buddy_prev;
+    }
+
+    coremap[idx].buddy_next = -1;
+    coremap[idx].buddy_prev = -1;
+    zeropool_cnt--;
+}
+
+/*
+ * zeropool_release()/zeropool_drain()
+ * Give one/all of the zero pool pages back to the buddy allocator.
+ */
+static void zeropool_release(int idx)
+{
+    zeropool_remove(idx);
+    coremap[idx].state = S_FREE;
+    buddy_free_range(idx, 1);
+    num_free_ppages++;
+}
+
+static void zeropool_drain(void)
+{
+    while(zeropool_head != -1) {
+        zeropool_release(zeropool_head);
+    }
+}
 
-/* for now, the first time I enter the page evict func I set the clock_hand to the first user entry I find*/
-//int first_page_evict = 0;
 
 /*
  * coremap_bootstrap()
@@ -37,7 +233,7 @@ int clock_hand = 0;
  *      (1) use ram_getsize() to understand how much memory we have, in the process firstppaddr and lastppaddr are both destroyed
  *      (2) Calculate how many pages we can fit, given that we need space for the coremap
  *      (3) Allocate space for the coremap manually using physical address pointers
- *      (4) Create the coremap_mutex, kmalloc should work by this point
+ *      (4) Hand every page after the coremap to the buddy allocator
  */
 void coremap_bootstrap() 
 {
@@ -64,21 +260,62 @@ void coremap_bootstrap()
         coremap[i].state = S_KERN; /* This memory is fixed */
         coremap[i].num_pages_allocated = 1;
         coremap[i].pt_entry = NULL;
+        coremap[i].pt_refs = 0;
         coremap[i].referenced = 1;
+        coremap[i].vaddr = 0;
+        coremap[i].readahead = 0;
+        coremap[i].file = NULL;
+        coremap[i].owner = NULL;
+        coremap[i].rp_age = 0;
+        coremap[i].rp_lastref = 0;
+        coremap[i].rp_queue = 0;
+        coremap[i].rp_next = -1;
+        coremap[i].rp_prev = -1;
+        coremap[i].rp_seen = 0;
+        coremap[i].buddy_order = -1;
+        coremap[i].buddy_next = -1;
+        coremap[i].buddy_prev = -1;
     }
 
     /* Initialize the rest of the coremap */
     for(i=num_fixed_pages; i<num_ppages; i++) {
         coremap[i].state = S_FREE; /* This memory is free */
-        coremap[i].num_pages_allocated = 1;
+        coremap[i].num_pages_allocated = 0;
         coremap[i].pt_entry = NULL;
+        coremap[i].pt_refs = 0;
         coremap[i].referenced = 0;
+        coremap[i].vaddr = 0;
+        coremap[i].readahead = 0;
+        coremap[i].file = NULL;
+        coremap[i].owner = NULL;
+        coremap[i].rp_age = 0;
+        coremap[i].rp_lastref = 0;
+        coremap[i].rp_queue = 0;
+        coremap[i].rp_next = -1;
+        coremap[i].rp_prev = -1;
+        coremap[i].rp_seen = 0;
+        coremap[i].buddy_order = -1;
+        coremap[i].buddy_next = -1;
+        coremap[i].buddy_prev = -1;
     }
 
     /* save first and last pages */
     first_avail_ppage = num_fixed_pages;
     last_avail_ppage = num_ppages;
 
+    /* Build the free lists */
+    for(i=0; i<=BUDDY_MAX_ORDER; i++) {
+        buddy_free_head[i] = -1;
+        buddy_free_cnt[i] = 0;
+    }
+    buddy_free_range(first_avail_ppage, last_avail_ppage - first_avail_ppage);
+    num_free_ppages = last_avail_ppage - first_avail_ppage;
+
+    /* Start up the page replacement policy */
+    if(replacement_setpolicy(REPLACEMENT_POLICY_DEFAULT)) {
+        panic("Unknown page replacement policy %s\n", REPLACEMENT_POLICY_DEFAULT);
+    }
+
     splx(spl); 
 }
 
@@ -86,69 +323,90 @@ void coremap_bootstrap()
 /*
  * get_ppage()
  * 
- * Find the first free consecutive npages and allocate it for the current thread.
- * We are looking for consecutive physical pages. If found, we update the coremap accordingly and 
- * return the physical address of the first page allocated.
+ * Allocate npages consecutive physical pages for the current thread.
+ * We take the smallest free block of at least 2^order >= npages pages, splitting larger blocks
+ * as needed, and return any pages past npages to the allocator. Single pages are O(1), larger
+ * requests are O(log n). If found, we update the coremap accordingly and return the physical 
+ * address of the first page allocated.
  * 
  * is_kernel=1 means we are allocating a kernel page, meaning its virtual page number is directly mapped.
  */
 paddr_t get_ppages(int npages, int is_kernel, struct pte *entry) 
 {   
     /* local variables */
-    int page_it = 0;
-    int cnt = 0;
-    int space_avail = 0;
+    int order;
+    int cur_order;
+    int start_page;
     int spl;
+
+    assert(npages > 0);
     
+    order = buddy_order_for(npages);
+    if(order < 0) {
+        return 0;
+    }
+
     /* get access to coremap using semapore or just disable interrupts */
     spl = splhigh();
 
-    /* loop through available pages and find consevutively free pages */
-    for(page_it=first_avail_ppage; page_it<last_avail_ppage; page_it++){
-        /* check if space is available */
-        if(cnt == npages) {
-            space_avail = 1;
-            break;
-        } 
-        /* look through coremap for consecutive free pages */   
-        if(coremap[page_it].state == S_FREE)
-            cnt++;
-        else {
-            cnt = 0;
-        }
+    /* find the smallest non-empty free list that can satisfy the request */
+    cur_order = buddy_find(order);
+
+    /* the zero pool is free memory too, give it back to the buddy allocator before giving up */
+    if(cur_order > BUDDY_MAX_ORDER && zeropool_cnt > 0) {
+        zeropool_drain();
+        cur_order = buddy_find(order);
     }
 
-    if(space_avail) {
-        /* Space was found, so we allocate it on the coremap */
-        int i;
-        int start_page = page_it - npages;
-        int end_page = start_page + npages;
+    if(cur_order > BUDDY_MAX_ORDER) {
+        splx(spl);
+        return 0;
+    }
 
-        for(i=start_page; i<end_page; i++) {
-            if(is_kernel) {
-                coremap[i].state = S_KERN;
-                coremap[i].pt_entry = NULL;
-            }
-            else {
-                coremap[i].state = S_USER;
-                coremap[i].pt_entry = entry;
-            }
+    start_page = buddy_free_head[cur_order];
+    buddy_list_remove(start_page);
 
-            if(i==start_page)
-                coremap[i].num_pages_allocated = npages;
-            else {
-                coremap[i].num_pages_allocated = 0;
-            }
-        }
+    /* split the block down to the order we need, upper halves go back on the free lists */
+    while(cur_order > order) {
+        cur_order--;
+        buddy_list_add(start_page + (1 << cur_order), cur_order);
+    }
 
-        splx(spl);
+    /* give back the tail we don't need */
+    if(npages < (1 << order)) {
+        buddy_free_range(start_page + npages, (1 << order) - npages);
+    }
+
+    /* Space was found, so we allocate it on the coremap */
+    int i;
+    int end_page = start_page + npages;
+
+    for(i=start_page; i<end_page; i++) {
+        assert(coremap[i].state == S_FREE);
+        if(is_kernel) {
+            coremap[i].state = S_KERN;
+            coremap[i].pt_entry = NULL;
+        }
+        else {
+            /* busy until the caller has the page mapped, so nobody evicts it half set up */
+            coremap[i].state = S_BUSY;
+            coremap[i].pt_entry = entry;
+        }
 
-        return (start_page*PAGE_SIZE);
+        if(i==start_page)
+            coremap[i].num_pages_allocated = npages;
+        else {
+            coremap[i].num_pages_allocated = 0;
+        }
+        coremap[i].pt_refs = 0;
+        coremap[i].readahead = 0;
+        coremap[i].file = NULL;
     }
+    num_free_ppages -= npages;
 
     splx(spl);
 
-    return 0;
+    return (start_page*PAGE_SIZE);
 }
 
 
@@ -156,7 +414,7 @@ paddr_t get_ppages(int npages, int is_kernel, struct pte *entry)
  * free_ppages()
  * 
  * Frees consecutively allocated pages. We know that they are consecutive because we saved
- * them when allocated them :) big brain.
+ * them when allocated them :) big brain. The pages are coalesced with any free buddies.
  */
 void free_ppages(paddr_t paddr) 
 {   
@@ -170,26 +428,57 @@ void free_ppages(paddr_t paddr)
     int start_page = (paddr >> PAGE_OFFSET);
     assert(start_page < last_avail_ppage);
     
-    int end_page = start_page + coremap[start_page].num_pages_allocated;
+    int npages = coremap[start_page].num_pages_allocated;
+    int end_page = start_page + npages;
     if(start_page == end_page) {
         panic("Fatal Coremap: Probably double freeing...\n");
     }
-    assert(start_page>=first_avail_ppage && end_page<last_avail_ppage);
+    assert(start_page>=first_avail_ppage && end_page<=last_avail_ppage);
 
     /* Go through the coremap entries and free neccessary entries */
     int i;
     for(i=start_page; i<end_page; i++) {
         assert(coremap[i].state != S_FREE);
+        if(coremap[i].state == S_USER) {
+            replacement_policy->rp_free(i);
+        }
+        else if(coremap[i].state == S_BUSY) {
+            /* threads waiting for the page find out it is gone */
+            thread_wakeup(&coremap[i]);
+        }
+        if(coremap[i].state == S_USER || coremap[i].state == S_BUSY) {
+            /* so do processes waiting on a futex in it */
+            futex_pagegone(i << PAGE_OFFSET);
+        }
+        if(coremap[i].readahead) {
+            /* read ahead but never used */
+            coremap[i].readahead = 0;
+            swap_readahead_miss();
+        }
         coremap[i].state = S_FREE;
         coremap[i].num_pages_allocated = 0;
         coremap[i].pt_entry = NULL;
         coremap[i].referenced = 1;
+        coremap[i].file = NULL;
     }
+
+    buddy_free_range(start_page, npages);
+    num_free_ppages += npages;
     
     splx(spl);
 }
 
 
+/*
+ * coremap_freecount()
+ * Returns the number of free physical pages.
+ */
+int coremap_freecount() 
+{
+    return num_free_ppages + zeropool_cnt;
+}
+
+
 /*
  * coremap_stat()
  * Print relevant information about the coremap for debugging
@@ -209,6 +498,10 @@ void coremap_stat()
             kprintf("USER    ");
         else if(coremap[i].state == S_KERN)
             kprintf("KERN    ");
+        else if(coremap[i].state == S_BUSY)
+            kprintf("BUSY    ");
+        else if(coremap[i].state == S_ZERO)
+            kprintf("ZERO    ");
             
         j++;
 
@@ -219,9 +512,84 @@ void coremap_stat()
     }
     kprintf("\n\n");
 
+    /* Print the buddy free lists */
+    kprintf("FREE PAGES: %d of %d, %d zeroed\n", num_free_ppages + zeropool_cnt, 
+            last_avail_ppage - first_avail_ppage, zeropool_cnt);
+    for(i=0; i<=BUDDY_MAX_ORDER; i++) {
+        kprintf("ORDER %d (%d pages): %d free blocks\n", i, 1 << i, buddy_free_cnt[i]);
+    }
+    kprintf("\n");
+
+    splx(spl);
+}
+
+
+
+/*
+ * coremap_zero_idle()
+ * Take a free page off the buddy allocator, zero it and add it to the zero pool. This runs from the
+ * idle loop with interrupts off, so it only does one page per call. Returns 1 if it zeroed a page,
+ * 0 if the pool is full or free memory is too low to hold pages back.
+ */
+int coremap_zero_idle()
+{
+    assert(curspl>0);
+    paddr_t paddr;
+
+    /* the idle loop runs before the coremap is set up during boot */
+    if(coremap == NULL) {
+        return 0;
+    }
+    if(zeropool_cnt >= ZEROPOOL_MAX || num_free_ppages <= PAGEOUT_HIGH_WATERMARK) {
+        return 0;
+    }
+
+    paddr = get_ppages(1, 1, NULL);
+    if(paddr == 0) {
+        return 0;
+    }
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    zeropool_add(paddr >> PAGE_OFFSET);
+    vmstat.vs_zeroidle++;
+
+    return 1;
+}
+
+/*
+ * coremap_zero_get()
+ * Take a zeroed page out of the pool for entry. The page comes back busy, like from get_ppages().
+ * Returns 0 if the pool is empty.
+ */
+paddr_t coremap_zero_get(struct pte *entry)
+{
+    int idx;
+    int spl = splhigh();
+
+    if(zeropool_head == -1) {
+        splx(spl);
+        return 0;
+    }
+
+    idx = zeropool_head;
+    zeropool_remove(idx);
+    coremap[idx].state = S_BUSY;
+    coremap[idx].pt_entry = entry;
+    coremap[idx].num_pages_allocated = 1;
+    coremap[idx].readahead = 0;
+    coremap[idx].file = NULL;
+
     splx(spl);
+    return (idx*PAGE_SIZE);
 }
 
+/*
+ * coremap_zero_count()
+ * Number of pages in the zero pool
+ */
+int coremap_zero_count()
+{
+    return zeropool_cnt;
+}
 
 
 /****************************************************************************************
@@ -230,70 +598,200 @@ void coremap_stat()
 
 /*
  * coremap_swap_pageout()
- * Implements random page table eviction...
+ * Ask the replacement policy for a page to evict. Returns its page table entry, or NULL if 
+ * there are no user pages to evict.
  */
 struct pte *coremap_swap_pageout() 
 {
     assert(curspl>0);
-    int page_it;
+    int victim;
 
-    if(!LRU_CLOCK) 
-    {
-        int start_page = ( random() % (last_avail_ppage - first_avail_ppage) ) + first_avail_ppage;
-
-        for(page_it=start_page; page_it<last_avail_ppage; page_it++){
-            if(coremap[page_it].state == S_USER && page_it != prev_swap_page) {
-                assert(coremap[page_it].pt_entry != NULL);
-                prev_swap_page = page_it;
-                return coremap[page_it].pt_entry;
-            }
-        }
+    victim = replacement_policy->rp_select();
+    if(victim < 0) {
+        return NULL;
+    }
 
-        for(page_it=first_avail_ppage; page_it<start_page; page_it++){
-            if(coremap[page_it].state == S_USER && page_it != prev_swap_page) {
-                assert(coremap[page_it].pt_entry != NULL);
-                prev_swap_page = page_it;
-                return coremap[page_it].pt_entry;
-            }
-        }
+    assert(victim >= first_avail_ppage && victim < last_avail_ppage);
+    assert(coremap[victim].state == S_USER);
+    assert(coremap[victim].pt_entry != NULL);
+    return coremap[victim].pt_entry;
+}
 
-        return 0;
+/*
+ * coremap_page_referenced()
+ * Called whenever a user page is mapped into the TLB, which is the closest thing to a
+ * reference bit we get on MIPS.
+ */
+void coremap_page_referenced(paddr_t ppageaddr, vaddr_t vaddr)
+{
+    int spl = splhigh();
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    if(coremap[index].state != S_USER || coremap[index].pt_entry == NULL) {
+        panic("coremap corrupted, coremap_page_referenced\n");
     }
-    else 
-    {
-        for(page_it=clock_hand+1; page_it<last_avail_ppage; page_it++) {
-            if(coremap[page_it].state == S_USER && coremap[page_it].referenced == 0) {
-                clock_hand = page_it; 
-                return coremap[page_it].pt_entry;
-            }
-            else if(coremap[page_it].state == S_USER && coremap[page_it].referenced == 1) {
-                coremap[page_it].referenced = 0;
-            }
-        }
+    coremap[index].vaddr = vaddr;
+    coremap[index].owner = curthread->t_vmspace;
+    coremap[index].pt_entry->pte_word &= ~PTE_NOREFILL;
+    if(coremap[index].readahead) {
+        coremap[index].readahead = 0;
+        swap_readahead_hit();
+    }
+    replacement_policy->rp_access(index);
+    splx(spl);
+}
 
-        for(page_it=first_avail_ppage; page_it<last_avail_ppage; page_it++) {
-            if(coremap[page_it].state == S_USER && coremap[page_it].referenced == 0) {
-                clock_hand = page_it; 
-                return coremap[page_it].pt_entry;
-            }
-            else if(coremap[page_it].state == S_USER && coremap[page_it].referenced == 1) {
-                coremap[page_it].referenced = 0;
-            }
-        }
+/*
+ * coremap_page_watch()
+ * Make the next reference to a user page fault. References the UTLB miss handler serves from the
+ * page table never reach coremap_page_referenced(), so the flag in the entry sends the next miss
+ * to vm_fault instead. coremap_page_referenced() clears it again.
+ */
+void coremap_page_watch(paddr_t ppageaddr)
+{
+    assert(curspl>0);
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    assert(coremap[index].state == S_USER);
+    assert(coremap[index].pt_entry != NULL);
 
-        return NULL;
-    }
+    coremap[index].pt_entry->pte_word |= PTE_NOREFILL;
+    TLB_InvalidatePaddr(ppageaddr & PAGE_FRAME);
+}
+
+/*
+ * coremap_set_ptentry()
+ * Point a user page at its new page table entry. The page must not be busy, since whoever
+ * marked it busy holds on to the old entry.
+ */
+void coremap_set_ptentry(paddr_t ppageaddr, struct pte *entry)
+{
+    assert(curspl>0);
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    assert(coremap[index].state == S_USER);
+    coremap[index].pt_entry = entry;
 }
 
-void coremap_lruclock_update(paddr_t ppageaddr)
+/*
+ * coremap_set_file()
+ * Remember where in a file a page of a shared mapping belongs, so the page can be written back
+ * there. len is the number of bytes of the page that are part of the file.
+ */
+void coremap_set_file(paddr_t ppageaddr, struct vnode *v, off_t offset, size_t len)
 {
+    assert(curspl>0);
     u_int32_t index = (ppageaddr >> PAGE_OFFSET);
-    if(coremap[index].state != S_USER || coremap[index].pt_entry == NULL) {
-        panic("coremap corrupted, coremap_lruclock_update\n");
+    assert(coremap[index].state == S_BUSY);
+    assert(len <= PAGE_SIZE);
+
+    coremap[index].file = v;
+    coremap[index].fileoff = offset;
+    coremap[index].filelen = len;
+}
+
+/*
+ * coremap_readahead_mark()
+ * Flag a page brought in by swap readahead. The first reference counts as a readahead hit,
+ * freeing it before then counts as a miss.
+ */
+void coremap_readahead_mark(paddr_t ppageaddr)
+{
+    assert(curspl>0);
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    assert(coremap[index].state == S_USER);
+
+    coremap[index].readahead = 1;
+    coremap_page_watch(ppageaddr);
+}
+
+/*
+ * coremap_busy_mark()
+ * Take a user page away from the replacement policy while we do I/O on it. Freeing a busy
+ * page is fine, it wakes up anyone waiting for it.
+ */
+void coremap_busy_mark(paddr_t ppageaddr)
+{
+    assert(curspl>0);
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    assert(coremap[index].state == S_USER);
+
+    replacement_policy->rp_free(index);
+    coremap[index].state = S_BUSY;
+}
+
+/*
+ * coremap_busy_unmark()
+ * Give a page back to the replacement policy once the I/O is done and wake up the waiters
+ */
+void coremap_busy_unmark(paddr_t ppageaddr)
+{
+    assert(curspl>0);
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    assert(coremap[index].state == S_BUSY);
+
+    coremap[index].state = S_USER;
+    replacement_policy->rp_alloc(index);
+    thread_wakeup(&coremap[index]);
+}
+
+/*
+ * coremap_busy_wait()
+ * Sleep until the page is no longer busy. Returns 1 if we slept
+ */
+int coremap_busy_wait(paddr_t ppageaddr)
+{
+    assert(curspl>0);
+    u_int32_t index = (ppageaddr >> PAGE_OFFSET);
+    int slept = 0;
+
+    while(coremap[index].state == S_BUSY) {
+        thread_sleep(&coremap[index]);
+        slept = 1;
+    }
+    return slept;
+}
+
+int coremap_is_busy(paddr_t ppageaddr)
+{
+    return (coremap[ppageaddr >> PAGE_OFFSET].state == S_BUSY);
+}
+
+
+
+/*
+ * coremap_swap_nextdirty()
+ * Used by the pageout daemon to clean pages ahead of time. Returns the next user page
+ * that would have to be written to swap before it could be evicted, or NULL if every
+ * user page is already clean. The search picks up where the last one left off.
+ */
+struct pte *coremap_swap_nextdirty() 
+{
+    assert(curspl>0);
+    int i;
+    int page_it;
+    int num_avail = last_avail_ppage - first_avail_ppage;
+    struct pte *entry;
+
+    if(clean_hand < first_avail_ppage || clean_hand >= last_avail_ppage) {
+        clean_hand = first_avail_ppage;
     }
-    if(coremap[index].referenced == 0) {
-        coremap[index].referenced = 1; /* set the referenced bit */
+
+    for(i=0; i<num_avail; i++) {
+        page_it = clean_hand;
+        clean_hand++;
+        if(clean_hand >= last_avail_ppage) {
+            clean_hand = first_avail_ppage;
+        }
+
+        if(coremap[page_it].state != S_USER) {
+            continue;
+        }
+        entry = coremap[page_it].pt_entry;
+        assert(entry != NULL);
+        if(PTE_STATE(entry) == PTE_PRESENT || PTE_STATE(entry) == PTE_DIRTY) {
+            return entry;
+        }
     }
+
+    return NULL;
 }
 
 
@@ -302,6 +800,8 @@ void coremap_lruclock_update(paddr_t ppageaddr)
  * coremap_swap_createspace()
  * More involved that coremap_swap_pageout(). This function clears npages using swapping.
  * This function should only be used to create space for kernel pages.
+ * The pages cleared form a whole buddy block, so once they are evicted they coalesce into
+ * a block get_ppages() can hand out.
  */
 int coremap_swap_createspace(int npages) 
 {
@@ -309,87 +809,61 @@ int coremap_swap_createspace(int npages)
 
     int err;
     int page_it = 0;
-    int cnt = 0;
+    int block_size;
     int space_avail = 0;
+    int order = buddy_order_for(npages);
 
-    /* loop through available pages and find consecutively non-fixed pages */
-    for(page_it=first_avail_ppage; page_it<last_avail_ppage; page_it++){
-        /* check if space is available */
-        if(cnt == npages) {
+    if(order < 0) {
+        return 1;
+    }
+    block_size = (1 << order);
+
+    /* loop through aligned blocks and find one with no fixed or busy pages */
+    for(page_it=first_avail_ppage; page_it+block_size<=last_avail_ppage; page_it+=block_size){
+        int k;
+        for(k=0; k<block_size; k++) {
+            if(coremap[page_it+k].state == S_KERN || coremap[page_it+k].state == S_BUSY)
+                break;
+        }
+        if(k == block_size) {
             space_avail = 1;
             break;
-        } 
-        /* look through coremap for consecutive free pages */   
-        if(coremap[page_it].state != S_KERN)
-            cnt++;
-        else {
-            cnt = 0;
         }
     }
 
     if(space_avail) {
-        /* Space was found, swap it out of the coremap to free it up*/
+        /* 
+         * Space was found, swap it out of the coremap to free it up. Every write puts us to sleep, 
+         * so other threads may allocate pages in the block behind us. The caller retries then.
+         */
         int i;
-        int start_page = page_it - npages;
-        int end_page = start_page + npages;
-        u_int32_t swap_location;
+        int start_page = page_it;
+        int end_page = start_page + block_size;
 
         for(i=start_page; i<end_page; i++) {
-            if(coremap[i].state == S_FREE) {
+            if(coremap[i].state == S_ZERO) {
+                zeropool_release(i);
+                continue;
+            }
+            if(coremap[i].state != S_USER) {
                 continue;
             }
 
             assert(coremap[i].num_pages_allocated == 1);
-            assert(coremap[i].state == S_USER);
 
             /* swap out the page */
             struct pte *entry_to_swap = coremap[i].pt_entry;
             assert(entry_to_swap != NULL);
-            assert(entry_to_swap->swap_state != PTE_SWAPPED);
-            assert(entry_to_swap->ppageaddr != 0);
-
-            switch(entry_to_swap->swap_state) {
-                case PTE_PRESENT:
-                    /* we have to allocate a place in swap memory and evict */
-                    err = swap_diskalloc(&swap_location);
-                    if(err) {
-                        return err;
-                    }
-
-                    /* write to this location */
-                    err = swap_write(swap_location, entry_to_swap->ppageaddr);
-                    if(err) {
-                        swap_diskfree(swap_location);
-                        return err;
-                    }
-                    
-                    entry_to_swap->swap_location = swap_location;
-                    entry_to_swap->swap_state = PTE_CLEAN;
-                    swap_pageevict(entry_to_swap);
-                    break;
-
-                case PTE_DIRTY:
-                    /* Dirty means that it already has a page in swap disk */
-                    swap_location = entry_to_swap->swap_location;
-
-                    err = swap_write(swap_location, entry_to_swap->ppageaddr);
-                    if(err) {
-                        return err;
-                    }
-
-                    entry_to_swap->swap_location = swap_location;
-                    entry_to_swap->swap_state = PTE_CLEAN;
-                    swap_pageevict(entry_to_swap);
-                    break;
-                
-                case PTE_CLEAN:
-                    swap_pageevict(entry_to_swap);
-                    break;
-
-                default:
-                    panic("Invalid PTE state");
+            assert(PTE_STATE(entry_to_swap) != PTE_SWAPPED);
+            assert(PTE_PADDR(entry_to_swap) != 0);
+
+            coremap_busy_mark(PTE_PADDR(entry_to_swap));
+            err = swap_pageclean(entry_to_swap);
+            if(err) {
+                coremap_busy_unmark(PTE_PADDR(entry_to_swap));
+                return err;
             }
-
+            swap_pageevict(entry_to_swap);
         }
         return 0;
     }
@@ -0,0 +1,146 @@
+/*
+ * Futexes. See futex.h for an overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <machine/spl.h>
+#include <thread.h>
+#include <curthread.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <futex.h>
+
+
+/* A sleeping process. It lives on the waiter's stack */
+struct futex_waiter {
+    paddr_t fw_key;                 /* frame and offset of the word */
+    int fw_woken;
+    struct futex_waiter *fw_next;
+};
+
+static struct futex_waiter *futex_buckets[FUTEX_BUCKETS];
+static int futex_nwaiters = 0;
+
+static unsigned futex_hash(paddr_t key)
+{
+    return (key >> PAGE_OFFSET) % FUTEX_BUCKETS;
+}
+
+/*
+ * futex_key()
+ * Read the word at uaddr and find the frame it is in. Reading faults the page in if it has to, and
+ * nothing can take it away again before we sleep, as interrupts are off. Returns EFAULT if the
+ * word can't be read.
+ */
+static int futex_key(vaddr_t uaddr, int *val, paddr_t *key)
+{
+    int err;
+    struct pte *entry;
+    struct addrspace *as = curthread->t_vmspace;
+
+    if((uaddr & (sizeof(int) - 1)) != 0) {
+        return EINVAL;
+    }
+
+    err = copyin((const_userptr_t)uaddr, val, sizeof(int));
+    if(err) {
+        return err;
+    }
+
+    entry = pt_get(as->as_pagetable, uaddr & PAGE_FRAME);
+    assert(entry != NULL && PTE_PADDR(entry) != 0);
+    *key = PTE_PADDR(entry) | (uaddr & ~PAGE_FRAME);
+    return 0;
+}
+
+/* futex_wait() */
+int futex_wait(vaddr_t uaddr, int val)
+{
+    int err, cur;
+    paddr_t key;
+    struct futex_waiter fw;
+    unsigned b;
+    int spl = splhigh();
+
+    err = futex_key(uaddr, &cur, &key);
+    if(err) {
+        splx(spl);
+        return err;
+    }
+    if(cur != val) {
+        splx(spl);
+        return EAGAIN;
+    }
+
+    b = futex_hash(key);
+    fw.fw_key = key;
+    fw.fw_woken = 0;
+    fw.fw_next = futex_buckets[b];
+    futex_buckets[b] = &fw;
+    futex_nwaiters++;
+
+    while(!fw.fw_woken) {
+        thread_sleep(&fw);
+    }
+
+    splx(spl);
+    return 0;
+}
+
+/* Wake the waiters on the chain of key that match. Frame only if whole is set */
+static int futex_wakekey(paddr_t key, int whole, int n)
+{
+    int woken = 0;
+    struct futex_waiter *fw, **pp;
+
+    pp = &futex_buckets[futex_hash(key)];
+    while((fw = *pp) != NULL && woken < n) {
+        if(fw->fw_key != key && !(whole && (fw->fw_key & PAGE_FRAME) == (key & PAGE_FRAME))) {
+            pp = &fw->fw_next;
+            continue;
+        }
+        *pp = fw->fw_next;
+        fw->fw_woken = 1;
+        futex_nwaiters--;
+        thread_wakeup(fw);
+        woken++;
+    }
+    return woken;
+}
+
+/* futex_wake() */
+int futex_wake(vaddr_t uaddr, int n, int *woken)
+{
+    int err, cur;
+    paddr_t key;
+    int spl = splhigh();
+
+    *woken = 0;
+    err = futex_key(uaddr, &cur, &key);
+    if(err) {
+        splx(spl);
+        return err;
+    }
+
+    if(futex_nwaiters > 0 && n > 0) {
+        *woken = futex_wakekey(key, 0, n);
+    }
+
+    splx(spl);
+    return 0;
+}
+
+/* futex_pagegone() */
+void futex_pagegone(paddr_t paddr)
+{
+    int spl = splhigh();
+
+    if(futex_nwaiters > 0) {
+        futex_wakekey(paddr & PAGE_FRAME, 1, futex_nwaiters);
+    }
+
+    splx(spl);
+}
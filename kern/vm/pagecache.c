@@ -0,0 +1,119 @@
+/*
+ * Page cache of read only file pages. See pagecache.h for an overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <machine/spl.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <pagecache.h>
+#include <vnode.h>
+
+
+/* A cached page. The entry comes first, so the page can be found from the entry processes map */
+struct pc_page {
+    struct pte_shared pc_ps;
+    struct vnode *pc_file;          /* NULL until the page is cached */
+    off_t pc_offset;
+    struct pc_page *pc_next;        /* next page in the same hash chain */
+};
+
+static struct pc_page *pagecache_buckets[PAGECACHE_BUCKETS];
+static int pagecache_npages = 0;
+
+static unsigned pagecache_hash(struct vnode *v, off_t offset)
+{
+    return (((u_int32_t)v >> 4) ^ ((u_int32_t)offset >> PAGE_OFFSET)) % PAGECACHE_BUCKETS;
+}
+
+/* pagecache_entry_create() */
+struct pte *pagecache_entry_create(void)
+{
+    struct pc_page *pg = kmalloc(sizeof(struct pc_page));
+    if(pg == NULL) {
+        return NULL;
+    }
+    pg->pc_ps.ps_pte.pte_word = PTE_OUTOFLINE;
+    PTE_SET_PERMS(&pg->pc_ps.ps_pte, set_permissions(0,0,0));
+    PTE_SET_STATE(&pg->pc_ps.ps_pte, PTE_NONE);
+    pg->pc_ps.ps_pte.swap_location = 0;
+    pg->pc_ps.ps_sharers = 0;
+    pg->pc_file = NULL;
+    pg->pc_offset = 0;
+    pg->pc_next = NULL;
+    return &pg->pc_ps.ps_pte;
+}
+
+/* pagecache_lookup() */
+struct pte *pagecache_lookup(struct vnode *v, off_t offset)
+{
+    assert(curspl>0);
+
+    struct pc_page *pg;
+
+    for(pg = pagecache_buckets[pagecache_hash(v, offset)]; pg != NULL; pg = pg->pc_next) {
+        if(pg->pc_file == v && pg->pc_offset == offset) {
+            return &pg->pc_ps.ps_pte;
+        }
+    }
+    return NULL;
+}
+
+/* pagecache_insert() */
+int pagecache_insert(struct vnode *v, off_t offset, struct pte *entry)
+{
+    assert(curspl>0);
+
+    struct pc_page *pg = (struct pc_page *)entry;
+    unsigned bucket = pagecache_hash(v, offset);
+
+    assert(entry->pte_word & PTE_OUTOFLINE);
+    assert((entry->pte_word & PTE_CACHED) == 0);
+
+    /* we may have slept loading the page, and somebody else loaded it too */
+    if(pagecache_lookup(v, offset) != NULL) {
+        return EEXIST;
+    }
+
+    VOP_INCREF(v);
+    pg->pc_file = v;
+    pg->pc_offset = offset;
+    pg->pc_next = pagecache_buckets[bucket];
+    pagecache_buckets[bucket] = pg;
+    pagecache_npages++;
+
+    entry->pte_word |= PTE_CACHED;
+    pte_addsharer(entry);
+    return 0;
+}
+
+/* pagecache_release() */
+void pagecache_release(struct pte *entry)
+{
+    assert(curspl>0);
+
+    struct pc_page *pg = (struct pc_page *)entry;
+    struct pc_page **link;
+
+    assert(entry->pte_word & PTE_CACHED);
+    assert(pte_sharers(entry) == 0);
+    assert(PTE_PADDR(entry) == 0);
+
+    for(link = &pagecache_buckets[pagecache_hash(pg->pc_file, pg->pc_offset)]; *link != pg; link = &(*link)->pc_next) {
+        assert(*link != NULL);
+    }
+    *link = pg->pc_next;
+    pagecache_npages--;
+    vmstat.vs_pcreclaims++;
+
+    VOP_DECREF(pg->pc_file);
+    kfree(pg);
+}
+
+/* pagecache_count() */
+int pagecache_count(void)
+{
+    return pagecache_npages;
+}
@@ -1,4 +1,3 @@
-
 #include <types.h>
 #include <pagetable.h>
 #include <coremap.h>
@@ -9,7 +8,6 @@
 #include <machine/vm.h>
 #include <machine/spl.h>
 #include <vm.h>
-#include <swap.h>
 
 
 /**************************************************
@@ -17,34 +15,56 @@
  **************************************************/
 
 /* pte_init() */
-struct pte *pte_init() 
+struct pte *pte_init()
 {
-    struct pte *entry = kmalloc(sizeof(struct pte));
-    if(entry == NULL) {
+    struct pte_shared *ps = kmalloc(sizeof(struct pte_shared));
+    if(ps == NULL) {
         return NULL;
     }
-    entry->ppageaddr = 0;
-    entry->permissions = set_permissions(0,0,0);
-    entry->swap_state = PTE_NONE;
-    entry->swap_location = 0;
-    entry->num_sharers = 0;
-    return entry;
+    ps->ps_pte.pte_word = PTE_OUTOFLINE;
+    PTE_SET_PERMS(&ps->ps_pte, set_permissions(0,0,0));
+    PTE_SET_STATE(&ps->ps_pte, PTE_NONE);
+    ps->ps_pte.swap_location = 0;
+    ps->ps_sharers = 0;
+    return &ps->ps_pte;
 }
 
-/* pte_copy() */
-void pte_copy(struct pte *src, struct pte *dest) 
+/* pte_copy() copies the page, not the flags that say where the entry lives */
+void pte_copy(struct pte *src, struct pte *dest)
 {
-    dest->ppageaddr = src->ppageaddr;
-    dest->permissions = src->permissions;
-    dest->swap_state = src->swap_state;
+    dest->pte_word = (dest->pte_word & ~PTE_PAGEBITS) | (src->pte_word & PTE_PAGEBITS);
     dest->swap_location = src->swap_location;
-    dest->num_sharers = src->num_sharers;
 }
 
 /* pte_destroy() */
-void pte_destroy(struct pte *entry) 
+void pte_destroy(struct pte *entry)
+{
+    assert(entry->pte_word & PTE_OUTOFLINE);    /* slots are freed with their leaf */
+    kfree((struct pte_shared *)entry);
+}
+
+/* pte_sharers() */
+int pte_sharers(struct pte *entry)
+{
+    if((entry->pte_word & PTE_OUTOFLINE) == 0) {
+        return 0;
+    }
+    return ((struct pte_shared *)entry)->ps_sharers;
+}
+
+/* pte_addsharer() */
+void pte_addsharer(struct pte *entry)
 {
-    kfree(entry);
+    assert(entry->pte_word & PTE_OUTOFLINE);
+    ((struct pte_shared *)entry)->ps_sharers += 1;
+}
+
+/* pte_dropsharer() */
+void pte_dropsharer(struct pte *entry)
+{
+    assert(entry->pte_word & PTE_OUTOFLINE);
+    assert(((struct pte_shared *)entry)->ps_sharers > 0);
+    ((struct pte_shared *)entry)->ps_sharers -= 1;
 }
 
 
@@ -53,647 +73,498 @@ void pte_destroy(struct pte *entry)
  * Operations on page tables
  ********************************************/
 
-#if !OPT_TWOLEVELPAGETABLE
-
-/* initialize a new page table */
-pagetable_t pt_init() 
+/* reset a slot to free */
+static void pt_slot_clear(struct pte *slot)
 {
-    struct pte_container *head = (struct pte_container *)kmalloc(sizeof(struct pte_container));
-    if(head == NULL) {
-        return NULL;
-    }
-    head->first_idx = 0;
-    head->pte_array = NULL;
-    head->next = NULL;
-    return head;
+    slot->pte_word = 0;             /* no frame, PTE_NONE, no permissions */
+    slot->swap_location = 0;
 }
 
-/* add entry into the page table */
-int pt_add(pagetable_t pt, vaddr_t vaddr, struct pte *entry)
-{
-    assert(pt != NULL);
-    assert( (vaddr > 0) && (vaddr < MIPS_KSEG0) );
+/* the entry a slot in use refers to */
+#define PT_SLOT_ENTRY(slot) \
+    (((slot)->pte_word & PTE_SHARED) ? (struct pte *)(slot)->swap_location : (slot))
 
-    u_int32_t first_idx = PT_VADDR_TO_FIRST_INDEX(vaddr);
-    u_int32_t second_idx = PT_VADDR_TO_SECOND_INDEX(vaddr);
+/* leaves are whole pages, the coremap keeps count of the page tables sharing them */
+#define PT_SLOT_LEAF(slot)  ((struct pt_leaf *)((vaddr_t)(slot) & PAGE_FRAME))
+#define PT_LEAF_REFS(leaf)  (coremap[((vaddr_t)(leaf) - MIPS_KSEG0) >> PAGE_OFFSET].pt_refs)
 
-    struct pte_container *head = pt;
-    struct pte_container *it = pt;
-    struct pte_container *tail = NULL;
+/*
+ * pt_leaf_unshare()
+ * Give the page table that owns dir a private copy of its leaf at dir_idx. Both leaves then map
+ * the same pages, so every private page in the leaf is moved out of line first, and each shared
+ * entry gets one more sharer. The copy itself is done without sleeping, since the other page
+ * tables keep using the leaf. Returns ENOMEM on error, and the leaf stays shared.
+ */
+static int pt_leaf_unshare(struct pt_dir *dir, u_int32_t dir_idx)
+{
     unsigned i;
-
-    /* Loop through the linked list */
-    while(1) {
-        if(it->first_idx == first_idx) {
-            assert(it->pte_array[second_idx] == NULL);
-            it->pte_array[second_idx] = entry;
-            goto pt_add_done;
-        }
-        if(it->next != NULL) {
-            it = it->next;
-        }
-        else {
-            break;
+    int needed;
+    int nspares = 0;
+    paddr_t busy;
+    struct pt_leaf *leaf = dir->pd_leaves[dir_idx];
+    struct pt_leaf *copy = NULL;
+    struct pte *spares = NULL;
+    struct pte *slot;
+    struct pte *entry;
+    int err = 0;
+    int spl = splhigh();
+
+    /*
+     * Get everything we need first. Every allocation may sleep, and the other page tables may
+     * let go of the leaf or move pages out of line meanwhile, so look again after each one.
+     */
+    while(PT_LEAF_REFS(leaf) > 1) {
+        if(copy == NULL) {
+            copy = (struct pt_leaf *)alloc_kpages(1);
+            if(copy == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            continue;
         }
-    }
 
-    tail = it;
-
-    /* Didn't find a suitable entry, create a new entry */
-    if(head->pte_array == NULL) {
-        /* This means the page table is empty. We fill out the first entry */
-        head->first_idx = first_idx;
-        head->pte_array = (struct pte **)kmalloc(PT_PTE_ARRAY_NUM_ENTRIES * sizeof(struct pte *));
-        if(head->pte_array == NULL) {
-            return ENOMEM;          /* If add fails, pt will be destroyed by as_destroy */
-        } 
-        for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-            head->pte_array[i] = NULL;
+        needed = 0;
+        busy = 0;
+        for(i=0; i<PT_LEAF_ENTRIES; i++) {
+            slot = &leaf->pl_slots[i];
+            if((slot->pte_word & (PTE_INUSE | PTE_SHARED)) != PTE_INUSE) {
+                continue;
+            }
+            needed++;
+            if(PTE_PADDR(slot) != 0 && coremap_is_busy(PTE_PADDR(slot))) {
+                busy = PTE_PADDR(slot);
+            }
         }
 
-        head->pte_array[second_idx] = entry;
-        assert(head->next == NULL);
-        goto pt_add_done;
-    }
-    else {
-        /* Allocate for the next one at the end of the tail */
-        assert(tail->next == NULL);
-
-        /* Allocate the pte_container */
-        tail->next = (struct pte_container *)kmalloc( sizeof(struct pte_container) );
-
-        /* Set the first idx and allocate space for the array */
-        tail->next->first_idx = first_idx;
-        tail->next->pte_array = (struct pte **)kmalloc(PT_PTE_ARRAY_NUM_ENTRIES * sizeof(struct pte *));
-        if(tail->next->pte_array == NULL) {
-            return ENOMEM;          /* If add fails, pt will be destroyed by as_destroy */
+        /* a page in or page out holds on to the slot, let it finish */
+        if(busy != 0) {
+            coremap_busy_wait(busy);
+            continue;
         }
-        for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-            tail->next->pte_array[i] = NULL;
+
+        if(nspares < needed) {
+            entry = pte_init();
+            if(entry == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            entry->swap_location = (u_int32_t)spares;
+            spares = entry;
+            nspares++;
+            continue;
         }
 
-        /* Add the entry into the pte_array and set the next pointer to NULL */
-        tail->next->pte_array[second_idx] = entry;
-        tail->next->next = NULL;
-        goto pt_add_done;
-    }
+        /* No sleeping from here on */
+        for(i=0; i<PT_LEAF_ENTRIES; i++) {
+            slot = &leaf->pl_slots[i];
+            if((slot->pte_word & PTE_INUSE) == 0) {
+                pt_slot_clear(&copy->pl_slots[i]);
+                continue;
+            }
 
-pt_add_done:
-    return 0;
-}
+            if((slot->pte_word & PTE_SHARED) == 0) {
+                entry = spares;
+                spares = (struct pte *)entry->swap_location;
+                nspares--;
 
-/* get pte entry */
-struct pte *pt_get(pagetable_t pt, vaddr_t vaddr)
-{
-    //assert(pt != NULL && pt->pte_array != NULL);
-    assert(pt != NULL);
-    if( pt->pte_array == NULL ){
-        return NULL;
-    }
+                pte_copy(slot, entry);
+                if(PTE_PADDR(entry) != 0) {
+                    coremap_set_ptentry(PTE_PADDR(entry), entry);
+                }
+                pt_slot_clear(slot);
+                slot->swap_location = (u_int32_t)entry;
+                slot->pte_word |= PTE_INUSE | PTE_SHARED;
+            }
 
-    u_int32_t first_idx = PT_VADDR_TO_FIRST_INDEX(vaddr);
-    u_int32_t second_idx = PT_VADDR_TO_SECOND_INDEX(vaddr);
+            copy->pl_slots[i] = *slot;
+            pte_addsharer(PT_SLOT_ENTRY(slot));
+        }
 
-    struct pte_container *it = pt;
-    struct pte *entry;
+        PT_LEAF_REFS(leaf) -= 1;
+        PT_LEAF_REFS(copy) = 1;
+        dir->pd_leaves[dir_idx] = copy;
+        copy = NULL;
+        vmstat.vs_ptsplits++;
+        break;
+    }
 
-    while(1) {
-        if(it->first_idx == first_idx) {
-            entry = it->pte_array[second_idx];
-            return entry;
-        }
-        if(it->next != NULL) {
-            it = it->next;
-        }
-        else {
-            break;
-        }
+    while(spares != NULL) {
+        entry = spares;
+        spares = (struct pte *)entry->swap_location;
+        pte_destroy(entry);
+    }
+    if(copy != NULL) {
+        free_kpages((vaddr_t)copy);
     }
 
-    return NULL;
+    splx(spl);
+    return err;
 }
 
-
-/* 
- * get the next populated vaddr 
- * Note, get next does not get the next vaddr in order! it just simply the order of the linked list...
- * If someone calls pt_getnext(pt, 0), we return the first vaddr in the linked list...
+/*
+ * pt_slot()
+ * Find the slot for vaddr. If modify is set, missing levels are allocated and a shared leaf is
+ * made private on the way. Otherwise we return NULL when there is no slot. Also NULL if we run
+ * out of memory.
  */
-vaddr_t pt_getnext(pagetable_t pt, vaddr_t vaddr)
+static struct pte *pt_slot(pagetable_t pt, vaddr_t vaddr, int modify)
 {
-    assert(pt != NULL && pt->pte_array != NULL);
-
-    u_int32_t first_idx = PT_VADDR_TO_FIRST_INDEX(vaddr);
-    u_int32_t second_idx = PT_VADDR_TO_SECOND_INDEX(vaddr);
-
-    struct pte_container *it = pt;
     unsigned i;
+    struct pt_dir *dir;
+    struct pt_leaf *leaf;
+    u_int32_t top_idx = PT_TOP_INDEX(vaddr);
+    u_int32_t dir_idx = PT_DIR_INDEX(vaddr);
 
-    /* Return first valid entry in page table */
-    if(vaddr == 0) {
-        for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-            if(pt->pte_array[i] != NULL) {
-                return PT_INDEX_TO_VADDR(pt->first_idx, i);
-            }
-        }
+    assert(pt != NULL);
+    if(vaddr >= MIPS_KSEG0) {
+        return NULL;
     }
 
-    /* Get to the first current vaddr */
-    while(1) {
-        if(it->first_idx == first_idx) {
-            break;
+    dir = pt->pt_dirs[top_idx];
+    if(dir == NULL) {
+        if(!modify) {
+            return NULL;
         }
-        else if(it->next != NULL) {
-            it = it->next;
+        dir = (struct pt_dir *)kmalloc(sizeof(struct pt_dir));
+        if(dir == NULL) {
+            return NULL;
         }
-        else {
-            return 0; /* Could not find vaddr */
+        for(i=0; i<PT_DIR_ENTRIES; i++) {
+            dir->pd_leaves[i] = NULL;
         }
+        pt->pt_dirs[top_idx] = dir;
     }
 
-    /* Return the next one */
-    while(1) {
-        if(it->first_idx == first_idx) {
-            for(i=second_idx+1; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-                if(it->pte_array[i] != NULL) {
-                    return PT_INDEX_TO_VADDR(it->first_idx, i);
-                }
-            }
+    leaf = dir->pd_leaves[dir_idx];
+    if(leaf == NULL) {
+        if(!modify) {
+            return NULL;
         }
-        else {
-            for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-                if(it->pte_array[i] != NULL) {
-                    return PT_INDEX_TO_VADDR(it->first_idx, i);
-                }
-            }
+        leaf = (struct pt_leaf *)alloc_kpages(1);
+        if(leaf == NULL) {
+            return NULL;
         }
-        if(it->next != NULL) {
-            it = it->next;
+        for(i=0; i<PT_LEAF_ENTRIES; i++) {
+            pt_slot_clear(&leaf->pl_slots[i]);
         }
-        else {
-            break;
+        PT_LEAF_REFS(leaf) = 1;
+        dir->pd_leaves[dir_idx] = leaf;
+    }
+    else if(modify && PT_LEAF_REFS(leaf) > 1) {
+        if(pt_leaf_unshare(dir, dir_idx)) {
+            return NULL;
         }
+        leaf = dir->pd_leaves[dir_idx];
     }
 
-    return 0;
+    return &leaf->pl_slots[PT_LEAF_INDEX(vaddr)];
 }
 
-/* 
- * copy a page table
- * This is only meant to be called to copy pages to a fresh page table 
- */
-int pt_copy(pagetable_t src, pagetable_t dest)
+/* initialize a new page table */
+pagetable_t pt_init()
 {
-    assert(src != NULL && src->pte_array != NULL && dest != NULL);
     unsigned i;
-
-    int spl = splhigh(); /* Working with two page tables, lets be careful */
-
-    while(1) {
-        dest->first_idx = src->first_idx;
-        assert(dest->pte_array == NULL);
-        dest->pte_array = (struct pte **)kmalloc(PT_PTE_ARRAY_NUM_ENTRIES * sizeof(struct pte *));
-        if(dest->pte_array == NULL) {
-            splx(spl);
-            return ENOMEM;
-        }
-
-        for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-            if(src->pte_array[i] != NULL){
-
-                dest->pte_array[i] = pte_init();
-                if(dest->pte_array[i] == NULL) {
-                    splx(spl);
-                    return ENOMEM;
-                }
-
-                pte_copy(src->pte_array[i], dest->pte_array[i]);
-            }
-            else {
-                dest->pte_array[i] = NULL;
-            }
-        }
-
-        if(src->next != NULL) {
-            src = src->next;
-
-            assert(dest->next == NULL);
-
-            dest->next = (struct pte_container *)kmalloc(sizeof(struct pte_container));
-            if(dest->next == NULL) {
-                splx(spl);
-                return ENOMEM;
-            }
-            
-            dest->next->first_idx = 0;
-            dest->next->pte_array = NULL;
-            dest->next->next = NULL;
-
-            dest = dest->next;
-        }
-        else {
-            break;
-        }
+    pagetable_t pt = (pagetable_t)kmalloc(sizeof(struct pagetable));
+    if(pt == NULL) {
+        return NULL;
     }
-
-    splx(spl);
-    return 0;
+    for(i=0; i<PT_TOP_ENTRIES; i++) {
+        pt->pt_dirs[i] = NULL;
+    }
+    return pt;
 }
 
-/* Have the two page tables share the same pte's */
-int pt_copy_shallow(pagetable_t src, pagetable_t dest)
+/* reserve the slot for a private page */
+struct pte *pt_alloc(pagetable_t pt, vaddr_t vaddr)
 {
-    assert(src != NULL && src->pte_array != NULL && dest != NULL);
-    unsigned i;
-
-    int spl = splhigh(); /* Working with two page tables, lets be careful */
-
-    while(1) {
-        dest->first_idx = src->first_idx;
-        assert(dest->pte_array == NULL);
-        dest->pte_array = (struct pte **)kmalloc(PT_PTE_ARRAY_NUM_ENTRIES * sizeof(struct pte *));
-        if(dest->pte_array == NULL) {
-            splx(spl);
-            return ENOMEM;
-        }
-
-        for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-            if(src->pte_array[i] != NULL){
-                dest->pte_array[i] = src->pte_array[i];
-            }
-            else {
-                dest->pte_array[i] = NULL;
-            }
-        }
+    assert( (vaddr > 0) && (vaddr < MIPS_KSEG0) );
 
-        if(src->next != NULL) {
-            src = src->next;
+    struct pte *slot = pt_slot(pt, vaddr, 1);
+    if(slot == NULL) {
+        return NULL;
+    }
+    assert((slot->pte_word & PTE_INUSE) == 0);
 
-            assert(dest->next == NULL);
+    pt_slot_clear(slot);
+    slot->pte_word |= PTE_INUSE;
+    return slot;
+}
 
-            dest->next = (struct pte_container *)kmalloc(sizeof(struct pte_container));
-            if(dest->next == NULL) {
-                splx(spl);
-                return ENOMEM;
-            }
-            
-            dest->next->first_idx = 0;
-            dest->next->pte_array = NULL;
-            dest->next->next = NULL;
+/* point the slot for vaddr at a shared entry */
+int pt_add_shared(pagetable_t pt, vaddr_t vaddr, struct pte *shared)
+{
+    assert( (vaddr > 0) && (vaddr < MIPS_KSEG0) );
+    assert( shared != NULL && (shared->pte_word & PTE_OUTOFLINE) );
 
-            dest = dest->next;
-        }
-        else {
-            break;
-        }
+    struct pte *slot = pt_slot(pt, vaddr, 1);
+    if(slot == NULL) {
+        return ENOMEM;
     }
+    assert((slot->pte_word & PTE_INUSE) == 0);
 
-    splx(spl);
+    pt_slot_clear(slot);
+    slot->swap_location = (u_int32_t)shared;
+    slot->pte_word |= PTE_INUSE | PTE_SHARED;
     return 0;
 }
 
-
-/* remove entry from the page table */
-void pt_remove(pagetable_t pt, vaddr_t vaddr)
+/* make the leaf mapping vaddr private */
+int pt_unshare(pagetable_t pt, vaddr_t vaddr)
 {
-    assert(pt != NULL && pt->pte_array != NULL);
+    struct pt_dir *dir;
+    u_int32_t dir_idx = PT_DIR_INDEX(vaddr);
 
-    u_int32_t first_idx = PT_VADDR_TO_FIRST_INDEX(vaddr);
-    u_int32_t second_idx = PT_VADDR_TO_SECOND_INDEX(vaddr);
+    assert(pt != NULL);
+    if(vaddr >= MIPS_KSEG0) {
+        return 0;
+    }
 
-    struct pte_container *it = pt;
+    dir = pt->pt_dirs[PT_TOP_INDEX(vaddr)];
+    if(dir == NULL || dir->pd_leaves[dir_idx] == NULL || PT_LEAF_REFS(dir->pd_leaves[dir_idx]) == 1) {
+        return 0;
+    }
+    return pt_leaf_unshare(dir, dir_idx);
+}
 
-    while(1) {
-        if(it->first_idx == first_idx) {
-            it->pte_array[second_idx] = NULL;
-            return;
-        }
-        if(it->next != NULL) {
-            it = it->next;
-        }
-        else {
-            return;
-        }
+/* is the page at vaddr mapped by anybody else */
+int pt_isshared(pagetable_t pt, vaddr_t vaddr)
+{
+    struct pte *slot = pt_slot(pt, vaddr, 0);
+    if(slot == NULL || (slot->pte_word & PTE_INUSE) == 0) {
+        return 0;
     }
+    return (PT_LEAF_REFS(PT_SLOT_LEAF(slot)) > 1 || pte_sharers(PT_SLOT_ENTRY(slot)) > 0);
 }
 
+/* get pte entry */
+struct pte *pt_get(pagetable_t pt, vaddr_t vaddr)
+{
+    struct pte *slot = pt_slot(pt, vaddr, 0);
+    if(slot == NULL || (slot->pte_word & PTE_INUSE) == 0) {
+        return NULL;
+    }
+    return PT_SLOT_ENTRY(slot);
+}
 
-/* 
- * destroy page table 
- * This is such an awful way to destroy everything. But I'm pressed on time :/
+/*
+ * Find the first slot in use at or after the given position, in address order. The walk ends
+ * with pi_leaf set to NULL.
  */
-void pt_destroy(pagetable_t pt)
+static void pt_iter_seek(struct pt_iter *it, u_int32_t top_idx, u_int32_t dir_idx, u_int32_t leaf_idx)
 {
-    struct pte_container *it;
-    struct pte_container *head;
-    unsigned i;
-    assert( lock_do_i_hold(swap_lock) );
-    
-    head = pt;
-
-    while(1) {
-        it = head;
-        while(1) {
-            if(it->next == NULL) {
-                break;
-            }
+    struct pt_dir *dir;
+    struct pt_leaf *leaf;
 
-            if(it->next->next == NULL) {
-                /* destroy the last pte_container */
-                for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-                    if(it->next->pte_array[i] != NULL) {
-                        if(it->next->pte_array[i]->ppageaddr != 0) {
-                            free_upage(it->next->pte_array[i]);
-                        }
-                    }
-                }
-                kfree(it->next->pte_array);
-                kfree(it->next);
-                it->next = NULL;
-                break;
-            }
-            else {
-                it = it->next;
-            }
+    for(; top_idx<PT_TOP_ENTRIES; top_idx++, dir_idx=0, leaf_idx=0) {
+        dir = it->pi_pt->pt_dirs[top_idx];
+        if(dir == NULL) {
+            continue;
         }
-        if(it == head) {
-            if(head->pte_array != NULL) {
-                for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-                    if(head->pte_array[i] != NULL) {
-                        if(head->pte_array[i]->ppageaddr != 0) {
-                            free_upage(head->pte_array[i]);
-                        }
-                    }
+        for(; dir_idx<PT_DIR_ENTRIES; dir_idx++, leaf_idx=0) {
+            leaf = dir->pd_leaves[dir_idx];
+            if(leaf == NULL) {
+                continue;
+            }
+            for(; leaf_idx<PT_LEAF_ENTRIES; leaf_idx++) {
+                if(leaf->pl_slots[leaf_idx].pte_word & PTE_INUSE) {
+                    it->pi_top = top_idx;
+                    it->pi_dir = dir_idx;
+                    it->pi_idx = leaf_idx;
+                    it->pi_leaf = leaf;
+                    return;
                 }
-                kfree(head->pte_array);
             }
-            kfree(head);
-            return;
         }
     }
-}
 
+    it->pi_leaf = NULL;
+}
 
-/* dump all contents of pagetable to console */
-void pt_dump(pagetable_t pt)
+/* pt_iter_begin() */
+void pt_iter_begin(pagetable_t pt, struct pt_iter *it)
 {
-    struct pte_container *it;
-    unsigned i;
-    vaddr_t vaddr;
-
-    it = pt;
-
-    while(1) {
-        if(it != NULL && it->pte_array != NULL) {
-            for(i=0; i<PT_PTE_ARRAY_NUM_ENTRIES; i++) {
-                vaddr = PT_INDEX_TO_VADDR(it->first_idx, i);
-                kprintf("Vaddr: 0x%08x  |  Paddr: 0x%08x  |  Permissions: %d\n", 
-                        vaddr, it->pte_array[i]->ppageaddr, it->pte_array[i]->permissions);
-            }
-            it = it->next;
-        }
-        else {
-            break;
-        }
-    }
-
+    assert(pt != NULL);
+    it->pi_pt = pt;
+    pt_iter_seek(it, 0, 0, 0);
 }
 
-
-
-
-
-
-
-#else
-
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-/******************************************************************************************************************************/
-
-/*
- * This is the two level page table implementation:
- * Although faster, we shouldn't be using this anymore as it simply takes up too much memory!
- */
-
-/* Machine dependant stuff */
-u_int32_t pt_vaddr_to_first_index(vaddr_t addr) {
-    int idx = ((addr >> PAGE_OFFSET) >> PT_SECOND_LAYER_OFFSET);
-    return idx;
-}
-u_int32_t pt_vaddr_to_second_index(vaddr_t addr) {
-    int idx = ((addr >> PAGE_OFFSET) & PT_SECOND_LAYER_MASK);
-    return idx;
-}
-vaddr_t idx_to_vaddr(u_int32_t first_idx, u_int32_t second_idx) {
-    return ( ((first_idx << (PAGE_OFFSET)) << PT_SECOND_LAYER_OFFSET) | (second_idx << PAGE_OFFSET) );
+/* pt_iter_from() */
+void pt_iter_from(pagetable_t pt, vaddr_t vaddr, struct pt_iter *it)
+{
+    assert(pt != NULL);
+    it->pi_pt = pt;
+    pt_iter_seek(it, PT_TOP_INDEX(vaddr), PT_DIR_INDEX(vaddr), PT_LEAF_INDEX(vaddr));
 }
 
-
-/* pt_init() */
-pagetable_t pt_init() 
+/* pt_iter_next() */
+void pt_iter_next(struct pt_iter *it)
 {
-    unsigned i;
-    pagetable_t pt;
+    assert(it->pi_leaf != NULL);
+    pt_iter_seek(it, it->pi_top, it->pi_dir, it->pi_idx + 1);
+}
 
-    pt = (pagetable_t)kmalloc(PT_FIRST_LAYER_SIZE * sizeof(struct pte **));
-    if(pt == NULL) {
-        return NULL;
+/* pt_iter_vaddr() */
+vaddr_t pt_iter_vaddr(struct pt_iter *it)
+{
+    if(it->pi_leaf == NULL) {
+        return 0;
     }
+    return PT_INDEX_TO_VADDR(it->pi_top, it->pi_dir, it->pi_idx);
+}
 
-    for(i=0; i<PT_FIRST_LAYER_SIZE; i++) {
-        pt[i] = NULL;
-    }
-    return pt;
+/* pt_iter_pte() */
+struct pte *pt_iter_pte(struct pt_iter *it)
+{
+    assert(it->pi_leaf != NULL);
+    return PT_SLOT_ENTRY(&it->pi_leaf->pl_slots[it->pi_idx]);
 }
 
+/* pt_iter_remove() */
+void pt_iter_remove(struct pt_iter *it)
+{
+    assert(it->pi_leaf != NULL);
+    assert(PT_LEAF_REFS(it->pi_leaf) == 1);
+    pt_slot_clear(&it->pi_leaf->pl_slots[it->pi_idx]);
+}
 
-/* 
- * pt_add() 
- * Create second layer tables on demand. Return non-zero value on error
- * We don't allocate memory for a pte here, do that before you call pt_add
+/*
+ * copy a page table
+ * This is only meant to be called to copy pages to a fresh page table. Every page gets a private
+ * copy of its entry, the caller fixes up the mappings.
  */
-int pt_add(pagetable_t pt, vaddr_t addr, struct pte *entry) 
+int pt_copy(pagetable_t src, pagetable_t dest)
 {
-    unsigned i;
-    u_int32_t first_layer_idx = pt_vaddr_to_first_index(addr);
-    u_int32_t second_layer_idx = pt_vaddr_to_second_index(addr);
-    
-    if(pt[first_layer_idx] == NULL) {
-        pt[first_layer_idx] = (struct pte **)kmalloc(PT_SECOND_LAYER_SIZE * sizeof(struct pte *));
-        if(pt[first_layer_idx] == NULL) {
+    assert(src != NULL && dest != NULL);
+
+    struct pt_iter it;
+    struct pte *copy;
+
+    for(pt_iter_begin(src, &it); pt_iter_vaddr(&it) != 0; pt_iter_next(&it)) {
+        copy = pt_alloc(dest, pt_iter_vaddr(&it));
+        if(copy == NULL) {
             return ENOMEM;
         }
-        for(i=0; i<PT_SECOND_LAYER_SIZE; i++) {
-            pt[first_layer_idx][i] = NULL;
-        }
+        pte_copy(pt_iter_pte(&it), copy);
     }
 
-    pt[first_layer_idx][second_layer_idx] = entry;
     return 0;
 }
 
-
 /*
- * pt_get()
- * Get a pagetable entry
+ * Have the two page tables share the same leaves
+ * dest gets its own upper levels, pointing at the leaves of src. Nothing below a leaf is touched,
+ * so this is as cheap as copying the directories. The first change either side makes to a leaf
+ * gives it a private copy, see pt_leaf_unshare(). dest must be empty.
  */
-struct pte *pt_get(pagetable_t pt, vaddr_t addr) {
-    u_int32_t first_layer_idx = pt_vaddr_to_first_index(addr);
-    u_int32_t second_layer_idx = pt_vaddr_to_second_index(addr);
-
-    if(pt[first_layer_idx] == NULL) {
-        return NULL;
-    }
-    return pt[first_layer_idx][second_layer_idx];
-}
-
+int pt_copy_shallow(pagetable_t src, pagetable_t dest)
+{
+    assert(src != NULL && dest != NULL);
 
-/*
- * pt_getnext()
- * Get the next populated vaddr table entry
- */
-vaddr_t pt_getnext(pagetable_t pt, vaddr_t addr) {
+    unsigned i, j;
+    int spl;
+    struct pt_dir *dir;
+    struct pt_leaf *leaf;
 
-    u_int32_t first_layer_idx = pt_vaddr_to_first_index(addr);
-    u_int32_t second_layer_idx = pt_vaddr_to_second_index(addr);
+    for(i=0; i<PT_TOP_ENTRIES; i++) {
+        if(src->pt_dirs[i] == NULL) {
+            continue;
+        }
+        assert(dest->pt_dirs[i] == NULL);
 
-    unsigned i, j;
-    if(pt[first_layer_idx] != NULL) {
-        for(j=second_layer_idx+1; j<PT_SECOND_LAYER_SIZE; j++) {
-            if(pt[first_layer_idx][j] != NULL)
-                return idx_to_vaddr(first_layer_idx, j);
+        dir = (struct pt_dir *)kmalloc(sizeof(struct pt_dir));
+        if(dir == NULL) {
+            return ENOMEM;
         }
-    }
 
-    for(i=first_layer_idx+1; i<PT_FIRST_LAYER_SIZE; i++) {
-        if(pt[i] == NULL)
-            continue;
-        else {
-            for(j=0; j<PT_SECOND_LAYER_SIZE; j++) {
-                if(pt[i][j] == NULL)
-                    continue;
-                else {
-                    return idx_to_vaddr(i, j);
-                }
+        spl = splhigh();
+        for(j=0; j<PT_DIR_ENTRIES; j++) {
+            leaf = src->pt_dirs[i]->pd_leaves[j];
+            dir->pd_leaves[j] = leaf;
+            if(leaf != NULL) {
+                PT_LEAF_REFS(leaf) += 1;
             }
         }
+        dest->pt_dirs[i] = dir;
+        splx(spl);
     }
 
     return 0;
 }
 
+/* remove entry from the page table */
+void pt_remove(pagetable_t pt, vaddr_t vaddr)
+{
+    struct pte *slot = pt_slot(pt, vaddr, 0);
+    if(slot != NULL) {
+        assert(PT_LEAF_REFS(PT_SLOT_LEAF(slot)) == 1);
+        pt_slot_clear(slot);
+    }
+}
 
 /*
- * pt_copy()
- * Deep copies and entire page table, including its entries.
- * Notice that the mappings will be exactly the same. It is up to the rest of the VM system to update them
- * Returns on error.
+ * destroy page table
+ * Every page still mapped is freed, or our share of it given up.
  */
-int pt_copy(pagetable_t src, pagetable_t dest) {
+void pt_destroy(pagetable_t pt)
+{
     unsigned i, j;
+    struct pt_dir *dir;
+    struct pt_iter it;
     struct pte *entry;
-    for(i=0; i<PT_FIRST_LAYER_SIZE; i++) {
-        if(src[i] == NULL)
+    int spl = splhigh();
+
+    /* 
+     * Leaves shared with other page tables are simply left to them. This has to happen before
+     * we sleep, or one of them may make its copy and leave the leaf to us halfway through.
+     */
+    for(i=0; i<PT_TOP_ENTRIES; i++) {
+        dir = pt->pt_dirs[i];
+        if(dir == NULL) {
             continue;
-        else {
-            for(j=0; j<PT_SECOND_LAYER_SIZE; j++) {
-                if(src[i][j] == NULL)
-                    continue;
-                else {
-                    entry = pte_init();
-                    if(entry == NULL) {
-                        return ENOMEM;
-                    }
-                    /* Copy the pte and then add it to the new page table */
-                    pte_copy(src[i][j], entry);
-                    pt_add(dest, idx_to_vaddr(i, j) ,entry);
-                    dest[i][j] = entry;
-                }
+        }
+        for(j=0; j<PT_DIR_ENTRIES; j++) {
+            if(dir->pd_leaves[j] != NULL && PT_LEAF_REFS(dir->pd_leaves[j]) > 1) {
+                PT_LEAF_REFS(dir->pd_leaves[j]) -= 1;
+                dir->pd_leaves[j] = NULL;
             }
-        }   
+        }
     }
-    return 0;
-}
-
-/*
- * pt_remove()
- * Remove a pagetable entry
- */
-void pt_remove(pagetable_t pt, vaddr_t addr) {
-    u_int32_t first_layer_idx = pt_vaddr_to_first_index(addr);
-    u_int32_t second_layer_idx = pt_vaddr_to_second_index(addr); 
 
-    if(pt[first_layer_idx] == NULL || pt[first_layer_idx][second_layer_idx] == NULL) {
-        return;
+    for(pt_iter_begin(pt, &it); pt_iter_vaddr(&it) != 0; pt_iter_next(&it)) {
+        entry = pt_iter_pte(&it);
+        /* dropped file pages that are shared still need their share given back */
+        if(PTE_STATE(entry) != PTE_NONE || (entry->pte_word & PTE_OUTOFLINE)) {
+            free_upage(entry);
+        }
     }
-    
-    pt[first_layer_idx][second_layer_idx] = NULL;
-}
-
 
-/*
- * pt_destroy()
- * Destroy page table as well all its entries
- * This needs to be changed to deallocate the pages in the page table! 
- * It gets complicated for copy on write... like how do u know when to destroy a page...
- * 
- * right now just destroy all the pages, no copy on write right now
- */
-void pt_destroy(pagetable_t pt) {
-    unsigned i, j;
-    /* Deallocate everything */
-    for(i=0; i<PT_FIRST_LAYER_SIZE; i++) {
-        if(pt[i] == NULL)
+    for(i=0; i<PT_TOP_ENTRIES; i++) {
+        dir = pt->pt_dirs[i];
+        if(dir == NULL) {
             continue;
-        else {
-            for(j=0; j<PT_SECOND_LAYER_SIZE; j++) {
-                if(pt[i][j] != NULL) {
-                    /* Deallocate the pages */
-                    if(pt[i][j]->ppageaddr != 0){
-                        free_ppages(pt[i][j]->ppageaddr);   /* Free the physical page mapping */
-                    }
-                    /* Deallocate the pte */
-                    pte_destroy(pt[i][j]);
-                }
+        }
+        for(j=0; j<PT_DIR_ENTRIES; j++) {
+            if(dir->pd_leaves[j] != NULL) {
+                free_kpages((vaddr_t)dir->pd_leaves[j]);
             }
-            /* Deallocate layer 2 table */
-            kfree(pt[i]);
         }
+        kfree(dir);
     }
-    /* Deallocate layer 1 table */
     kfree(pt);
+
+    splx(spl);
 }
 
-/* Dump all contents of page table to console */
+
+/* dump all contents of pagetable to console */
 void pt_dump(pagetable_t pt)
 {
-    unsigned i, j;
-    vaddr_t vaddr;
-    kprintf("\n");
-    for(i=0; i<PT_FIRST_LAYER_SIZE; i++) {
-        if(pt[i] == NULL)
-            continue;
-        else {
-            for(j=0; j<PT_SECOND_LAYER_SIZE; j++) {
-                if(pt[i][j] == NULL)
-                    continue;
-                else {
-                    vaddr = idx_to_vaddr(i, j);
-                    kprintf("Vaddr: 0x%08x  |  Paddr: 0x%08x  |  Permissions: %d\n", vaddr, pt[i][j]->ppageaddr, pt[i][j]->permissions);
-                }
-            }
-        }
-    }   
-    kprintf("\n");
-}
-
+    struct pt_iter it;
+    struct pte *entry;
 
-#endif /* OPT_TWOLEVELPAGETABLE */
+    for(pt_iter_begin(pt, &it); pt_iter_vaddr(&it) != 0; pt_iter_next(&it)) {
+        entry = pt_iter_pte(&it);
+        kprintf("Vaddr: 0x%08x  |  Paddr: 0x%08x  |  Permissions: %d  |  Sharers: %d\n",
+                pt_iter_vaddr(&it), PTE_PADDR(entry), PTE_PERMS(entry), pte_sharers(entry));
+    }
+}
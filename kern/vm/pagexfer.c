@@ -0,0 +1,251 @@
+/*
+ * Zero copy page transfer between processes. See pagexfer.h for an overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <machine/spl.h>
+#include <synch.h>
+#include <thread.h>
+#include <curthread.h>
+#include <process.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <region.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <pagexfer.h>
+
+
+/* A receiver waiting for a sender. It lives on the receiver's stack */
+struct pagexfer {
+    pid_t px_pid;
+    struct addrspace *px_as;
+    vaddr_t px_addr;
+    size_t px_len;
+    int px_done;                    /* set by the sender once the pages moved */
+    int px_err;
+    size_t px_moved;
+    struct pagexfer *px_next;
+};
+
+/* receivers nobody sent to yet. Senders waiting for a receiver sleep on this too */
+static struct pagexfer *pagexfer_receivers = NULL;
+
+/* 
+ * pagexfer_checkrange()
+ * Is [addr, addr+len) page aligned and inside one anonymous writable region. Pages of other
+ * regions belong to a file or a segment and can't change hands.
+ */
+static int pagexfer_checkrange(struct addrspace *as, vaddr_t addr, size_t len)
+{
+    struct vm_region *region;
+
+    if(len == 0 || (addr & ~PAGE_FRAME) != 0 || (len & ~PAGE_FRAME) != 0 || addr + len < addr) {
+        return EINVAL;
+    }
+
+    region = region_find(as, addr);
+    if(region == NULL || region->vr_pager != &vm_anonpager || !is_writeable(region->vr_perms)) {
+        return EFAULT;
+    }
+    if(addr < region->vr_start || addr + len > region->vr_end) {
+        return EFAULT;
+    }
+    return 0;
+}
+
+/*
+ * pagexfer_movepage()
+ * Move the page at src in from to dst in to. Whatever to had at dst is freed. A private page
+ * keeps its frame or swap slot and only changes slots. A shared page (copy on write, the zero
+ * page) has its entry mapped by to instead, and the sender's share of it becomes the receiver's.
+ */
+static int pagexfer_movepage(struct addrspace *from, vaddr_t src, struct addrspace *to, vaddr_t dst)
+{
+    int err;
+    struct pte *entry, *old, *slot;
+
+    /* Both leaves have to be private before we change them */
+    err = pt_unshare(from->as_pagetable, src);
+    if(err) {
+        return err;
+    }
+    err = pt_unshare(to->as_pagetable, dst);
+    if(err) {
+        return err;
+    }
+
+    old = pt_get(to->as_pagetable, dst);
+    if(old != NULL) {
+        as_invalidatevaddr(to, dst);
+        free_upage(old);
+        pt_remove(to->as_pagetable, dst);
+    }
+
+    /* never touched, the receiver reads zeros as well */
+    entry = pt_get(from->as_pagetable, src);
+    if(entry == NULL) {
+        return 0;
+    }
+
+    if(entry->pte_word & PTE_OUTOFLINE) {
+        err = pt_add_shared(to->as_pagetable, dst, entry);
+        if(err) {
+            return err;
+        }
+    }
+    else {
+        slot = pt_alloc(to->as_pagetable, dst);
+        if(slot == NULL) {
+            return ENOMEM;
+        }
+
+        /* A page out holds on to the old slot until it is done, this is the last time we sleep */
+        while(PTE_PADDR(entry) != 0 && coremap_is_busy(PTE_PADDR(entry))) {
+            coremap_busy_wait(PTE_PADDR(entry));
+        }
+
+        pte_copy(entry, slot);
+        PTE_SET_PERMS(slot, region_find(to, dst)->vr_perms);
+        if(PTE_PADDR(slot) != 0) {
+            coremap_set_ptentry(PTE_PADDR(slot), slot);
+        }
+    }
+
+    as_invalidatevaddr(from, src);
+    pt_remove(from->as_pagetable, src);
+    vmstat.vs_xferpages++;
+    return 0;
+}
+
+/*
+ * pagexfer_move()
+ * Move the pages of a sender to the waiting receiver px. Stops at the first error, the pages
+ * moved until then stay moved.
+ */
+static int pagexfer_move(struct addrspace *as, vaddr_t addr, size_t len, struct pagexfer *px)
+{
+    int err;
+    size_t off;
+
+    if(len > px->px_len) {
+        len = px->px_len;
+    }
+
+    lock_acquire(as->as_lock);
+    lock_acquire(px->px_as->as_lock);
+
+    /* The receiver is asleep, so its range is still what it checked. Ours may have changed */
+    err = pagexfer_checkrange(as, addr, len);
+    for(off=0; err == 0 && off<len; off+=PAGE_SIZE) {
+        err = pagexfer_movepage(as, addr + off, px->px_as, px->px_addr + off);
+        if(err == 0) {
+            px->px_moved += PAGE_SIZE;
+        }
+    }
+
+    lock_release(px->px_as->as_lock);
+    lock_release(as->as_lock);
+    return err;
+}
+
+/* pagexfer_send() */
+int pagexfer_send(pid_t pid, vaddr_t addr, size_t len, size_t *moved)
+{
+    int err;
+    struct pagexfer *px, **pp;
+    struct addrspace *as = curthread->t_vmspace;
+    int spl = splhigh();
+
+    *moved = 0;
+    if(pid == curthread->t_pid) {
+        splx(spl);
+        return EINVAL;
+    }
+
+    lock_acquire(as->as_lock);
+    err = pagexfer_checkrange(as, addr, len);
+    lock_release(as->as_lock);
+    if(err) {
+        splx(spl);
+        return err;
+    }
+
+    /* Wait until pid is ready to receive */
+    for(;;) {
+        for(pp = &pagexfer_receivers; *pp != NULL; pp = &(*pp)->px_next) {
+            if((*pp)->px_pid == pid) {
+                break;
+            }
+        }
+        if(*pp != NULL) {
+            break;
+        }
+        if(!proc_alive(pid)) {
+            splx(spl);
+            return EINVAL;
+        }
+        thread_sleep(&pagexfer_receivers);
+    }
+    px = *pp;
+    *pp = px->px_next;
+
+    err = pagexfer_move(as, addr, len, px);
+
+    *moved = px->px_moved;
+    px->px_err = (px->px_moved > 0) ? 0 : err;
+    px->px_done = 1;
+    thread_wakeup(px);
+
+    splx(spl);
+    return (px->px_moved > 0) ? 0 : err;
+}
+
+/* pagexfer_recv() */
+int pagexfer_recv(vaddr_t addr, size_t len, size_t *moved)
+{
+    int err;
+    struct pagexfer px;
+    struct addrspace *as = curthread->t_vmspace;
+    int spl = splhigh();
+
+    *moved = 0;
+
+    lock_acquire(as->as_lock);
+    err = pagexfer_checkrange(as, addr, len);
+    lock_release(as->as_lock);
+    if(err) {
+        splx(spl);
+        return err;
+    }
+
+    px.px_pid = curthread->t_pid;
+    px.px_as = as;
+    px.px_addr = addr;
+    px.px_len = len;
+    px.px_done = 0;
+    px.px_err = 0;
+    px.px_moved = 0;
+    px.px_next = pagexfer_receivers;
+    pagexfer_receivers = &px;
+
+    /* Let a waiting sender know, and wait for it to move the pages */
+    thread_wakeup(&pagexfer_receivers);
+    while(!px.px_done) {
+        thread_sleep(&px);
+    }
+
+    *moved = px.px_moved;
+    splx(spl);
+    return px.px_err;
+}
+
+/* pagexfer_exit() */
+void pagexfer_exit(void)
+{
+    int spl = splhigh();
+    thread_wakeup(&pagexfer_receivers);
+    splx(spl);
+}
@@ -0,0 +1,326 @@
+/*
+ * Regions of a user address space and their pagers. See region.h for an overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <region.h>
+#include <vnode.h>
+
+
+/****************************************************************************************
+ ****** Pagers **************************************************************************
+ ****************************************************************************************/
+
+static int guard_fault(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype)
+{
+    (void) as;
+    (void) region;
+    (void) faultaddress;
+    (void) faulttype;
+    return EFAULT;
+}
+
+/* the copy reads from the same file, so it needs a reference of its own */
+static int file_copy(struct vm_region *src, struct vm_region *dest)
+{
+    (void) src;
+    if(dest->vr_file != NULL) {
+        VOP_INCREF(dest->vr_file);
+    }
+    return 0;
+}
+
+static void file_destroy(struct vm_region *region)
+{
+    if(region->vr_file != NULL) {
+        VOP_DECREF(region->vr_file);
+        region->vr_file = NULL;
+    }
+}
+
+const struct vm_pager vm_anonpager  = { "anon",  vm_anonfault, NULL,      NULL         };
+const struct vm_pager vm_filepager  = { "file",  vm_lodfault,  file_copy, file_destroy };
+const struct vm_pager vm_guardpager = { "guard", guard_fault,  NULL,      NULL         };
+
+
+/****************************************************************************************
+ ****** The region array ****************************************************************
+ ****************************************************************************************/
+
+/* the first size of the region array, it doubles when it fills up */
+#define REGION_MINSLOTS 8
+
+/*
+ * region_search()
+ * Index of the first region that ends above vaddr, as_nregions if there is none. Ends are in
+ * the same order as starts, since regions don't overlap.
+ */
+static int region_search(struct addrspace *as, vaddr_t vaddr)
+{
+    int lo = 0;
+    int hi = as->as_nregions;
+    int mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(as->as_regions[mid]->vr_end <= vaddr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * region_index()
+ * Index of region in the array. Only empty regions can end at the same address as their
+ * neighbours, so this hardly ever looks at more than one slot.
+ */
+static int region_index(struct addrspace *as, struct vm_region *region)
+{
+    int idx;
+
+    for(idx = region_search(as, region->vr_end - 1); idx < as->as_nregions; idx++) {
+        if(as->as_regions[idx] == region) {
+            return idx;
+        }
+    }
+    panic("region_index: region 0x%x not in addrspace", region->vr_start);
+    return -1;
+}
+
+/* Make room for one more region */
+static int region_grow(struct addrspace *as)
+{
+    struct vm_region **regions;
+    int maxregions;
+
+    if(as->as_nregions < as->as_maxregions) {
+        return 0;
+    }
+
+    maxregions = (as->as_maxregions > 0) ? 2*as->as_maxregions : REGION_MINSLOTS;
+    regions = kmalloc(maxregions*sizeof(struct vm_region *));
+    if(regions == NULL) {
+        return ENOMEM;
+    }
+    if(as->as_regions != NULL) {
+        memmove(regions, as->as_regions, as->as_nregions*sizeof(struct vm_region *));
+        kfree(as->as_regions);
+    }
+    as->as_regions = regions;
+    as->as_maxregions = maxregions;
+    return 0;
+}
+
+/* region_add() */
+int region_add(struct addrspace *as, vaddr_t start, vaddr_t end, permissions_t perms,
+                const struct vm_pager *pager, int flags, struct vm_region **ret)
+{
+    struct vm_region *region;
+    int idx, err;
+
+    start &= PAGE_FRAME;
+    end = (end + PAGE_SIZE - 1) & PAGE_FRAME;
+    if(end < start || end > USERTOP) {
+        return EINVAL;
+    }
+
+    /* The first region ending above start has to start at or above end */
+    idx = region_search(as, start);
+    if(idx < as->as_nregions && as->as_regions[idx]->vr_start < end) {
+        return EINVAL;
+    }
+
+    err = region_grow(as);
+    if(err) {
+        return err;
+    }
+
+    region = kmalloc(sizeof(struct vm_region));
+    if(region == NULL) {
+        return ENOMEM;
+    }
+    region->vr_start = start;
+    region->vr_end = end;
+    region->vr_perms = perms;
+    region->vr_flags = flags;
+    region->vr_pager = pager;
+    region->vr_file = NULL;
+    region->vr_filestart = start;
+    region->vr_fileoff = 0;
+    region->vr_filesize = 0;
+    region->vr_shm = NULL;
+
+    memmove(&as->as_regions[idx+1], &as->as_regions[idx], (as->as_nregions - idx)*sizeof(struct vm_region *));
+    as->as_regions[idx] = region;
+    as->as_nregions++;
+
+    if(ret != NULL) {
+        *ret = region;
+    }
+    return 0;
+}
+
+/* region_find() */
+struct vm_region *region_find(struct addrspace *as, vaddr_t vaddr)
+{
+    struct vm_region *region;
+    int idx = region_search(as, vaddr);
+
+    if(idx == as->as_nregions) {
+        return NULL;
+    }
+
+    region = as->as_regions[idx];
+    if(vaddr >= region->vr_start) {
+        return region;
+    }
+
+    /* In the gap below the region. The region below, if any, ends at or below vaddr */
+    if((region->vr_flags & VR_GROWSDOWN) && idx > 0) {
+        return region;
+    }
+    return NULL;
+}
+
+/* region_setend() */
+int region_setend(struct addrspace *as, struct vm_region *region, vaddr_t end)
+{
+    int idx;
+
+    end = (end + PAGE_SIZE - 1) & PAGE_FRAME;
+    assert(end >= region->vr_start);
+
+    if(end > region->vr_end) {
+        idx = region_index(as, region);
+        if(idx + 1 < as->as_nregions && as->as_regions[idx+1]->vr_start < end) {
+            return ENOMEM;
+        }
+        if(end > USERTOP) {
+            return ENOMEM;
+        }
+    }
+
+    region->vr_end = end;
+    return 0;
+}
+
+/* region_setfile() */
+void region_setfile(struct vm_region *region, struct vnode *v, vaddr_t vaddr, off_t offset, size_t filesize)
+{
+    assert(region->vr_pager == &vm_filepager);
+    assert(vaddr >= region->vr_start && vaddr + filesize <= region->vr_end);
+
+    VOP_INCREF(v);
+    if(region->vr_file != NULL) {
+        VOP_DECREF(region->vr_file);
+    }
+    region->vr_file = v;
+    region->vr_filestart = vaddr;
+    region->vr_fileoff = offset;
+    region->vr_filesize = filesize;
+}
+
+/* region_findgap() */
+int region_findgap(struct addrspace *as, size_t len, vaddr_t *ret)
+{
+    int idx;
+    vaddr_t lo, hi;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    if(len == 0) {
+        return EINVAL;
+    }
+
+    /* The gap below a region that grows down is taken, and so is everything below the first region */
+    for(idx = as->as_nregions - 1; idx > 0; idx--) {
+        if(as->as_regions[idx]->vr_flags & VR_GROWSDOWN) {
+            continue;
+        }
+        lo = as->as_regions[idx-1]->vr_end;
+        hi = as->as_regions[idx]->vr_start;
+        if(hi - lo >= len) {
+            *ret = hi - len;
+            return 0;
+        }
+    }
+    return ENOMEM;
+}
+
+/* region_remove() */
+void region_remove(struct addrspace *as, struct vm_region *region)
+{
+    int idx = region_index(as, region);
+
+    if(region->vr_pager->pg_destroy != NULL) {
+        region->vr_pager->pg_destroy(region);
+    }
+    memmove(&as->as_regions[idx], &as->as_regions[idx+1], (as->as_nregions - idx - 1)*sizeof(struct vm_region *));
+    as->as_nregions--;
+    if(as->as_heap == region) {
+        as->as_heap = NULL;
+    }
+    kfree(region);
+}
+
+/* region_copyall() */
+int region_copyall(struct addrspace *src, struct addrspace *dest)
+{
+    struct vm_region *region;
+    int i, err;
+
+    assert(dest->as_nregions == 0);
+
+    for(i=0; i<src->as_nregions; i++) {
+        err = region_grow(dest);
+        if(err) {
+            return err;
+        }
+
+        region = kmalloc(sizeof(struct vm_region));
+        if(region == NULL) {
+            return ENOMEM;
+        }
+        *region = *src->as_regions[i];
+
+        if(region->vr_pager->pg_copy != NULL) {
+            err = region->vr_pager->pg_copy(src->as_regions[i], region);
+            if(err) {
+                kfree(region);
+                return err;
+            }
+        }
+
+        /* already in order */
+        dest->as_regions[dest->as_nregions++] = region;
+        if(src->as_regions[i] == src->as_heap) {
+            dest->as_heap = region;
+        }
+    }
+
+    return 0;
+}
+
+/* region_destroyall() */
+void region_destroyall(struct addrspace *as)
+{
+    struct vm_region *region;
+    int i;
+
+    for(i=0; i<as->as_nregions; i++) {
+        region = as->as_regions[i];
+        if(region->vr_pager->pg_destroy != NULL) {
+            region->vr_pager->pg_destroy(region);
+        }
+        kfree(region);
+    }
+    as->as_nregions = 0;
+    as->as_heap = NULL;
+}
@@ -0,0 +1,482 @@
+/*
+ * Page replacement policies. See replacement.h for an overview.
+ * Everything in here runs with interrupts off and works directly on the coremap.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <machine/spl.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <replacement.h>
+#include <vm_features.h>
+
+
+/*
+ * Clear the referenced bit of a user page. References through a TLB entry or the UTLB miss
+ * handler don't fault, so the page is watched as well, and the next reference faults and sets
+ * the bit again.
+ */
+static void rp_clearref(int idx)
+{
+    coremap[idx].referenced = 0;
+    coremap_page_watch((paddr_t)idx << PAGE_OFFSET);
+}
+
+
+/****************************************************************************************
+ ****** Random **************************************************************************
+ ****************************************************************************************/
+
+/* last page evicted, so we don't evict the same page twice in a row */
+static int prev_swap_page = 0;
+
+static int random_select(void)
+{
+    int page_it;
+    int start_page = ( random() % (last_avail_ppage - first_avail_ppage) ) + first_avail_ppage;
+
+    for(page_it=start_page; page_it<last_avail_ppage; page_it++){
+        if(coremap[page_it].state == S_USER && page_it != prev_swap_page) {
+            prev_swap_page = page_it;
+            return page_it;
+        }
+    }
+
+    for(page_it=first_avail_ppage; page_it<start_page; page_it++){
+        if(coremap[page_it].state == S_USER && page_it != prev_swap_page) {
+            prev_swap_page = page_it;
+            return page_it;
+        }
+    }
+
+    return -1;
+}
+
+static void random_reset(void)
+{
+    prev_swap_page = 0;
+}
+
+static void random_noop(int idx)
+{
+    (void) idx;
+}
+
+
+/****************************************************************************************
+ ****** Clock ***************************************************************************
+ ****************************************************************************************/
+
+/* stores the index of the coremap entry the clock hand points at */
+static int clock_hand = 0;
+
+/* move the clock hand forward one page, wrapping around */
+static int clock_advance(void)
+{
+    clock_hand++;
+    if(clock_hand < first_avail_ppage || clock_hand >= last_avail_ppage) {
+        clock_hand = first_avail_ppage;
+    }
+    return clock_hand;
+}
+
+static int clock_select(void)
+{
+    int i, page_it;
+    int num_avail = last_avail_ppage - first_avail_ppage;
+
+    /* two revolutions, the first one may only clear referenced bits */
+    for(i=0; i<2*num_avail; i++) {
+        page_it = clock_advance();
+        if(coremap[page_it].state != S_USER) {
+            continue;
+        }
+        if(coremap[page_it].referenced) {
+            rp_clearref(page_it);
+            continue;
+        }
+        return page_it;
+    }
+
+    return -1;
+}
+
+static void clock_reset(void)
+{
+    int i;
+    for(i=first_avail_ppage; i<last_avail_ppage; i++) {
+        coremap[i].referenced = 0;
+    }
+    clock_hand = first_avail_ppage;
+}
+
+static void clock_access(int idx)
+{
+    coremap[idx].referenced = 1;
+}
+
+static void clock_alloc(int idx)
+{
+    coremap[idx].referenced = 1;
+}
+
+
+/****************************************************************************************
+ ****** WSClock *************************************************************************
+ ****************************************************************************************/
+
+/*
+ * Pages referenced within this many faults are considered part of the working set.
+ * Virtual time only moves forward on faults, since that is the only time we see references.
+ */
+#define WSCLOCK_WINDOW 64
+
+static u_int32_t wsclock_vtime = 0;
+
+static int wsclock_isdirty(int idx)
+{
+    struct pte *entry = coremap[idx].pt_entry;
+    return (PTE_STATE(entry) == PTE_PRESENT || PTE_STATE(entry) == PTE_DIRTY);
+}
+
+static int wsclock_select(void)
+{
+    int i, page_it;
+    int num_avail = last_avail_ppage - first_avail_ppage;
+    int dirty_candidate = -1;
+    int oldest = -1;
+
+    for(i=0; i<num_avail; i++) {
+        page_it = clock_advance();
+        if(coremap[page_it].state != S_USER) {
+            continue;
+        }
+
+        /* referenced since we last looked, it is in the working set */
+        if(coremap[page_it].referenced) {
+            rp_clearref(page_it);
+            coremap[page_it].rp_lastref = wsclock_vtime;
+            continue;
+        }
+
+        if(oldest < 0 || coremap[page_it].rp_lastref < coremap[oldest].rp_lastref) {
+            oldest = page_it;
+        }
+
+        /* still in the working set */
+        if(wsclock_vtime - coremap[page_it].rp_lastref <= WSCLOCK_WINDOW) {
+            continue;
+        }
+
+        /* old and clean, this is the best we can do */
+        if(!wsclock_isdirty(page_it)) {
+            return page_it;
+        }
+
+        /* old but dirty, remember it in case there is no clean page */
+        if(dirty_candidate < 0) {
+            dirty_candidate = page_it;
+        }
+    }
+
+    if(dirty_candidate >= 0) {
+        clock_hand = dirty_candidate;
+        return dirty_candidate;
+    }
+
+    /* everything is in the working set, fall back to the least recently used page */
+    if(oldest >= 0) {
+        clock_hand = oldest;
+    }
+    return oldest;
+}
+
+static void wsclock_reset(void)
+{
+    int i;
+    for(i=first_avail_ppage; i<last_avail_ppage; i++) {
+        coremap[i].referenced = 0;
+        coremap[i].rp_lastref = wsclock_vtime;
+    }
+    clock_hand = first_avail_ppage;
+}
+
+static void wsclock_access(int idx)
+{
+    wsclock_vtime++;
+    coremap[idx].referenced = 1;
+    coremap[idx].rp_lastref = wsclock_vtime;
+}
+
+static void wsclock_alloc(int idx)
+{
+    coremap[idx].referenced = 1;
+    coremap[idx].rp_lastref = wsclock_vtime;
+}
+
+
+/****************************************************************************************
+ ****** Aging ***************************************************************************
+ ****************************************************************************************/
+
+/*
+ * Every eviction is one aging tick. The referenced bit is shifted into the top of the counter,
+ * so recently referenced pages have the largest counters.
+ */
+static int aging_select(void)
+{
+    int page_it;
+    int victim = -1;
+
+    for(page_it=first_avail_ppage; page_it<last_avail_ppage; page_it++) {
+        if(coremap[page_it].state != S_USER) {
+            continue;
+        }
+
+        coremap[page_it].rp_age >>= 1;
+        if(coremap[page_it].referenced) {
+            coremap[page_it].rp_age |= 0x80;
+            rp_clearref(page_it);
+        }
+
+        if(victim < 0 || coremap[page_it].rp_age < coremap[victim].rp_age) {
+            victim = page_it;
+        }
+    }
+
+    return victim;
+}
+
+static void aging_reset(void)
+{
+    int i;
+    for(i=first_avail_ppage; i<last_avail_ppage; i++) {
+        coremap[i].referenced = 0;
+        coremap[i].rp_age = 0;
+    }
+}
+
+static void aging_access(int idx)
+{
+    coremap[idx].referenced = 1;
+}
+
+static void aging_alloc(int idx)
+{
+    coremap[idx].referenced = 1;
+    coremap[idx].rp_age = 0x80;
+}
+
+
+/****************************************************************************************
+ ****** 2Q ******************************************************************************
+ ****************************************************************************************/
+
+/*
+ * Pages are kept on one of two queues, linked through rp_next/rp_prev in the coremap.
+ * New pages go to the tail of the A1 FIFO. Every fault path maps a page right after allocating
+ * it, so the first reference only sets rp_seen. A page referenced again while on A1 moves to the
+ * tail of the Am LRU queue, and a reference to an Am page moves it back to the tail.
+ * Victims come from the head of A1 while A1 holds more than a quarter of memory.
+ *
+ * References through the TLB or the UTLB miss handler never fault, so a page that is in use may
+ * drift to the head of its queue unnoticed. Before a referenced page is evicted from the head
+ * it is watched (coremap_page_watch()) and goes around once more. It is only evicted if it gets
+ * back to the head without faulting.
+ */
+#define TWOQ_NONE  0
+#define TWOQ_A1    1
+#define TWOQ_AM    2
+
+/* rp_seen */
+#define TWOQ_UNSEEN     0   /* not mapped since it was allocated */
+#define TWOQ_SEEN       1   /* referenced */
+#define TWOQ_WATCHED    2   /* TLB entries shot down at the head of the queue, not referenced since */
+
+struct twoq_queue {
+    int head;
+    int tail;
+    int count;
+};
+
+static struct twoq_queue twoq_a1;
+static struct twoq_queue twoq_am;
+
+static struct twoq_queue *twoq_getqueue(int queue)
+{
+    return (queue == TWOQ_A1) ? &twoq_a1 : &twoq_am;
+}
+
+static void twoq_append(int idx, int queue)
+{
+    struct twoq_queue *q = twoq_getqueue(queue);
+
+    coremap[idx].rp_queue = queue;
+    coremap[idx].rp_next = -1;
+    coremap[idx].rp_prev = q->tail;
+    if(q->tail != -1) {
+        coremap[q->tail].rp_next = idx;
+    }
+    else {
+        q->head = idx;
+    }
+    q->tail = idx;
+    q->count++;
+}
+
+static void twoq_unlink(int idx)
+{
+    struct twoq_queue *q;
+
+    if(coremap[idx].rp_queue == TWOQ_NONE) {
+        return;
+    }
+    q = twoq_getqueue(coremap[idx].rp_queue);
+
+    if(coremap[idx].rp_prev != -1) {
+        coremap[coremap[idx].rp_prev].rp_next = coremap[idx].rp_next;
+    }
+    else {
+        q->head = coremap[idx].rp_next;
+    }
+    if(coremap[idx].rp_next != -1) {
+        coremap[coremap[idx].rp_next].rp_prev = coremap[idx].rp_prev;
+    }
+    else {
+        q->tail = coremap[idx].rp_prev;
+    }
+
+    coremap[idx].rp_queue = TWOQ_NONE;
+    coremap[idx].rp_next = -1;
+    coremap[idx].rp_prev = -1;
+    q->count--;
+}
+
+static int twoq_select(void)
+{
+    int i, idx, queue;
+    int a1_max = (last_avail_ppage - first_avail_ppage) / 4;
+    int npages = twoq_a1.count + twoq_am.count;
+
+    /* every page goes around at most once, so this ends with a victim */
+    for(i=0; ; i++) {
+        if(twoq_a1.head != -1 && (twoq_a1.count > a1_max || twoq_am.head == -1)) {
+            queue = TWOQ_A1;
+        }
+        else {
+            queue = TWOQ_AM;
+        }
+        idx = twoq_getqueue(queue)->head;
+        if(idx == -1 || coremap[idx].rp_seen != TWOQ_SEEN || i >= npages) {
+            return idx;
+        }
+
+        coremap[idx].rp_seen = TWOQ_WATCHED;
+        coremap_page_watch((paddr_t)idx << PAGE_OFFSET);
+        twoq_unlink(idx);
+        twoq_append(idx, queue);
+    }
+}
+
+static void twoq_reset(void)
+{
+    int i;
+
+    twoq_a1.head = twoq_a1.tail = -1;
+    twoq_a1.count = 0;
+    twoq_am.head = twoq_am.tail = -1;
+    twoq_am.count = 0;
+
+    for(i=first_avail_ppage; i<last_avail_ppage; i++) {
+        coremap[i].rp_queue = TWOQ_NONE;
+        coremap[i].rp_next = -1;
+        coremap[i].rp_prev = -1;
+        if(coremap[i].state == S_USER) {
+            /* already mapped, the next reference promotes them */
+            coremap[i].rp_seen = TWOQ_SEEN;
+            twoq_append(i, TWOQ_A1);
+        }
+    }
+}
+
+static void twoq_access(int idx)
+{
+    /* the reference that maps a new page doesn't count */
+    if(coremap[idx].rp_queue == TWOQ_A1 && coremap[idx].rp_seen == TWOQ_UNSEEN) {
+        coremap[idx].rp_seen = TWOQ_SEEN;
+        return;
+    }
+
+    /* either promote from A1 or move to the most recently used end of Am */
+    twoq_unlink(idx);
+    coremap[idx].rp_seen = TWOQ_SEEN;
+    twoq_append(idx, TWOQ_AM);
+}
+
+static void twoq_alloc(int idx)
+{
+    twoq_unlink(idx);
+    coremap[idx].rp_seen = TWOQ_UNSEEN;
+    twoq_append(idx, TWOQ_A1);
+}
+
+static void twoq_free(int idx)
+{
+    twoq_unlink(idx);
+}
+
+
+/****************************************************************************************
+ ****** Policy selection ****************************************************************
+ ****************************************************************************************/
+
+static struct replacement_policy replacement_policies[] = {
+    { "random",  random_reset,  random_select,  random_noop,    random_noop,   random_noop },
+    { "clock",   clock_reset,   clock_select,   clock_access,   clock_alloc,   random_noop },
+    { "wsclock", wsclock_reset, wsclock_select, wsclock_access, wsclock_alloc, random_noop },
+    { "aging",   aging_reset,   aging_select,   aging_access,   aging_alloc,   random_noop },
+    { "2q",      twoq_reset,    twoq_select,    twoq_access,    twoq_alloc,    twoq_free   },
+    { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+struct replacement_policy *replacement_policy = &replacement_policies[0];
+
+/*
+ * replacement_setpolicy()
+ * Switch to the policy with the given name. The new policy rebuilds its state from the coremap,
+ * so this can be done at any time, including while user programs are running.
+ */
+int replacement_setpolicy(const char *name)
+{
+    int i;
+    int spl;
+
+    for(i=0; replacement_policies[i].rp_name != NULL; i++) {
+        if(!strcmp(replacement_policies[i].rp_name, name)) {
+            spl = splhigh();
+            replacement_policy = &replacement_policies[i];
+            replacement_policy->rp_reset();
+            splx(spl);
+            return 0;
+        }
+    }
+
+    return EINVAL;
+}
+
+/*
+ * replacement_listpolicies()
+ * Print all policies, marking the current one
+ */
+void replacement_listpolicies()
+{
+    int i;
+
+    for(i=0; replacement_policies[i].rp_name != NULL; i++) {
+        kprintf("%s%s ", replacement_policies[i].rp_name,
+                (&replacement_policies[i] == replacement_policy) ? "*" : "");
+    }
+    kprintf("\n");
+}
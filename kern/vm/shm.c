@@ -0,0 +1,284 @@
+/*
+ * System V style shared memory segments. See shm.h for an overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <machine/spl.h>
+#include <synch.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <region.h>
+#include <shm.h>
+#include <coremap.h>
+#include <pagetable.h>
+
+
+/* all segments, indexed by id */
+static struct shm_segment *shm_table[SHM_MAX];
+
+/* The segment with the key, or NULL */
+static struct shm_segment *shm_find(int key)
+{
+    int i;
+
+    for(i=0; i<SHM_MAX; i++) {
+        if(shm_table[i] != NULL && shm_table[i]->shm_key == key) {
+            return shm_table[i];
+        }
+    }
+    return NULL;
+}
+
+/* A new segment, not in the table yet */
+static struct shm_segment *shm_create(int key, size_t size)
+{
+    int i;
+    struct shm_segment *seg;
+
+    seg = kmalloc(sizeof(struct shm_segment));
+    if(seg == NULL) {
+        return NULL;
+    }
+    seg->shm_key = key;
+    seg->shm_size = size;
+    seg->shm_npages = (size + PAGE_SIZE - 1) >> PAGE_OFFSET;
+    seg->shm_nattach = 0;
+    seg->shm_pages = kmalloc(seg->shm_npages*sizeof(struct pte *));
+    if(seg->shm_pages == NULL) {
+        kfree(seg);
+        return NULL;
+    }
+    for(i=0; i<seg->shm_npages; i++) {
+        seg->shm_pages[i] = NULL;
+    }
+    return seg;
+}
+
+/* shm_get() */
+int shm_get(int key, size_t size, int flags, int *id)
+{
+    int i;
+    struct shm_segment *seg = NULL;
+    struct shm_segment *new;
+    int spl = splhigh();
+
+    if(key != IPC_PRIVATE) {
+        seg = shm_find(key);
+    }
+
+    if(seg != NULL) {
+        if((flags & IPC_CREAT) && (flags & IPC_EXCL)) {
+            splx(spl);
+            return EEXIST;
+        }
+        if(size > seg->shm_size) {
+            splx(spl);
+            return EINVAL;
+        }
+        *id = seg->shm_id;
+        splx(spl);
+        return 0;
+    }
+
+    if(!(flags & IPC_CREAT) && key != IPC_PRIVATE) {
+        splx(spl);
+        return ENOENT;
+    }
+    if(size == 0 || size > SHM_MAXPAGES*PAGE_SIZE) {
+        splx(spl);
+        return EINVAL;
+    }
+
+    /* We may sleep for the memory, and somebody may create the same key meanwhile */
+    new = shm_create(key, size);
+    if(new == NULL) {
+        splx(spl);
+        return ENOMEM;
+    }
+    if(key != IPC_PRIVATE && (seg = shm_find(key)) != NULL) {
+        kfree(new->shm_pages);
+        kfree(new);
+        if((flags & IPC_EXCL) || size > seg->shm_size) {
+            splx(spl);
+            return (flags & IPC_EXCL) ? EEXIST : EINVAL;
+        }
+        *id = seg->shm_id;
+        splx(spl);
+        return 0;
+    }
+
+    for(i=0; i<SHM_MAX; i++) {
+        if(shm_table[i] == NULL) {
+            new->shm_id = i;
+            shm_table[i] = new;
+            *id = i;
+            splx(spl);
+            return 0;
+        }
+    }
+
+    kfree(new->shm_pages);
+    kfree(new);
+    splx(spl);
+    return ENOSPC;
+}
+
+/* shm_attach() */
+struct shm_segment *shm_attach(int id)
+{
+    struct shm_segment *seg;
+    int spl = splhigh();
+
+    if(id < 0 || id >= SHM_MAX || shm_table[id] == NULL) {
+        splx(spl);
+        return NULL;
+    }
+    seg = shm_table[id];
+    seg->shm_nattach++;
+
+    splx(spl);
+    return seg;
+}
+
+/* 
+ * shm_free()
+ * Nobody maps the pages any more and the segment's own share is the only one left, so
+ * free_upage() frees them for good. The segment must be out of the table already.
+ */
+static void shm_free(struct shm_segment *seg)
+{
+    int i;
+
+    assert(curspl>0);
+    assert(seg->shm_nattach == 0);
+
+    for(i=0; i<seg->shm_npages; i++) {
+        if(seg->shm_pages[i] != NULL) {
+            assert(pte_sharers(seg->shm_pages[i]) == 0);
+            free_upage(seg->shm_pages[i]);
+        }
+    }
+    kfree(seg->shm_pages);
+    kfree(seg);
+}
+
+/* shm_detach() */
+void shm_detach(struct shm_segment *seg)
+{
+    int spl = splhigh();
+
+    assert(seg->shm_nattach > 0);
+    seg->shm_nattach--;
+    if(seg->shm_nattach > 0) {
+        splx(spl);
+        return;
+    }
+
+    /* a removed segment is out of the table already */
+    if(shm_table[seg->shm_id] == seg) {
+        shm_table[seg->shm_id] = NULL;
+    }
+    shm_free(seg);
+
+    splx(spl);
+}
+
+/* shm_remove() */
+int shm_remove(int id)
+{
+    struct shm_segment *seg;
+    int spl = splhigh();
+
+    if(id < 0 || id >= SHM_MAX || shm_table[id] == NULL) {
+        splx(spl);
+        return EINVAL;
+    }
+    seg = shm_table[id];
+    shm_table[id] = NULL;
+
+    if(seg->shm_nattach == 0) {
+        shm_free(seg);
+    }
+
+    splx(spl);
+    return 0;
+}
+
+
+/****************************************************************************************
+ ****** The shm pager *******************************************************************
+ ****************************************************************************************/
+
+/*
+ * shm_fault()
+ * Map the page of the segment, creating it if this is the first touch anywhere. vm_fault
+ * picks up the mapping on the retry, and from then on the page is like any other shared page.
+ */
+static int shm_fault(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype)
+{
+    assert(lock_do_i_hold(as->as_lock));
+
+    paddr_t paddr;
+    struct pte *entry;
+    struct shm_segment *seg = region->vr_shm;
+    vaddr_t faultpage = (faultaddress & PAGE_FRAME);
+    int idx = (faultpage - region->vr_start) >> PAGE_OFFSET;
+
+    (void) faulttype;
+    assert(seg != NULL);
+    assert(idx >= 0 && idx < seg->shm_npages);
+
+    if(seg->shm_pages[idx] == NULL) {
+        entry = pte_init();
+        if(entry == NULL) {
+            return ENOMEM;
+        }
+        PTE_SET_PERMS(entry, set_permissions(1, 1, 0));
+
+        paddr = alloc_uzeroframe(entry);
+        if(paddr == 0) {
+            pte_destroy(entry);
+            return ENOMEM;
+        }
+
+        PTE_SET_PADDR(entry, paddr);
+        PTE_SET_STATE(entry, PTE_PRESENT);
+        entry->swap_location = 0;
+        coremap_busy_unmark(paddr);
+
+        /* somebody attached elsewhere may have created it while we slept */
+        if(seg->shm_pages[idx] != NULL) {
+            free_upage(entry);
+            return EAGAIN;
+        }
+        seg->shm_pages[idx] = entry;
+    }
+
+    if(pt_add_shared(as->as_pagetable, faultpage, seg->shm_pages[idx])) {
+        return ENOMEM;
+    }
+    pte_addsharer(seg->shm_pages[idx]);
+
+    return EAGAIN;
+}
+
+/* the copy of a region after fork is attached as well */
+static int shm_copy(struct vm_region *src, struct vm_region *dest)
+{
+    (void) src;
+    dest->vr_shm->shm_nattach++;
+    return 0;
+}
+
+static void shm_destroy(struct vm_region *region)
+{
+    if(region->vr_shm != NULL) {
+        shm_detach(region->vr_shm);
+        region->vr_shm = NULL;
+    }
+}
+
+const struct vm_pager vm_shmpager = { "shm", shm_fault, shm_copy, shm_destroy };
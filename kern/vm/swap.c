@@ -1,7 +1,8 @@
 
 /*
  * Implementation of swapping.
- * All code is protected by disabling interrupts as well as acquiring the swap lock.
+ * All code runs with interrupts off. Pages under I/O are marked busy in the coremap, see the
+ * synchronization notes in swap.h.
  */
 
 #include <types.h>
@@ -18,9 +19,12 @@
 #include <bitmap.h>
 #include <coremap.h>
 #include <pagetable.h>
+#include <pagecache.h>
+#include <addrspace.h>
 #include <lib.h>
 #include <vm.h>
 #include <thread.h>
+#include <vm_features.h>
 #include <kern/errno.h>
 
 
@@ -33,8 +37,11 @@ static struct stat *swap_fstat;
 /* abstract representation of the swap file */
 static struct vnode *swap_vnode;
 
-/* synchronization device to make sure only one thread is swapping at any one time */
-struct lock *swap_lock;
+/* protects the swap slot bitmap */
+static struct lock *swap_slot_lock;
+
+/* protects swap_cluster_buf, held across the I/O that uses it */
+static struct lock *swap_cluster_lock;
 
 /* structure to keep track of each swap location */
 static struct bitmap *swap_bitmap;
@@ -42,20 +49,43 @@ static struct bitmap *swap_bitmap;
 /* counter for how many pages are available for swapping */
 static u_int32_t num_swap_pages_avail;
 
+/* set once the pageout daemon is running, the daemon sleeps on this address */
+static int pageout_started = 0;
+
+/* staging area for clustered writes, SWAP_CLUSTER_SIZE pages long */
+static char *swap_cluster_buf;
+
+/* where the search for free runs of swap slots resumes */
+static u_int32_t swap_cluster_hint = 1;
+
+/* number of pages to read ahead on a swap fault, adapts between SWAP_READAHEAD_MIN and SWAP_READAHEAD_MAX */
+static int swap_ra_window = 4;
+
+/* overcommit policies, see swap.h */
+#define OVERCOMMIT_STRICT       0
+#define OVERCOMMIT_HEURISTIC    1
+
+static const char *swap_overcommit_names[] = { "strict", "heuristic", NULL };
+
+/* current overcommit policy, and the pages of anonymous memory charged against the commit limit */
+static int swap_overcommit = OVERCOMMIT_HEURISTIC;
+static u_int32_t swap_committed = 0;
+
 /*
  * swap_bootstrap()
  * Initializes all data structures to keep track of swapfile:
- *      1. swap lock
+ *      1. swap slot and cluster buffer locks
  *      2. bit map to keep track of storage
  *      3. varable to keep track of how many pages we have left
  * To determine how big our bitmap should be, we should open up the swap file and check
  */
 void swap_bootstrap() 
 {
-    /* create the swap lock */
-    swap_lock = lock_create("swap_lock");
-    if(swap_lock == NULL) {
-        panic("Could not create swap lock");
+    /* create the swap locks */
+    swap_slot_lock = lock_create("swap_slot_lock");
+    swap_cluster_lock = lock_create("swap_cluster_lock");
+    if(swap_slot_lock == NULL || swap_cluster_lock == NULL) {
+        panic("Could not create swap locks");
     }
 
     /* open the swap file */
@@ -78,13 +108,22 @@ void swap_bootstrap()
         panic("Could not create swap bitmap");
     }
     bitmap_mark(swap_bitmap, 0); /* mark the first index, this one should not be used */
+
+    /* Buffer to gather pages into for clustered writes */
+    swap_cluster_buf = (char *)kmalloc(SWAP_CLUSTER_SIZE*PAGE_SIZE);
+    if(swap_cluster_buf == NULL) {
+        panic("Could not create swap cluster buffer");
+    }
+
+    if(swap_setovercommit(OVERCOMMIT_POLICY_DEFAULT)) {
+        panic("Unknown overcommit policy %s\n", OVERCOMMIT_POLICY_DEFAULT);
+    }
 }
 
 
 /* Given a swapfile location, read the swap page into physical page */
 int swap_read(u_int32_t swap_location, paddr_t ppage)
 {
-    assert( lock_do_i_hold(swap_lock) );
     assert(curspl>0)
 
     int err;
@@ -99,6 +138,7 @@ int swap_read(u_int32_t swap_location, paddr_t ppage)
     if(err) {
         return err;
     }
+    vmstat.vs_swapins++;
 
     return 0;
 }
@@ -106,7 +146,6 @@ int swap_read(u_int32_t swap_location, paddr_t ppage)
 /* Given a swapfile location, write the physical page into the swap location */
 int swap_write(u_int32_t swap_location, paddr_t ppage)
 {
-    assert( lock_do_i_hold(swap_lock) );
     assert(curspl>0)
 
     int err;
@@ -121,6 +160,36 @@ int swap_write(u_int32_t swap_location, paddr_t ppage)
     if(err) {
         return err;
     }
+    vmstat.vs_swapouts++;
+
+    return 0;
+}
+
+
+/*
+ * swap_filewrite()
+ * Write a page of a shared file mapping back to its file. Only the part of the page that is in the
+ * file is written, mappings never make a file longer.
+ */
+static int swap_filewrite(paddr_t ppage)
+{
+    assert(curspl>0);
+
+    int err;
+    struct uio ku;
+    struct coremap_entry *cme = &coremap[ppage >> PAGE_OFFSET];
+
+    assert(cme->file != NULL);
+    if(cme->filelen == 0) {
+        return 0;
+    }
+
+    mk_kuio(&ku, (void *)PADDR_TO_KVADDR(ppage), cme->filelen, cme->fileoff, UIO_WRITE);
+    err = VOP_WRITE(cme->file, &ku);
+    if(err) {
+        return err;
+    }
+    vmstat.vs_filewrites++;
 
     return 0;
 }
@@ -130,111 +199,295 @@ int swap_write(u_int32_t swap_location, paddr_t ppage)
  * swap_pageevict()
  * 
  * Eviction is the process of officially removing a page from memory.
- * After a page it is evicted, its ppageaddr is set to 0, and its swap_state is set to PTE_SWAPPED.
+ * After a page is evicted, its frame is set to 0, and its swap state is set to PTE_SWAPPED.
+ * File pages are dropped instead, to PTE_NONE, and read from their file on the next fault.
+ * Dropping a page that only the page cache holds frees its entry as well, don't touch it afterwards.
  * Only clean pages can be evicted! Once evicted, the TLB entry is also shot down, as the translation
- * is not invalid.
+ * is not invalid. The caller must have marked the page busy, freeing it wakes up the waiters.
  */
 void swap_pageevict(struct pte *entry)
 {
     assert(curspl>0);
-    assert(lock_do_i_hold(swap_lock));
-
-    assert(entry->swap_state == PTE_CLEAN);
-    assert(entry->ppageaddr != 0);
 
-    TLB_Flush();
+    assert(PTE_STATE(entry) == PTE_CLEAN);
+    assert(PTE_PADDR(entry) != 0);
+    assert(coremap_is_busy(PTE_PADDR(entry)));
 
-    /* Shoot down the specific TLB entry */
-    // int idx = TLB_FindEntry(entry->ppageaddr);
-    // if(idx >= 0) {
-    //     TLB_Invalidate(idx);
-    // }
+    /* Shoot down the TLB entries for this page only, it may be mapped under several ASIDs */
+    TLB_InvalidatePaddr(PTE_PADDR(entry));
 
     /* Free the physical page and change the state of the entry */
-    free_ppages(entry->ppageaddr);
-    entry->ppageaddr = 0;
-    entry->swap_state = PTE_SWAPPED;
+    free_ppages(PTE_PADDR(entry));
+    PTE_SET_PADDR(entry, 0);
+    if(entry->pte_word & PTE_FILE) {
+        PTE_SET_STATE(entry, PTE_NONE);
+        vmstat.vs_filedrops++;
+    }
+    else {
+        PTE_SET_STATE(entry, PTE_SWAPPED);
+    }
+    vmstat.vs_evictions++;
+
+    /* A cached page nobody maps is gone from the cache once it is out of memory */
+    if((entry->pte_word & PTE_CACHED) && pte_sharers(entry) == 0) {
+        pagecache_release(entry);
+    }
 }
 
-/* 
- * swap_pageout()
+/*
+ * swap_pageclean()
  * 
- * Find a appropriate page to swap out. Find a spot in the swap disk and write the contents
- * of the physical page to the swap disk. Once this is done, the page is clean. We can then
- * evict this page.
+ * Make sure the page has an up to date copy on the swap disk. PTE_PRESENT pages get a new swap
+ * location, PTE_DIRTY pages are written back to their existing one, or to their file if they are
+ * file pages. Afterwards the page is PTE_CLEAN and can be evicted without any I/O.
  * 
- * Currently the eviction policy used is nMRU
+ * The page is write protected in the TLB before the write, so a writable mapping can't modify it
+ * behind our back. The next write faults, waits for the page to stop being busy and marks it dirty again.
+ * The caller must have marked the page busy.
  * 
  * Returns 0 on success.
  */
-int swap_pageout()
+int swap_pageclean(struct pte *entry)
 {
+    assert(curspl>0);
+
     int err;
     u_int32_t swap_location;
-    struct pte *entry_to_swap;
-
-    int spl = splhigh();
-    assert( lock_do_i_hold(swap_lock) );
-    
-    /* We have to find a target to swap out */
-    entry_to_swap = coremap_swap_pageout();
-    if(entry_to_swap == NULL) {
-        splx(spl);
-        return 1;
-    }
 
-    assert(entry_to_swap->swap_state != PTE_SWAPPED);
-    assert(entry_to_swap->ppageaddr != 0);
+    assert(PTE_STATE(entry) != PTE_SWAPPED);
+    assert(PTE_PADDR(entry) != 0);
+    assert(coremap_is_busy(PTE_PADDR(entry)));
 
-    switch(entry_to_swap->swap_state) {
+    switch(PTE_STATE(entry)) {
         case PTE_PRESENT:
-            /* we have to allocate a place in swap memory and evict */
-            err = bitmap_alloc(swap_bitmap, &swap_location);
+            /* we have to allocate a place in swap memory */
+            err = swap_diskalloc(&swap_location);
             if(err) {
-                splx(spl);
                 return err;
             }
 
             /* write to this location */
-            err = swap_write(swap_location, entry_to_swap->ppageaddr);
+            TLB_WriteProtectPaddr(PTE_PADDR(entry));
+            err = swap_write(swap_location, PTE_PADDR(entry));
             if(err) {
-                bitmap_unmark(swap_bitmap, swap_location);
-                splx(spl);
+                swap_diskfree(swap_location);
                 return err;
             }
 
-            entry_to_swap->swap_location = swap_location;
-            entry_to_swap->swap_state = PTE_CLEAN;
-            swap_pageevict(entry_to_swap);
+            entry->swap_location = swap_location;
+            PTE_SET_STATE(entry, PTE_CLEAN);
             break;
 
         case PTE_DIRTY:
-            /* Dirty means that it already has a page in swap disk */
-            swap_location = entry_to_swap->swap_location;
-
-            err = swap_write(swap_location, entry_to_swap->ppageaddr);
+            /* Dirty means that it already has a page in swap disk, or in its file */
+            TLB_WriteProtectPaddr(PTE_PADDR(entry));
+            if(entry->pte_word & PTE_FILE) {
+                err = swap_filewrite(PTE_PADDR(entry));
+            }
+            else {
+                err = swap_write(entry->swap_location, PTE_PADDR(entry));
+            }
             if(err) {
-                splx(spl);
                 return err;
             }
 
-            entry_to_swap->swap_location = swap_location;
-            entry_to_swap->swap_state = PTE_CLEAN;
-            swap_pageevict(entry_to_swap);
+            PTE_SET_STATE(entry, PTE_CLEAN);
             break;
         
         case PTE_CLEAN:
-            swap_pageevict(entry_to_swap);
             break;
 
         default:
             panic("Invalid PTE state");
     }
 
-    splx(spl);
     return 0;
 }
 
+/*
+ * swap_cluster_before()
+ * Ordering used for clustered writes: group pages by address space, then by virtual address,
+ * so pages that will likely be faulted back in together sit next to each other on disk.
+ */
+static int swap_cluster_before(struct pte *a, struct pte *b)
+{
+    struct coremap_entry *ca = &coremap[PTE_PADDR(a) >> PAGE_OFFSET];
+    struct coremap_entry *cb = &coremap[PTE_PADDR(b) >> PAGE_OFFSET];
+
+    if(ca->owner != cb->owner) {
+        return ((vaddr_t)ca->owner < (vaddr_t)cb->owner);
+    }
+    return (ca->vaddr < cb->vaddr);
+}
+
+/*
+ * swap_pagecleancluster()
+ * 
+ * Clean up to SWAP_CLUSTER_SIZE pages with a single write. The pages are sorted, given a run of
+ * adjacent swap slots, copied into the cluster buffer and written out in one transfer. Pages that
+ * already had a swap slot (PTE_DIRTY) give up their old slot once the write succeeded.
+ * If the swap disk is too fragmented for a run of slots we clean the pages one at a time.
+ * 
+ * All pages must be marked busy by the caller.
+ * 
+ * Returns 0 on success. On failure some of the pages may still be dirty.
+ */
+int swap_pagecleancluster(struct pte **entries, int npages)
+{
+    assert(curspl>0);
+    assert(npages > 0 && npages <= SWAP_CLUSTER_SIZE);
+
+    int i, j, err;
+    u_int32_t start;
+    struct pte *tmp;
+    struct uio ku;
+
+    /* File pages go back to their files one at a time, the rest of the cluster goes to swap */
+    for(i=0; i<npages; ) {
+        if(!(entries[i]->pte_word & PTE_FILE)) {
+            i++;
+            continue;
+        }
+        err = swap_pageclean(entries[i]);
+        if(err) {
+            return err;
+        }
+        npages--;
+        tmp = entries[i];
+        entries[i] = entries[npages];
+        entries[npages] = tmp;
+    }
+
+    if(npages <= 1) {
+        return (npages == 1) ? swap_pageclean(entries[0]) : 0;
+    }
+
+    /* sort the cluster, it is tiny so insertion sort will do */
+    for(i=1; i<npages; i++) {
+        tmp = entries[i];
+        for(j=i; j>0 && swap_cluster_before(tmp, entries[j-1]); j--) {
+            entries[j] = entries[j-1];
+        }
+        entries[j] = tmp;
+    }
+
+    err = swap_diskalloc_cluster(npages, &start);
+    if(err) {
+        /* no run of free slots, fall back to one page at a time */
+        for(i=0; i<npages; i++) {
+            err = swap_pageclean(entries[i]);
+            if(err) {
+                return err;
+            }
+        }
+        return 0;
+    }
+
+    lock_acquire(swap_cluster_lock);
+
+    for(i=0; i<npages; i++) {
+        assert(PTE_PADDR(entries[i]) != 0);
+        assert(PTE_STATE(entries[i]) == PTE_PRESENT || PTE_STATE(entries[i]) == PTE_DIRTY);
+        assert(coremap_is_busy(PTE_PADDR(entries[i])));
+        /* no writable mappings may change the page while we write it */
+        TLB_WriteProtectPaddr(PTE_PADDR(entries[i]));
+        memmove(swap_cluster_buf + i*PAGE_SIZE, (const void *)PADDR_TO_KVADDR(PTE_PADDR(entries[i])), PAGE_SIZE);
+    }
+
+    mk_kuio(&ku, swap_cluster_buf, npages*PAGE_SIZE, start*PAGE_SIZE, UIO_WRITE);
+    err = VOP_WRITE(swap_vnode, &ku);
+    lock_release(swap_cluster_lock);
+    if(err) {
+        for(i=0; i<npages; i++) {
+            swap_diskfree(start + i);
+        }
+        return err;
+    }
+    vmstat.vs_swapouts += npages;
+    vmstat.vs_clusterwrites++;
+
+    for(i=0; i<npages; i++) {
+        if(PTE_STATE(entries[i]) == PTE_DIRTY) {
+            swap_diskfree(entries[i]->swap_location);
+        }
+        entries[i]->swap_location = start + i;
+        PTE_SET_STATE(entries[i], PTE_CLEAN);
+    }
+
+    return 0;
+}
+
+/* 
+ * swap_pageout()
+ * 
+ * Find appropriate pages to swap out and evict them. Clean victims are evicted right away.
+ * Dirty victims are gathered, up to SWAP_CLUSTER_SIZE of them, and written to the swap disk
+ * together before being evicted, so heavy swapping costs one disk request per cluster instead
+ * of one per page.
+ * 
+ * The victims are chosen by the replacement policy, see replacement.h. They are marked busy right
+ * away, so the writes don't race with their owners or other threads looking for victims.
+ * 
+ * Returns 0 on success.
+ */
+int swap_pageout()
+{
+    int err;
+    int i;
+    int npages = 0;
+    int nevicted = 0;
+    int nselected;
+    struct pte *entry_to_swap;
+    struct pte *cluster[SWAP_CLUSTER_SIZE];
+
+    int spl = splhigh();
+    
+    /* We have to find targets to swap out */
+    for(nselected=0; nselected<2*SWAP_CLUSTER_SIZE && npages<SWAP_CLUSTER_SIZE; nselected++) {
+        entry_to_swap = coremap_swap_pageout();
+        if(entry_to_swap == NULL) {
+            break;
+        }
+
+        assert(PTE_STATE(entry_to_swap) != PTE_SWAPPED);
+        assert(PTE_PADDR(entry_to_swap) != 0);
+
+        coremap_busy_mark(PTE_PADDR(entry_to_swap));
+
+        if(PTE_STATE(entry_to_swap) == PTE_CLEAN) {
+            /* nothing to write, and nothing to gather if this is all we found */
+            swap_pageevict(entry_to_swap);
+            nevicted++;
+            if(npages == 0) {
+                break;
+            }
+            continue;
+        }
+
+        cluster[npages++] = entry_to_swap;
+    }
+
+    if(npages > 0) {
+        err = swap_pagecleancluster(cluster, npages);
+        for(i=0; i<npages; i++) {
+            if(PTE_STATE(cluster[i]) == PTE_CLEAN) {
+                swap_pageevict(cluster[i]);
+                nevicted++;
+            }
+            else {
+                coremap_busy_unmark(PTE_PADDR(cluster[i]));
+            }
+        }
+        if(err && nevicted == 0) {
+            splx(spl);
+            return err;
+        }
+    }
+
+    splx(spl);
+    return (nevicted > 0) ? 0 : 1;
+}
+
 
 /*
  * swap_pagein()
@@ -242,36 +495,199 @@ int swap_pageout()
  * Bring a specific page back into memory. Do this by first allocating a page. Once we have
  * a page, we can start writing from the swap disk to the page in memory.
  * 
+ * The entry may be shared with other address spaces, and getting a frame may put us to sleep.
+ * If somebody else started bringing the page in meanwhile we give up and return EAGAIN, so the
+ * fault is retried. While we read, the entry has its frame but is still PTE_SWAPPED and the frame
+ * is busy, which makes everyone else wait.
  */
 int swap_pagein(struct pte *entry)
 {
     int err = 0;
+    paddr_t paddr;
     int spl = splhigh();
-    assert(lock_do_i_hold(swap_lock));
-
-    assert(entry->swap_state == PTE_SWAPPED);
-    assert(entry->ppageaddr == 0);
 
     /* Get a physical page for this entry */
-    alloc_upage(entry);
-    if(entry->ppageaddr == 0) {
+    paddr = alloc_uframe(entry);
+    if(paddr == 0) {
         splx(spl);
         return ENOMEM;
     }
-    assert(entry->ppageaddr != 0);
 
-    err = swap_read(entry->swap_location, entry->ppageaddr);
+    if(PTE_STATE(entry) != PTE_SWAPPED || PTE_PADDR(entry) != 0) {
+        free_ppages(paddr);
+        splx(spl);
+        return EAGAIN;
+    }
+    PTE_SET_PADDR(entry, paddr);
+
+    err = swap_read(entry->swap_location, PTE_PADDR(entry));
     if(err) {
+        PTE_SET_PADDR(entry, 0);
+        free_ppages(paddr);
         splx(spl);
         return err;
     }
 
-    entry->swap_state = PTE_CLEAN;      /* Just loaded the page, it is clean */
+    PTE_SET_STATE(entry, PTE_CLEAN);      /* Just loaded the page, it is clean */
+    coremap_busy_unmark(paddr);
 
     splx(spl);
     return 0;
 }
 
+/*
+ * swap_readrun()
+ * Read npages adjacent swap slots starting at entries[0]->swap_location into the frames of
+ * the entries, using one request through the cluster buffer.
+ */
+static int swap_readrun(struct pte **entries, int npages)
+{
+    int i, err;
+    struct uio ku;
+    u_int32_t start = entries[0]->swap_location;
+
+    if(npages == 1) {
+        return swap_read(start, PTE_PADDR(entries[0]));
+    }
+
+    assert(npages <= SWAP_CLUSTER_SIZE);
+    lock_acquire(swap_cluster_lock);
+    mk_kuio(&ku, swap_cluster_buf, npages*PAGE_SIZE, start*PAGE_SIZE, UIO_READ);
+    err = VOP_READ(swap_vnode, &ku);
+    if(err) {
+        lock_release(swap_cluster_lock);
+        return err;
+    }
+    vmstat.vs_swapins += npages;
+
+    for(i=0; i<npages; i++) {
+        assert(entries[i]->swap_location == start + i);
+        memmove((void *)PADDR_TO_KVADDR(PTE_PADDR(entries[i])), swap_cluster_buf + i*PAGE_SIZE, PAGE_SIZE);
+    }
+    lock_release(swap_cluster_lock);
+
+    return 0;
+}
+
+/*
+ * swap_pagein_readahead()
+ * 
+ * Bring the page at vaddr back into memory along with the swapped pages that follow it.
+ * We stop at the first following page that isn't swapped, whose slot is far away from the
+ * faulting page's slot, or once free memory runs low, since readahead should never cause
+ * evictions. Pages in adjacent slots are read with one request. 
+ * 
+ * The readahead pages end up PTE_CLEAN, in the page table but not in the TLB. Like in swap_pagein(),
+ * all frames stay busy until the reads are done, and EAGAIN means the fault has to be retried.
+ */
+int swap_pagein_readahead(struct addrspace *as, vaddr_t vaddr, struct pte *entry)
+{
+    int err = 0;
+    int i, j, k;
+    int npages;
+    int dist;
+    paddr_t paddr;
+    struct pte *e;
+    struct pte *cands[SWAP_READAHEAD_MAX+1];
+
+    int spl = splhigh();
+
+    /* Get a physical page for the faulting entry, this one may evict */
+    paddr = alloc_uframe(entry);
+    if(paddr == 0) {
+        splx(spl);
+        return ENOMEM;
+    }
+    if(PTE_STATE(entry) != PTE_SWAPPED || PTE_PADDR(entry) != 0) {
+        free_ppages(paddr);
+        splx(spl);
+        return EAGAIN;
+    }
+    PTE_SET_PADDR(entry, paddr);
+    cands[0] = entry;
+    npages = 1;
+
+    /* Find the pages to read ahead and give them frames */
+    for(k=1; k<=swap_ra_window; k++) {
+        e = pt_get(as->as_pagetable, vaddr + k*PAGE_SIZE);
+        if(e == NULL || PTE_STATE(e) != PTE_SWAPPED || PTE_PADDR(e) != 0) {
+            break;
+        }
+        dist = (int)e->swap_location - (int)entry->swap_location;
+        if(dist < -SWAP_READAHEAD_DISTANCE || dist > SWAP_READAHEAD_DISTANCE) {
+            break;
+        }
+        if(coremap_freecount() <= PAGEOUT_LOW_WATERMARK) {
+            break;
+        }
+        PTE_SET_PADDR(e, get_ppages(1, 0, e));
+        if(PTE_PADDR(e) == 0) {
+            break;
+        }
+        cands[npages++] = e;
+    }
+    pageout_wakeup();
+
+    /* Read runs of adjacent slots */
+    for(i=0; i<npages; i=j) {
+        for(j=i+1; j<npages && j-i<SWAP_CLUSTER_SIZE; j++) {
+            if(cands[j]->swap_location != cands[j-1]->swap_location + 1) {
+                break;
+            }
+        }
+
+        err = swap_readrun(&cands[i], j-i);
+        if(err) {
+            /* give back the frames of everything we did not read */
+            for(k=i; k<npages; k++) {
+                paddr = PTE_PADDR(cands[k]);
+                PTE_SET_PADDR(cands[k], 0);
+                free_ppages(paddr);
+            }
+            npages = i;
+            break;
+        }
+    }
+
+    for(i=0; i<npages; i++) {
+        PTE_SET_STATE(cands[i], PTE_CLEAN);
+        coremap_busy_unmark(PTE_PADDR(cands[i]));
+        if(i > 0) {
+            coremap_readahead_mark(PTE_PADDR(cands[i]));
+        }
+    }
+    vmstat.vs_ra_pages += (npages > 0) ? npages-1 : 0;
+
+    splx(spl);
+    /* only the faulting page matters to the caller */
+    return (npages > 0) ? 0 : err;
+}
+
+/*
+ * Adaptive readahead window. Grow slowly while readahead pays off, back off quickly when it doesn't.
+ */
+void swap_readahead_hit()
+{
+    vmstat.vs_ra_hits++;
+    if(swap_ra_window < SWAP_READAHEAD_MAX) {
+        swap_ra_window++;
+    }
+}
+
+void swap_readahead_miss()
+{
+    vmstat.vs_ra_misses++;
+    swap_ra_window /= 2;
+    if(swap_ra_window < SWAP_READAHEAD_MIN) {
+        swap_ra_window = SWAP_READAHEAD_MIN;
+    }
+}
+
+int swap_readahead_window()
+{
+    return swap_ra_window;
+}
+
 /*
  * Use swapping to free up npages of memory
  * Return 1 if space was created successfully, 0 if not
@@ -279,7 +695,6 @@ int swap_pagein(struct pte *entry)
 int swap_createspace(int npages)
 {
     int spl = splhigh();
-    assert(lock_do_i_hold(swap_lock));
 
     int result;
 
@@ -295,49 +710,260 @@ int swap_createspace(int npages)
 }
 
 /*
- * This for when we want to allocate on stack or heap on demand
- * Basically just reserve a spot in swap disk and bring it in
- * whenever the user needs it!
+ * Let other files allocate or deallocate swap disk space
  */
-int swap_allocpage_od(struct pte *entry) 
+void swap_diskfree(u_int32_t swap_location)
 {
-    assert(lock_do_i_hold(swap_lock));
-    assert(curspl>0);
+    lock_acquire(swap_slot_lock);
+    bitmap_unmark(swap_bitmap, swap_location);
+    lock_release(swap_slot_lock);
+}
 
+int swap_diskalloc(u_int32_t *swap_location)
+{
     int err;
+    lock_acquire(swap_slot_lock);
+    err = bitmap_alloc(swap_bitmap, swap_location);
+    lock_release(swap_slot_lock);
+    if(err) {
+        return err;      /* swap is full! */
+    }
+    return 0;
+}
 
-    u_int32_t swap_location;
+/*
+ * swap_diskalloc_cluster()
+ * Allocate npages adjacent swap slots. The first one is returned in start.
+ * Returns ENOSPC if there is no free run that long.
+ */
+int swap_diskalloc_cluster(int npages, u_int32_t *start)
+{
+    u_int32_t i, slot;
+    u_int32_t run = 0;
+    u_int32_t nslots = num_swap_pages_avail;
 
-    err = swap_diskalloc(&swap_location);
-    if(err) {
-        return err;
+    lock_acquire(swap_slot_lock);
+
+    if(swap_cluster_hint >= nslots) {
+        swap_cluster_hint = 1;
+    }
+
+    /* scan from the hint, wrapping around once. A run can't straddle the wrap */
+    slot = swap_cluster_hint;
+    for(i=0; i<nslots; i++, slot++) {
+        if(slot >= nslots) {
+            slot = 1;
+            run = 0;
+        }
+
+        if(bitmap_isset(swap_bitmap, slot)) {
+            run = 0;
+            continue;
+        }
+
+        run++;
+        if(run == (u_int32_t)npages) {
+            *start = slot - npages + 1;
+            for(slot=*start; slot<*start+npages; slot++) {
+                bitmap_mark(swap_bitmap, slot);
+            }
+            swap_cluster_hint = *start + npages;
+            lock_release(swap_slot_lock);
+            return 0;
+        }
     }
 
-    entry->ppageaddr = 0;
-    entry->swap_state = PTE_SWAPPED;
-    entry->swap_location = swap_location;
+    lock_release(swap_slot_lock);
+    return ENOSPC;
+}
+
+
+
+/****************************************************************************************
+ ****** Commit accounting ***************************************************************
+ ****************************************************************************************/
+
+/* Every page of anonymous memory can live either in a frame or in a swap slot, slot 0 is never used */
+static u_int32_t swap_commitlimit()
+{
+    u_int32_t nslots = (num_swap_pages_avail > 0) ? num_swap_pages_avail - 1 : 0;
+    return nslots + (last_avail_ppage - first_avail_ppage);
+}
+
+/*
+ * swap_commit()
+ * Nothing is reserved on the swap disk, the pages are only counted. Under the heuristic policy the
+ * count can run past the limit, and the pages that don't fit fail when they are written out.
+ */
+int swap_commit(u_int32_t npages)
+{
+    int spl = splhigh();
+    u_int32_t limit = swap_commitlimit();
 
+    if(npages > limit) {
+        splx(spl);
+        return ENOMEM;
+    }
+    if(swap_overcommit == OVERCOMMIT_STRICT && swap_committed + npages > limit) {
+        splx(spl);
+        return ENOMEM;
+    }
+    swap_committed += npages;
+
+    splx(spl);
     return 0;
 }
 
+/* swap_uncommit() */
+void swap_uncommit(u_int32_t npages)
+{
+    int spl = splhigh();
+
+    assert(swap_committed >= npages);
+    swap_committed -= npages;
+
+    splx(spl);
+}
 
 /*
- * Let other files allocate or deallocate swap disk space
+ * swap_setovercommit()
+ * Switching to strict while more than the limit is committed doesn't take anything back, it only
+ * refuses new charges until enough are given back.
  */
-void swap_diskfree(u_int32_t swap_location)
+int swap_setovercommit(const char *name)
 {
-    assert( lock_do_i_hold(swap_lock) );
-    bitmap_unmark(swap_bitmap, swap_location);
+    int i;
+    int spl;
+
+    for(i=0; swap_overcommit_names[i] != NULL; i++) {
+        if(!strcmp(swap_overcommit_names[i], name)) {
+            spl = splhigh();
+            swap_overcommit = i;
+            splx(spl);
+            return 0;
+        }
+    }
+
+    return EINVAL;
 }
 
-int swap_diskalloc(u_int32_t *swap_location)
+/* swap_listovercommit() */
+void swap_listovercommit()
+{
+    int i;
+
+    for(i=0; swap_overcommit_names[i] != NULL; i++) {
+        kprintf("%s%s ", swap_overcommit_names[i], (i == swap_overcommit) ? "*" : "");
+    }
+    kprintf("\n%u of %u pages committed\n", swap_committed, swap_commitlimit());
+}
+
+
+
+/****************************************************************************************
+ ****** Pageout daemon ******************************************************************
+ ****************************************************************************************/
+
+/*
+ * pageout_daemon()
+ * 
+ * Body of the pageout thread. Sleeps until free memory drops below the low watermark, then
+ * evicts pages until the high watermark is reached and cleans a batch of dirty pages. Only the pages
+ * being written are busy, faults on everything else go ahead while the daemon waits for the disk.
+ */
+static void pageout_daemon(void *unused1, unsigned long unused2)
 {
-    assert( lock_do_i_hold(swap_lock) );
     int err;
-    err = bitmap_alloc(swap_bitmap, swap_location);
+    int i;
+    int cleaned;
+    int npages;
+    struct pte *entry;
+    struct pte *cluster[SWAP_CLUSTER_SIZE];
+
+    (void) unused1;
+    (void) unused2;
+
+    thread_daemonize();
+
+    int spl = splhigh();
+
+    while(1) {
+        while(coremap_freecount() >= PAGEOUT_LOW_WATERMARK) {
+            thread_sleep(&pageout_started);
+        }
+
+        /* evict until we are back above the high watermark */
+        while(coremap_freecount() < PAGEOUT_HIGH_WATERMARK) {
+            err = swap_pageout();
+            if(err) {
+                break;
+            }
+            thread_yield();
+        }
+
+        /* clean pages ahead of time so later evictions are free, one cluster at a time */
+        for(cleaned=0; cleaned<PAGEOUT_CLEAN_BATCH; cleaned+=npages) {
+            for(npages=0; npages<SWAP_CLUSTER_SIZE && cleaned+npages<PAGEOUT_CLEAN_BATCH; npages++) {
+                /* busy pages are skipped, so we never get the same page twice */
+                entry = coremap_swap_nextdirty();
+                if(entry == NULL) {
+                    break;
+                }
+                coremap_busy_mark(PTE_PADDR(entry));
+                cluster[npages] = entry;
+            }
+            if(npages == 0) {
+                break;
+            }
+            err = swap_pagecleancluster(cluster, npages);
+            for(i=0; i<npages; i++) {
+                coremap_busy_unmark(PTE_PADDR(cluster[i]));
+            }
+            if(err) {
+                break;
+            }
+            thread_yield();
+        }
+
+        /* don't spin if we couldn't get back above the low watermark */
+        if(coremap_freecount() < PAGEOUT_LOW_WATERMARK) {
+            thread_sleep(&pageout_started);
+        }
+    }
+
+    splx(spl);
+}
+
+/*
+ * pageout_bootstrap()
+ * Start the pageout daemon. Requires the swap disk, so call this after swap_bootstrap().
+ */
+void pageout_bootstrap()
+{
+    int err;
+
+    if(!SWAPPING_ENABLE || !PAGEOUT_DAEMON_ENABLE) {
+        return;
+    }
+
+    err = thread_fork("pageout", NULL, 0, pageout_daemon, NULL);
     if(err) {
-        return err;      /* swap is full! */
+        panic("Could not start pageout daemon");
     }
-    return 0;
+    pageout_started = 1;
 }
 
+/*
+ * pageout_wakeup()
+ * Called after pages are allocated. Kicks the pageout daemon if free memory is running low.
+ */
+void pageout_wakeup()
+{
+    int spl = splhigh();
+
+    if(pageout_started && coremap_freecount() < PAGEOUT_LOW_WATERMARK) {
+        thread_wakeup(&pageout_started);
+    }
+
+    splx(spl);
+}
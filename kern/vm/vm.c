@@ -18,6 +18,7 @@
 #include <thread.h>
 #include <curthread.h>
 #include <addrspace.h>
+#include <region.h>
 #include <vm.h>
 #include <synch.h>
 #include <coremap.h>
@@ -26,8 +27,26 @@
 #include <pagetable.h>
 #include <permissions.h>
 #include <vm_features.h>
+#include <replacement.h>
+#include <pagecache.h>
 
 
+/* VM statistics */
+struct vmstat vmstat;
+
+/* buffer that vm_lodfault() reads the fault-around window into, protected by faultaround_lock */
+static char *faultaround_buf;
+static struct lock *faultaround_lock;
+
+/*
+ * The zero page. Reads of heap, stack and bss pages that were never written map this one frame
+ * read only instead of getting a frame of their own. Every such page table slot points at
+ * vm_zeropte, which is shared like any copy on write page, so the first write goes through
+ * vm_copyonwritefault. The kernel holds a share that it never gives up, so the entry is never
+ * freed, and the frame is a kernel page, so it is never evicted.
+ */
+static struct pte_shared vm_zeropte;
+
 /*
  * vm_bootstrap()
  * All the heavy lifting is done in coremap_bootstrap()
@@ -36,7 +55,72 @@ void
 vm_bootstrap(void)
 {
 	coremap_bootstrap();
-	as_bitmap_bootstrap();
+	as_asid_bootstrap();
+	vmstat_reset();
+
+	vaddr_t zeropage = alloc_kpages(1);
+	if(zeropage == 0) {
+		panic("Could not allocate the zero page");
+	}
+	bzero((void *)zeropage, PAGE_SIZE);
+	vm_zeropte.ps_pte.pte_word = PTE_OUTOFLINE;
+	PTE_SET_PADDR(&vm_zeropte.ps_pte, zeropage - MIPS_KSEG0);
+	PTE_SET_PERMS(&vm_zeropte.ps_pte, set_permissions(1, 1, 0));
+	PTE_SET_STATE(&vm_zeropte.ps_pte, PTE_PRESENT);
+	vm_zeropte.ps_pte.swap_location = 0;
+	vm_zeropte.ps_sharers = 0;
+
+	faultaround_buf = (char *)kmalloc(FAULTAROUND_PAGES*PAGE_SIZE);
+	faultaround_lock = lock_create("faultaround_lock");
+	if(faultaround_buf == NULL || faultaround_lock == NULL) {
+		panic("Could not allocate fault-around buffer");
+	}
+}
+
+
+/*
+ * vmstat_print()
+ * Print the VM statistics along with the replacement policy in use
+ */
+void
+vmstat_print(void)
+{
+	int spl = splhigh();
+
+	kprintf("page replacement policy: ");
+	replacement_listpolicies();
+	kprintf("free pages:  %d\n", coremap_freecount());
+	kprintf("faults:      %u\n", vmstat.vs_faults);
+	kprintf("swap ins:    %u\n", vmstat.vs_swapins);
+	kprintf("swap outs:   %u\n", vmstat.vs_swapouts);
+	kprintf("evictions:   %u\n", vmstat.vs_evictions);
+	kprintf("clustered writes: %u\n", vmstat.vs_clusterwrites);
+	kprintf("fault-around: %u pages\n", vmstat.vs_faultaround);
+	kprintf("zero page:   %u maps, %d sharers\n", vmstat.vs_zerofaults, vm_zeropte.ps_sharers);
+	kprintf("zero pool:   %d pages, %u hits, %u misses, %u zeroed when idle\n", 
+		coremap_zero_count(), vmstat.vs_zerohits, vmstat.vs_zeromisses, vmstat.vs_zeroidle);
+	kprintf("page table leaves split: %u\n", vmstat.vs_ptsplits);
+	kprintf("file pages:  %u read back, %u written back, %u dropped\n", 
+		vmstat.vs_filereads, vmstat.vs_filewrites, vmstat.vs_filedrops);
+	kprintf("page cache:  %d pages, %u hits, %u reclaimed\n", 
+		pagecache_count(), vmstat.vs_pchits, vmstat.vs_pcreclaims);
+	kprintf("page xfer:   %u pages moved\n", vmstat.vs_xferpages);
+	kprintf("readahead:   %u pages, %u hits, %u misses, window %d\n", 
+		vmstat.vs_ra_pages, vmstat.vs_ra_hits, vmstat.vs_ra_misses, swap_readahead_window());
+
+	splx(spl);
+}
+
+/*
+ * vmstat_reset()
+ * Zero the VM statistics, so a workload can be measured on its own
+ */
+void
+vmstat_reset(void)
+{
+	int spl = splhigh();
+	bzero(&vmstat, sizeof(struct vmstat));
+	splx(spl);
 }
 
 
@@ -55,29 +139,21 @@ alloc_kpages(int npages)
 	/* mark that we want the pages to be fixed and will be kernel pages */
 	paddr = get_ppages(npages, 1, NULL);
 	if(paddr != 0) {
+		pageout_wakeup();
 		splx(spl);
 		return PADDR_TO_KVADDR(paddr);
 	}
 	
 if(SWAPPING_ENABLE) {
-	int lock_held_prior = lock_do_i_hold(swap_lock);
-	lock_acquire(swap_lock);
-
-	err = swap_createspace(npages);
-	if(err) {
-		if(!lock_held_prior) {
-			lock_release(swap_lock);
+	/* Other threads may grab the pages while we sleep on the disk, so keep at it until swapping fails */
+	while(paddr == 0) {
+		err = swap_createspace(npages);
+		if(err) {
+			splx(spl);
+			return 0;
 		}
-		splx(spl);
-		return 0;
-	}
-	/* try again */
-	paddr = get_ppages(npages, 1, NULL);
-	if(paddr == 0) {
-		panic("Something seriously wrong with swap");
-	}
-	if(!lock_held_prior) {
-		lock_release(swap_lock);
+		/* try again */
+		paddr = get_ppages(npages, 1, NULL);
 	}
 	splx(spl);
 	return PADDR_TO_KVADDR(paddr);
@@ -101,40 +177,87 @@ free_kpages(vaddr_t addr)
 
 
 /* 
- * alloc_upages()
- * Allocate user pages. High level interface to pagetables and coremap.
- * Makes sure pagetables are consistent with coremap
- * Returns the new page table entry on success and NULL on failure
+ * alloc_uframe()
+ * Get a physical page for entry, evicting if we have to. The page is busy, so nobody touches it
+ * until the caller maps it and calls coremap_busy_unmark(). Returns 0 if we are out of memory.
+ * This may sleep, so entry may have changed by the time we return if it is shared.
  */
-void
-alloc_upage(struct pte *entry)
+paddr_t
+alloc_uframe(struct pte *entry)
 {
 	int err;
+	paddr_t paddr;
 	int spl = splhigh();
 
 	assert(entry != NULL);
-	assert(entry->ppageaddr == 0);
-	assert( lock_do_i_hold(swap_lock) );
 
 	/* Get physical page from coremap */
-	entry->ppageaddr = get_ppages(1, 0, entry);
-	if(entry->ppageaddr != 0) {
+	paddr = get_ppages(1, 0, entry);
+	if(paddr != 0) {
+		pageout_wakeup();
 		splx(spl);
-		return;
+		return paddr;
 	}
 
 if(SWAPPING_ENABLE) {
-	err = swap_pageout();
-	if(err) {
-		splx(spl);
-		return;
-	}
-	entry->ppageaddr = get_ppages(1, 0, entry);
-	if(entry->ppageaddr == 0) {
-		panic("Something messed up with swap");
+	/* pages we evict may be taken by other threads while we sleep on the disk, so keep at it */
+	while(paddr == 0) {
+		err = swap_pageout();
+		if(err) {
+			splx(spl);
+			return 0;
+		}
+		paddr = get_ppages(1, 0, entry);
 	}
 }
 	splx(spl);
+	return paddr;
+}
+
+/*
+ * alloc_uzeroframe()
+ * Same as alloc_uframe(), but the page is zero filled. If the idle loop left a zeroed page in the
+ * zero pool we take that one, otherwise we clear a fresh page here.
+ */
+paddr_t
+alloc_uzeroframe(struct pte *entry)
+{
+	paddr_t paddr;
+	int spl = splhigh();
+
+	if(ZERO_POOL_ENABLE) {
+		paddr = coremap_zero_get(entry);
+		if(paddr != 0) {
+			vmstat.vs_zerohits++;
+			pageout_wakeup();
+			splx(spl);
+			return paddr;
+		}
+		vmstat.vs_zeromisses++;
+	}
+
+	paddr = alloc_uframe(entry);
+	if(paddr != 0) {
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	}
+
+	splx(spl);
+	return paddr;
+}
+
+/* 
+ * alloc_upages()
+ * Allocate user pages. High level interface to pagetables and coremap.
+ * Makes sure pagetables are consistent with coremap
+ * Sets the frame of entry to the new, busy page. It is 0 on failure
+ */
+void
+alloc_upage(struct pte *entry)
+{
+	assert(entry != NULL);
+	assert(PTE_PADDR(entry) == 0);
+
+	PTE_SET_PADDR(entry, alloc_uframe(entry));
 }
 
 /*
@@ -146,40 +269,58 @@ void
 free_upage(struct pte *entry)
 {
 	int spl = splhigh();
-	assert(lock_do_i_hold(swap_lock));
 
-	if(entry->num_sharers > 0) {
-		entry->num_sharers -= 1; /* other threads are still using this page. Just back out of this one */
+	if(pte_sharers(entry) > 0) {
+		pte_dropsharer(entry); /* other threads are still using this page. Just back out of this one */
+
+		/* The page cache keeps its pages until they are evicted. This one already was */
+		if((entry->pte_word & PTE_CACHED) && pte_sharers(entry) == 0 && PTE_PADDR(entry) == 0) {
+			pagecache_release(entry);
+		}
 		splx(spl);
 		return;
 	}
 
-	/* Depending on the swap state, we free differently */
-	switch(entry->swap_state) {
+	/* The entry is ours alone now, but a page out or page in may still be in flight */
+	while(PTE_PADDR(entry) != 0 && coremap_is_busy(PTE_PADDR(entry))) {
+		coremap_busy_wait(PTE_PADDR(entry));
+	}
+
+	/* Depending on the swap state, we free differently. File pages have no swap slot */
+	switch(PTE_STATE(entry)) {
+		case PTE_NONE:
+			/* a file page that was dropped, there is nothing left of it */
+			assert(PTE_PADDR(entry) == 0);
+			break;
 		case PTE_PRESENT:
-			assert(entry->ppageaddr != 0);
-			free_ppages(entry->ppageaddr);
-			entry->ppageaddr = 0;
-			entry->swap_state = PTE_NONE;
+			assert(PTE_PADDR(entry) != 0);
+			free_ppages(PTE_PADDR(entry));
+			PTE_SET_PADDR(entry, 0);
+			PTE_SET_STATE(entry, PTE_NONE);
 			break;
 		case PTE_SWAPPED:
 			swap_diskfree(entry->swap_location);
-			entry->ppageaddr = 0;
-			entry->swap_state = PTE_NONE;
+			PTE_SET_PADDR(entry, 0);
+			PTE_SET_STATE(entry, PTE_NONE);
 			break;
 		case PTE_DIRTY:
 		case PTE_CLEAN:
-			assert(entry->ppageaddr != 0);
-			free_ppages(entry->ppageaddr);
-			swap_diskfree(entry->swap_location);
-			entry->ppageaddr = 0;
-			entry->swap_state = PTE_NONE;
+			assert(PTE_PADDR(entry) != 0);
+			free_ppages(PTE_PADDR(entry));
+			if(!(entry->pte_word & PTE_FILE)) {
+				swap_diskfree(entry->swap_location);
+			}
+			PTE_SET_PADDR(entry, 0);
+			PTE_SET_STATE(entry, PTE_NONE);
 			break;
 		default:
 			panic("invalid swap state!!\n");
 	}
 
-	pte_destroy(entry);
+	/* a page table slot stays until pt_remove(), only shared entries are freed here */
+	if(entry->pte_word & PTE_OUTOFLINE) {
+		pte_destroy(entry);
+	}
 
 	splx(spl);
 }
@@ -192,136 +333,172 @@ free_upage(struct pte *entry)
  * cannot be completed if there isn't a TLB entry. As a result, we need to examine the fault
  * and determine whether to allocate a page to resolve the fault, or to kill the program.
  * 
- * Page faults imply TLB faults but not the other way around. Without load on demand or
- * swapping, there should never be any page faults... for now.
+ * First we look up the region of the faulting address. No region means a segfault.
  * 
- * 1. Fault on Read, Page Fault: 		This is a SEG fault. Kill the program
- * 2. Fault on Read, No Page Fault: 	Add it to the TLB
- * 3. Fault on Write, Page Fault: 		If they are writing to the correct stackptr, then allocate a new page. Otherwise kill the program
- * 4. Fault on Write, No Page Fault: 	Add it into the TLB. Check if the page in question is writable though
+ * 1. Page fault (no page table entry): 	The pager of the region brings in the page. Writes need a writable region
+ * 2. Fault on Read, No Page Fault: 		Add it to the TLB, or swap it in
+ * 3. Fault on Write, No Page Fault: 		Add it into the TLB. Check if the page in question is writable though
+ * 4. Fault on Readonly: 					Copy on write, or the first write to a clean page
  */ 
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {	
 	int spl = splhigh();
-	lock_acquire(swap_lock);
+	vmstat.vs_faults++;
 
-	int is_pagefault, is_stack, is_swapped, is_shared;
+	int is_swapped, is_shared;
 	vaddr_t faultpage;
 	int retval;
+	int lock_held_prior;
+	struct pte *faultentry;
+	struct vm_region *region;
 
 	/* Get current addrspace */
 	struct addrspace *as = curthread->t_vmspace;
 	assert(as != NULL);
 
-	/* Detetermine a number of flags: is_pagefault, is_swapped, is_stack */
-	is_pagefault = 0;
+	/* We may fault on user memory while already holding our own lock, e.g. in a system call */
+	lock_held_prior = lock_do_i_hold(as->as_lock);
+	lock_acquire(as->as_lock);
+
 	faultpage = (faultaddress & PAGE_FRAME);
-	struct pte *faultentry = pt_get(as->as_pagetable, faultpage);
-	if(faultentry == NULL) {
-		is_pagefault = 1;
-	}
 
-	is_swapped = 0;
-	is_shared = 0;
-	if(faultentry != NULL) {
-		if(faultentry->swap_state == PTE_SWAPPED) {
-			is_swapped = 1;
+retry:
+	/* Check to see if address is valid */
+	region = region_find(as, faultpage);
+	if(region == NULL) {
+		if(!lock_held_prior) {
+			lock_release(as->as_lock);
 		}
-		if(faultentry->num_sharers > 0) {
-			is_shared = 1;
+		splx(spl);
+		return EFAULT;
+	}
+
+	/* Writes change the page, so the page table leaf it is in must not be shared */
+	if(faulttype != VM_FAULT_READ) {
+		retval = pt_unshare(as->as_pagetable, faultpage);
+		if(retval) {
+			if(!lock_held_prior) {
+				lock_release(as->as_lock);
+			}
+			splx(spl);
+			return retval;
 		}
 	}
 
-	is_stack = 0;
-	if( faultpage >= (USERSTACKBASE) && faultpage < as->as_stackptr ) {
-		is_stack = 1;
+	faultentry = pt_get(as->as_pagetable, faultpage);
+
+	/* Somebody is paging this page in or out, wait for them and look again */
+	if(faultentry != NULL && PTE_PADDR(faultentry) != 0 && coremap_is_busy(PTE_PADDR(faultentry))) {
+		coremap_busy_wait(PTE_PADDR(faultentry));
+		goto retry;
 	}
 
-	/* Check to see if address is valid */
-	if( !is_vaddrcode(as, faultpage) && 
-		!is_vaddrdata(as, faultpage) && 
-		!is_vaddrheap(as, faultpage) && 
-		!is_vaddrstack(as, faultpage) && 
-		!is_stack ) {
-			lock_release(swap_lock);
-			splx(spl);
-			return EFAULT;
+	/* A file page that was dropped when it was evicted, read it back in and look again */
+	if(faultentry != NULL && PTE_STATE(faultentry) == PTE_NONE && (faultentry->pte_word & PTE_FILE)) {
+		retval = vm_filepagein(as, region, faultentry, faultpage);
+		if(retval == 0 || retval == EAGAIN) {
+			goto retry;
+		}
+	}
+	else if(faultentry == NULL) {
+		/* Nothing mapped here yet, the pager of the region knows where the page comes from */
+		if(faulttype != VM_FAULT_READ && !is_writeable(region->vr_perms)) {
+			retval = EFAULT;
+		}
+		else if(!is_readable(region->vr_perms) && !is_executable(region->vr_perms)) {
+			retval = EFAULT;	/* mapped PROT_NONE */
+		}
+		else {
+			retval = region->vr_pager->pg_fault(as, region, faultaddress, faulttype);
 		}
 
-	/* If page is clean, we change the state to dirty as neccessary */
-	if(faultentry != NULL) {
-		if(faultentry->swap_state == PTE_CLEAN && faulttype != VM_FAULT_READ) {
-			faultentry->swap_state = PTE_DIRTY;
+		/* A fault in the gap below a region that grows down, the stack grew */
+		if(retval == 0 && faultpage < region->vr_start) {
+			region->vr_start = faultpage;
 		}
 	}
+	else if(faulttype != VM_FAULT_READ && !is_writeable(region->vr_perms)) {
+		/* the page itself may be writable for others, like a shared memory segment attached read only */
+		retval = EFAULT;
+	}
+	else {
+		is_swapped = (PTE_STATE(faultentry) == PTE_SWAPPED);
+		is_shared = pt_isshared(as->as_pagetable, faultpage);
 
-	/*
-	 * Handle the faults
-	 */
-	switch(faulttype)
-	{
-		case VM_FAULT_READ:
-			retval = vm_readfault(as, faultentry, faultaddress, is_pagefault, is_stack, is_swapped, is_shared);
-			break;
+		/* Pages of a shared region are written in place by everyone who maps them, never copied */
+		if(region->vr_flags & VR_SHARED) {
+			is_shared = 0;
+		}
 
-		case VM_FAULT_WRITE:
-			retval = vm_writefault(as, faultentry, faultaddress, is_pagefault, is_stack, is_swapped, is_shared);
-			break;
+		/* 
+		 * If page is clean, we change the state to dirty as neccessary. A private file page is ours
+		 * once written, it becomes an anonymous page. If it is shared the copy on write does that.
+		 */
+		if(PTE_STATE(faultentry) == PTE_CLEAN && faulttype != VM_FAULT_READ && is_writeable(PTE_PERMS(faultentry))) {
+			if(!(faultentry->pte_word & PTE_FILE) || (region->vr_flags & VR_SHARED)) {
+				PTE_SET_STATE(faultentry, PTE_DIRTY);
+			}
+			else if(!is_shared) {
+				faultentry->pte_word &= ~PTE_FILE;
+				PTE_SET_STATE(faultentry, PTE_PRESENT);
+			}
+		}
 
-		case VM_FAULT_READONLY:
-			retval = vm_readonlyfault(as, faultentry, faultaddress, is_pagefault, is_stack, is_swapped, is_shared);
-			break;
-		default:
-			retval = EINVAL;
+		/*
+		 * Handle the faults
+		 */
+		switch(faulttype)
+		{
+			case VM_FAULT_READ:
+				retval = vm_readfault(as, faultentry, faultaddress, is_swapped, is_shared);
+				break;
+
+			case VM_FAULT_WRITE:
+				retval = vm_writefault(as, faultentry, faultaddress, is_swapped, is_shared);
+				break;
+
+			case VM_FAULT_READONLY:
+				retval = vm_readonlyfault(as, faultentry, faultaddress, is_swapped, is_shared);
+				break;
+			default:
+				retval = EINVAL;
+		}
+	}
+
+	/* The page changed under us while we slept, start over */
+	if(retval == EAGAIN) {
+		goto retry;
 	}
 
 	// if(retval != 0) {
 	// 	kprintf("Something is wrong in vm_fault\n");
 	// }
 
-	lock_release(swap_lock);
+	if(!lock_held_prior) {
+		lock_release(as->as_lock);
+	}
 	splx(spl);
 	return retval;
 }
 
-/* Need to check whether the page is already in memory or not (is_pagefault ?) 
- * If it IS, load appropriate entry into TLB and return from exception 
- * If it is NOT:
- * 		 - allocate a place in physical memory to store the page - use alloc_upage
- * 		 - load the page, using info from the program's ELF file to do so - call load_page_od
- * 		 - update the OS/161's information about this address space
- * 				* I suppose twe need an additional flag in  the PTE struct for whether or not the page is already in the mem
- *       - load appropriate entry into TLB and return from the exception - TLB_Replace + TLB_WriteDirty & Valid
- */
-
 /* Handles faults on reads */
 int vm_readfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, 
-					int is_pagefault, int is_stack, int is_swapped, int is_shared)
+					int is_swapped, int is_shared)
 {
 	assert(curspl>0);
-	assert(lock_do_i_hold(swap_lock));
+	assert(lock_do_i_hold(as->as_lock));
 
 	int idx;
-	(void) is_stack;
 
 	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
 
-	if(is_pagefault) {
-		if(LOAD_ON_DEMAND_ENABLE) {
-			return vm_lodfault(as, faultaddress, VM_FAULT_READ);
-		}
-		else {
-			return EFAULT;
-		}
-
-	}
-	
-	if(!is_pagefault && !is_swapped) {
-		if(is_readable(faultentry->permissions)) {
-			idx = TLB_Replace(faultpage, faultentry->ppageaddr);
-			if( is_writeable(faultentry->permissions) && !is_shared ) {
+	if(!is_swapped) {
+		if(is_readable(PTE_PERMS(faultentry))) {
+			idx = TLB_Replace(faultpage, PTE_PADDR(faultentry));
+			/* clean pages stay read only so the first write marks them dirty */
+			if( is_writeable(PTE_PERMS(faultentry)) && !is_shared && PTE_STATE(faultentry) != PTE_CLEAN ) {
 				TLB_WriteDirty(idx, 1);
 			}
 			else {
@@ -329,8 +506,9 @@ int vm_readfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddr
 			}
 			TLB_WriteValid(idx, 1);
 
-			if(LRU_CLOCK) {
-				coremap_lruclock_update(faultentry->ppageaddr);
+			/* the zero page belongs to the kernel, the replacement policy doesn't know about it */
+			if(faultentry != &vm_zeropte.ps_pte) {
+				coremap_page_referenced(PTE_PADDR(faultentry), faultpage);
 			}
 
 			return 0;
@@ -341,21 +519,16 @@ int vm_readfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddr
 		}
 	}
 	
-	if(!is_pagefault && is_swapped) {
-		return vm_swapfault(as, faultentry, faultaddress, VM_FAULT_READ);
-	}
-
-	panic("Should not reach here, vm_readfault");
-	return 0;
+	return vm_swapfault(as, faultentry, faultaddress, VM_FAULT_READ);
 }
 
 
 /* Handles faults on writes */
 int vm_writefault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, 
-					int is_pagefault, int is_stack, int is_swapped, int is_shared)
+					int is_swapped, int is_shared)
 {
 	assert(curspl>0);
-	assert(lock_do_i_hold(swap_lock));
+	assert(lock_do_i_hold(as->as_lock));
 
 	int idx;
 
@@ -367,35 +540,14 @@ int vm_writefault(struct addrspace *as, struct pte *faultentry, vaddr_t faultadd
 		return vm_copyonwritefault(as, faultentry, faultaddress);
 	}
 
-	/* Check to see if page fault is to the stack. If so we should allocate a page for the stack. */
-	if(is_pagefault && is_stack) {
-		return vm_stackfault(as, faultaddress);
-	}
-
-	/* In current stack region or heap region */
-	if( (is_pagefault) && (is_vaddrstack(as, faultpage) || is_vaddrheap(as, faultpage)) ) {
-		return vm_allocstackheap(as, faultaddress);
-	}
-
-	if(is_pagefault && !is_stack) {
-		if(LOAD_ON_DEMAND_ENABLE) {
-			return vm_lodfault(as, faultaddress, VM_FAULT_WRITE);
-		}
-		else {
-		    return EFAULT;
-		}
-	}
-
-	/* If not page fault, check permissions then add to the TLB */
-	if(!is_pagefault && !is_swapped) {
-		if( is_writeable(faultentry->permissions) ) {
-			idx = TLB_Replace(faultpage, faultentry->ppageaddr);
+	/* check permissions then add to the TLB */
+	if(!is_swapped) {
+		if( is_writeable(PTE_PERMS(faultentry)) ) {
+			idx = TLB_Replace(faultpage, PTE_PADDR(faultentry));
 			TLB_WriteDirty(idx, 1);
 			TLB_WriteValid(idx, 1);
 
-			if(LRU_CLOCK) {
-				coremap_lruclock_update(faultentry->ppageaddr);
-			}
+			coremap_page_referenced(PTE_PADDR(faultentry), faultpage);
 
 			return 0;
 		}
@@ -404,166 +556,89 @@ int vm_writefault(struct addrspace *as, struct pte *faultentry, vaddr_t faultadd
 		}
 	}
 	
-	if(!is_pagefault && is_swapped) {
-		return vm_swapfault(as, faultentry, faultaddress, VM_FAULT_WRITE);
-	}
-	else {
-		return EFAULT;
-	}
+	return vm_swapfault(as, faultentry, faultaddress, VM_FAULT_WRITE);
 }
 
-/* Only purpose is to help us implement COW. If it hits here, it means that we should copy the entry, and set it to writable */
+/* 
+ * Writes to read only TLB entries. Either the page is shared and we have to copy it (COW), or it is a
+ * writable page that was mapped read only while it was clean. vm_fault already marked it dirty, so we
+ * just make the TLB entry writable.
+ */
 int vm_readonlyfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, 
-						int is_pagefault, int is_stack, int is_swapped, int is_shared)
+						int is_swapped, int is_shared)
 {	
-	/* We must be handling a shared page if we reach this point! */
-	assert(lock_do_i_hold(swap_lock));
-	assert(is_shared);
-
-	(void) is_pagefault;
-	(void) is_stack;
-	(void) is_swapped;
-
-	if( !is_writeable(faultentry->permissions) ) {
-		return EFAULT;
-	}
-
-	return vm_copyonwritefault(as, faultentry, faultaddress);
-}
-
-
-/***********************************************************************
- **************** Specific Faults **************************************
- ***********************************************************************/
-
-/* Handle a fault that results from writing to the stack */
-int vm_stackfault(struct addrspace *as, vaddr_t faultaddress) 
-{
-	assert(lock_do_i_hold(swap_lock));
+	assert(lock_do_i_hold(as->as_lock));
 
 	int idx;
-	int err;
-	paddr_t faultpage_paddr;
-	struct pte *new_stack_entry;
-	//vaddr_t vpageaddr;
 	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
-	int num_requested_pages = ((as->as_stackptr - faultpage) >> PAGE_OFFSET);
-
-	// for(idx=0; idx<num_requested_pages; idx++) {
-
-	// 	vpageaddr = faultpage + PAGE_SIZE*idx;
-
-	// 	new_stack_entry = pte_init();
-	// 	if(new_stack_entry == NULL) {
-	// 		return ENOMEM;
-	// 	}
-
-	// 	if(idx==0) {
-	// 		/* For the fault page, we actually give it a physical page */
-	// 		alloc_upage(new_stack_entry);
-	// 		if(new_stack_entry->ppageaddr == 0) {
-	// 			pte_destroy(new_stack_entry);
-	// 			return ENOMEM;
-	// 		}
-	// 		faultpage_paddr = new_stack_entry->ppageaddr;
-			
-	// 		/* entry->ppageaddr is updated by alloc_upage */
-	// 		new_stack_entry->permissions = set_permissions(1, 1, 0);
-	// 		new_stack_entry->swap_state = PTE_PRESENT;
-	// 		new_stack_entry->swap_location = 0;
-	// 	}
-	// 	else {
-	// 		/* for the others, we simply allocate swap storage */
-	// 		err = swap_allocpage_od(new_stack_entry);
-	// 		if(err) {
-	// 			return err;
-	// 		}
-	// 		new_stack_entry->permissions = set_permissions(1, 1, 0);
-	// 	}
-
-	// 	/* add entry to page table */
-	// 	pt_add(as->as_pagetable, vpageaddr, new_stack_entry);
-	// }	
-
-	new_stack_entry = pte_init();
-	if(new_stack_entry == NULL) {
-		return ENOMEM;
-	}
-	/* Give the faultaddress its entry */
-	alloc_upage(new_stack_entry);
-	if(new_stack_entry->ppageaddr == 0) {
-		pte_destroy(new_stack_entry);
-		return ENOMEM;
-	}
 
-	err = pt_add(as->as_pagetable, faultpage, new_stack_entry);
-	if(err) {
-		pte_destroy(new_stack_entry);
-		return ENOMEM;
+	if( is_swapped || !is_writeable(PTE_PERMS(faultentry)) ) {
+		return EFAULT;
 	}
 
-	faultpage_paddr = new_stack_entry->ppageaddr;
-	
-	/* entry->ppageaddr is updated by alloc_upage */
-	new_stack_entry->permissions = set_permissions(1, 1, 0);
-	new_stack_entry->swap_state = PTE_PRESENT;
-	new_stack_entry->swap_location = 0;
+	if(is_shared) {
+		return vm_copyonwritefault(as, faultentry, faultaddress);
+	}
 
-	/* let vm_fault allocate the stack pages on demand */
-	as->as_stackptr -= PAGE_SIZE*num_requested_pages;
-	assert(as->as_stackptr == faultpage);
+	assert(PTE_STATE(faultentry) == PTE_DIRTY || PTE_STATE(faultentry) == PTE_PRESENT);
 
-	/* Add to the TLB */
-	idx = TLB_Replace(faultpage, faultpage_paddr);
+	idx = TLB_ProbeVaddr(faultpage);
+	if(idx < 0) {
+		idx = TLB_Replace(faultpage, PTE_PADDR(faultentry));
+	}
 	TLB_WriteDirty(idx, 1);
 	TLB_WriteValid(idx, 1);
 
-	if(LRU_CLOCK) {
-		coremap_lruclock_update(faultpage_paddr);
-	}
+	coremap_page_referenced(PTE_PADDR(faultentry), faultpage);
 
 	return 0;
 }
 
 
+/***********************************************************************
+ **************** Specific Faults **************************************
+ ***********************************************************************/
+
 /* Handle a fault that results from reading/writing to a swapped page */
 int vm_swapfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddress, int faulttype)
 {
-	assert(lock_do_i_hold(swap_lock));
-
-	(void) as;
+	assert(lock_do_i_hold(as->as_lock));
 
 	int err, idx;
 	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
 
 	/* Check to see if we have proper permissions */
-	if(faulttype == VM_FAULT_READ && !is_readable(faultentry->permissions)) {
+	if(faulttype == VM_FAULT_READ && !is_readable(PTE_PERMS(faultentry))) {
 		return EFAULT;
 	}
-	else if(faulttype == VM_FAULT_WRITE && !is_writeable(faultentry->permissions)) {
+	else if(faulttype == VM_FAULT_WRITE && !is_writeable(PTE_PERMS(faultentry))) {
 		return EFAULT;
 	}
 
 	/* Lets swap in the page */
-	err = swap_pagein(faultentry);
+	if(SWAP_READAHEAD_ENABLE) {
+		err = swap_pagein_readahead(as, faultpage, faultentry);
+	}
+	else {
+		err = swap_pagein(faultentry);
+	}
 	if(err) {
 		return err;
 	}
-	assert(faultentry->swap_state == PTE_CLEAN ); /* Just loaded the page, it should be clean */
-	assert(faultentry->ppageaddr != 0);
+	assert(PTE_STATE(faultentry) == PTE_CLEAN ); /* Just loaded the page, it should be clean */
+	assert(PTE_PADDR(faultentry) != 0);
 
-	idx = TLB_Replace(faultpage, faultentry->ppageaddr);
-	if(LRU_CLOCK) {
-		coremap_lruclock_update(faultentry->ppageaddr);
-	}
+	idx = TLB_Replace(faultpage, PTE_PADDR(faultentry));
+	coremap_page_referenced(PTE_PADDR(faultentry), faultpage);
 
-	if( !is_writeable(faultentry->permissions) ) {
-		faultentry->swap_state = PTE_CLEAN;
+	/* shared pages stay read only, a write to them is a copy on write fault */
+	if( !is_writeable(PTE_PERMS(faultentry)) || pt_isshared(as->as_pagetable, faultpage) ) {
+		PTE_SET_STATE(faultentry, PTE_CLEAN);
 		TLB_WriteDirty(idx, 0);
 		TLB_WriteValid(idx, 1);
 	}
 	else {
-		faultentry->swap_state = PTE_DIRTY;
+		PTE_SET_STATE(faultentry, PTE_DIRTY);
 		TLB_WriteDirty(idx, 1);
 		TLB_WriteValid(idx, 1);
 	}
@@ -574,197 +649,473 @@ int vm_swapfault(struct addrspace *as, struct pte *faultentry, vaddr_t faultaddr
 
 /* 
  * handle writes to shared pages. Implements COW.
- * What this does is it creates a new pte and copies the contents of the old pte into this one.
- * This new PTE is then inserted into the current page table. The share counter of the previous
- * pte is then decremented. The current pte will have a counter of 0.
+ * What this does is it turns our page table slot back into a private pte and copies the contents of 
+ * the old, shared pte into it. The share counter of the previous pte is then decremented. The current 
+ * pte will have a counter of 0.
  */
 int vm_copyonwritefault(struct addrspace *as, struct pte *old_faultentry, vaddr_t faultaddress) 
 {
-	assert(lock_do_i_hold(swap_lock));
+	assert(lock_do_i_hold(as->as_lock));
 
 	int idx, err;
 	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
 
-	/* Set up the new entry */
-	struct pte *new_faultentry = pte_init();
-	if(new_faultentry == NULL) {
-		return ENOMEM;
-	}
-	new_faultentry->ppageaddr = 0;
-	new_faultentry->permissions = old_faultentry->permissions;
-	new_faultentry->num_sharers = 0;
-	new_faultentry->swap_location = 0;
-	new_faultentry->swap_state = PTE_NONE;
+	/* 
+	 * Our slot becomes private. It keeps its share of the old entry until the copy is done, so put the
+	 * old entry back if we fail. The levels of the page table above the slot exist, so neither
+	 * pt_alloc() nor pt_add_shared() can fail here.
+	 */
+	pt_remove(as->as_pagetable, faultpage);
+	struct pte *new_faultentry = pt_alloc(as->as_pagetable, faultpage);
+	assert(new_faultentry != NULL);
+	PTE_SET_PERMS(new_faultentry, PTE_PERMS(old_faultentry));
 
-	/* Get a physical page for the new entry. */
-	alloc_upage(new_faultentry);
-	if(new_faultentry->ppageaddr == 0) {
-		pte_destroy(new_faultentry);
-		return ENOMEM;
+	/* Get a physical page for the new entry. The first write to the zero page wants a zeroed one */
+	if(old_faultentry == &vm_zeropte.ps_pte) {
+		PTE_SET_PADDR(new_faultentry, alloc_uzeroframe(new_faultentry));
+	}
+	else {
+		alloc_upage(new_faultentry);
+	}
+	if(PTE_PADDR(new_faultentry) == 0) {
+		err = ENOMEM;
+		goto cow_failed;
 	}
 	
-	/* Now copy the contents from old_entry to new_entry */
-	if(old_faultentry->swap_state == PTE_SWAPPED) {
+	/* 
+	 * Now copy the contents from old_entry to new_entry. We may have slept for the page, so the old entry
+	 * could have been evicted, or be on its way in for another sharer, meanwhile. Its swap slot stays put
+	 * as long as we share it.
+	 */
+	if(old_faultentry == &vm_zeropte.ps_pte) {
+		/* first write to a page that was only read so far, alloc_uzeroframe() already cleared it */
+	}
+	else if(PTE_STATE(old_faultentry) == PTE_NONE) {
+		/* a file page that was dropped while we slept. vm_fault reads it back in and tries again */
+		free_ppages(PTE_PADDR(new_faultentry));
+		err = EAGAIN;
+		goto cow_failed;
+	}
+	else if(PTE_STATE(old_faultentry) == PTE_SWAPPED) {
 		/* swap read the old entry in the new entry */
-		err = swap_read(old_faultentry->swap_location, new_faultentry->ppageaddr);
+		err = swap_read(old_faultentry->swap_location, PTE_PADDR(new_faultentry));
 		if(err) {
-			pte_destroy(new_faultentry);
-			return err;
+			free_ppages(PTE_PADDR(new_faultentry));
+			goto cow_failed;
 		}
 	}
 	else {
 		/* use memmove to copy */
-		memmove((void *)PADDR_TO_KVADDR(new_faultentry->ppageaddr),
-				(const void *)PADDR_TO_KVADDR(old_faultentry->ppageaddr), 
+		memmove((void *)PADDR_TO_KVADDR(PTE_PADDR(new_faultentry)),
+				(const void *)PADDR_TO_KVADDR(PTE_PADDR(old_faultentry)), 
 				PAGE_SIZE);
 	}
 
 	/* Update the new faultentry */
-	new_faultentry->swap_state = PTE_PRESENT;
+	PTE_SET_STATE(new_faultentry, PTE_PRESENT);
 	new_faultentry->swap_location = 0;
+	coremap_busy_unmark(PTE_PADDR(new_faultentry));
 
-	/* Update the old faultentry */
-	old_faultentry->num_sharers -= 1; /* now one less sharer */
+	/* 
+	 * Replace the outdated TLB entry with the proper mapping. TLB_Replace reuses the entry for faultpage
+	 * in our ASID, the other sharers keep their (readonly) mappings of the old page.
+	 */
+	idx = TLB_Replace(faultpage, PTE_PADDR(new_faultentry));
+	TLB_WriteDirty(idx, 1);
+	TLB_WriteValid(idx, 1);
+
+	coremap_page_referenced(PTE_PADDR(new_faultentry), faultpage);
+
+	/* 
+	 * Give up our share of the old entry. The other sharers may have broken their shares while we slept,
+	 * in which case we were the last one and this frees it. This may sleep, so it comes after the TLB.
+	 */
+	free_upage(old_faultentry);
+
+	return 0;
 
-	/* finally update the current page table, to swap out the old entry with the new one */
+cow_failed:
 	pt_remove(as->as_pagetable, faultpage);
-	err = pt_add(as->as_pagetable, faultpage, new_faultentry);
-	if(err) {
-		pte_destroy(new_faultentry);
-		return err;
+	pt_add_shared(as->as_pagetable, faultpage, old_faultentry);
+	return err;
+}
+
+
+/*
+ * vm_setfilepage()
+ * Pages of shared mappings remember where they belong in the file, so the swap code can write them
+ * back. Private file pages are never written back, they don't need to know.
+ */
+static void vm_setfilepage(struct vm_region *region, paddr_t paddr, vaddr_t vpage)
+{
+	vaddr_t fileend = region->vr_filestart + region->vr_filesize;
+	size_t len = 0;
+
+	if(!(region->vr_flags & VR_SHARED)) {
+		return;
 	}
 
-	/* shoot down outdated TLB entry and replace with the proper mapping */
-	// idx = TLB_FindEntry(old_faultentry->ppageaddr);
-	// if(idx >= 0) {
-	// 	TLB_Invalidate(idx);
-	// }
+	/* shared mappings start at their file */
+	assert(vpage >= region->vr_filestart);
+	if(vpage < fileend) {
+		len = (fileend - vpage < PAGE_SIZE) ? fileend - vpage : PAGE_SIZE;
+	}
+	coremap_set_file(paddr, region->vr_file, region->vr_fileoff + (vpage - region->vr_filestart), len);
+}
 
-	TLB_Flush();
+/*
+ * vm_cacheable()
+ * Pages of read only program segments that lie entirely within the file hold the same bytes for
+ * everybody who runs the program, so they go through the page cache. Returns 1 and the file offset
+ * of the page if vpage is one of them.
+ *
+ * Mappings of other files are never cached. Nothing updates a cached page when a shared mapping
+ * writes its file, so cached copies of data files would go stale.
+ */
+static int vm_cacheable(struct vm_region *region, vaddr_t vpage, off_t *offset)
+{
+	if(!PAGE_CACHE_ENABLE || !(region->vr_flags & VR_IMAGE) || is_writeable(region->vr_perms)) {
+		return 0;
+	}
+	if(vpage < region->vr_filestart || vpage + PAGE_SIZE > region->vr_filestart + region->vr_filesize) {
+		return 0;
+	}
+	*offset = region->vr_fileoff + (vpage - region->vr_filestart);
+	return 1;
+}
 
-	idx = TLB_Replace(faultpage, new_faultentry->ppageaddr);
-	TLB_WriteDirty(idx, 1);
-	TLB_WriteValid(idx, 1);
+/*
+ * vm_lodmapcached()
+ * Map the cached copy of vpage, if there is one. Returns 1 if it did.
+ */
+static int vm_lodmapcached(struct addrspace *as, struct vm_region *region, vaddr_t vpage)
+{
+	off_t offset;
+	struct pte *cached;
 
-	if(LRU_CLOCK) {
-		coremap_lruclock_update(new_faultentry->ppageaddr);
+	if(!vm_cacheable(region, vpage, &offset)) {
+		return 0;
 	}
+	cached = pagecache_lookup(region->vr_file, offset);
+	if(cached == NULL || pt_add_shared(as->as_pagetable, vpage, cached)) {
+		return 0;
+	}
+	pte_addsharer(cached);
+	vmstat.vs_pchits++;
+	return 1;
+}
 
-	return 0;
+/*
+ * vm_lodentry()
+ * The entry a page is loaded into. Pages that may be cached get a shared entry of their own right
+ * away, everything else a page table slot. vm_lodentry_free() undoes it.
+ */
+static struct pte *vm_lodentry(struct addrspace *as, struct vm_region *region, vaddr_t vpage)
+{
+	off_t offset;
+	struct pte *entry;
+
+	if(!vm_cacheable(region, vpage, &offset)) {
+		return pt_alloc(as->as_pagetable, vpage);
+	}
+
+	entry = pagecache_entry_create();
+	if(entry == NULL) {
+		return NULL;
+	}
+	if(pt_add_shared(as->as_pagetable, vpage, entry)) {
+		pte_destroy(entry);
+		return NULL;
+	}
+	return entry;
 }
 
+static void vm_lodentry_free(struct addrspace *as, vaddr_t vpage, struct pte *entry)
+{
+	pt_remove(as->as_pagetable, vpage);
+	if(entry->pte_word & PTE_OUTOFLINE) {
+		pte_destroy(entry);
+	}
+}
 
 /* 
- * Handle faults for load on demand. These are pagefaults that fall within a valid code/data region 
+ * Handle faults for load on demand. This is the fault handler of file backed regions, such as the
+ * code and data segments of the executable, and mmap()ed files.
+ * 
+ * The pages loaded are file pages (PTE_FILE), clean until they are written. See pagetable.h.
+ * Read only pages go through the page cache, see pagecache.h. If another process already loaded
+ * the page we map its copy, and vm_fault picks it up on the retry.
+ * 
+ * Fault-around: instead of loading only the faulting page, we load the window of FAULTAROUND_PAGES
+ * pages around it (aligned within the region) with one read of the ELF file into faultaround_buf.
+ * Every page in the window that isn't loaded yet gets a frame and a page table entry, but only the
+ * faulting page goes into the TLB. The extra pages only use frames that are free anyway, we never
+ * evict to make room for them.
  */
-int vm_lodfault(struct addrspace *as, vaddr_t faultaddress, int faulttype)
+int vm_lodfault(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype)
 {
-	int idx, result;
+	int idx, result, i;
+	int npages;
+	off_t offset;
 	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
-	off_t p_offset;
-
-	/* Check whether we are working with as_code or as_data segment */
-	int is_code_seg = is_vaddrcode(as, faultpage);
-	int is_data_seg = is_vaddrdata(as, faultpage);
+	vaddr_t winstart, winend, vpage, bssstart;
+	struct pte *entries[FAULTAROUND_PAGES];
 
-	/* Sanity check - the only two other possibilities I see, since we already checked for validity, 
-	 * is that the vaddr is in the heap or somewhere else on the stack
-	 */
-	if(!is_code_seg && !is_data_seg){
+	/* Without load on demand, all pages were loaded up front */
+	if(!LOAD_ON_DEMAND_ENABLE || region->vr_file == NULL) {
 		return EFAULT;
 	}
-	if(is_code_seg && faulttype == VM_FAULT_WRITE) {
-		return EFAULT;
+
+	/* Pages of the segment past the end of the file are all bss. Shared ones can't be the zero page */
+	bssstart = region->vr_filestart + region->vr_filesize;
+	if(ZERO_PAGE_ENABLE && faulttype == VM_FAULT_READ && !(region->vr_flags & VR_SHARED) &&
+		is_writeable(region->vr_perms) && faultpage >= bssstart) {
+		return vm_zerofault(as, faultaddress);
+	}
+
+	/* Figure out the window, clipped to the region */
+	winstart = faultpage;
+	winend = faultpage + PAGE_SIZE;
+	if(FAULTAROUND_ENABLE) {
+		winstart = faultpage & ~(vaddr_t)(FAULTAROUND_PAGES*PAGE_SIZE - 1);
+		if(winstart < region->vr_start) {
+			winstart = region->vr_start;
+		}
+		winend = winstart + FAULTAROUND_PAGES*PAGE_SIZE;
+		if(winend > region->vr_end) {
+			winend = region->vr_end;
+		}
+	}
+	npages = (winend - winstart) >> PAGE_OFFSET;
+	assert(npages > 0 && npages <= FAULTAROUND_PAGES);
+
+	if(vm_lodmapcached(as, region, faultpage)) {
+		return EAGAIN;
 	}
 
+	/* Give the faulting page a frame first, this is the only one we may evict for */
 	struct pte *new_entry;
-	new_entry = pte_init();
+	new_entry = vm_lodentry(as, region, faultpage);
 	if(new_entry == NULL){
 		return ENOMEM;
 	}
 
-	/* Allocate space for it in physical memory to store it */
-	alloc_upage(new_entry);
-	if(new_entry->ppageaddr == 0) {
-		pte_destroy(new_entry);
+	/* A page that is all bss needs nothing from the file */
+	if(faultpage >= bssstart) {
+		PTE_SET_PADDR(new_entry, alloc_uzeroframe(new_entry));
+	}
+	else {
+		alloc_upage(new_entry);
+	}
+	if(PTE_PADDR(new_entry) == 0) {
+		vm_lodentry_free(as, faultpage, new_entry);
 		return ENOMEM;
 	}
-	new_entry->permissions = set_permissions(1, 1, 1); /* RWX */
-	new_entry->swap_state = PTE_PRESENT;
-	new_entry->swap_location = 0;
 
-	/* add entry to page table */
-	pt_add(as->as_pagetable, faultpage, new_entry);	//faultpage or faultaddress??
+	/* Now the neighbours that aren't loaded yet, as long as memory is plentiful */
+	for(i=0; i<npages; i++) {
+		vpage = winstart + i*PAGE_SIZE;
+		entries[i] = NULL;
 
-	/* Set as writable in order for us to load the page */
-	idx = TLB_Replace(faultpage, new_entry->ppageaddr);
-	TLB_WriteDirty(idx, 1);
-	TLB_WriteValid(idx, 1);
+		if(vpage == faultpage) {
+			entries[i] = new_entry;
+			continue;
+		}
+		if(pt_get(as->as_pagetable, vpage) != NULL) {
+			continue;
+		}
+		if(vpage >= bssstart) {
+			continue;	/* all bss, may never be written. Leave it to its own fault */
+		}
+		if(vm_lodmapcached(as, region, vpage)) {
+			continue;	/* costs neither memory nor I/O */
+		}
+		if(coremap_freecount() <= PAGEOUT_LOW_WATERMARK) {
+			continue;
+		}
 
-	if(LRU_CLOCK) {
-		coremap_lruclock_update(new_entry->ppageaddr);
+		entries[i] = vm_lodentry(as, region, vpage);
+		if(entries[i] == NULL) {
+			continue;
+		}
+		PTE_SET_PADDR(entries[i], get_ppages(1, 0, entries[i]));
+		if(PTE_PADDR(entries[i]) == 0) {
+			vm_lodentry_free(as, vpage, entries[i]);
+			entries[i] = NULL;
+		}
+	}
+	pageout_wakeup();
+
+	/* One read for the whole window */
+	lock_acquire(faultaround_lock);
+	result = load_pages_od(region, winstart, npages, faultaround_buf);
+	if(result) {
+		lock_release(faultaround_lock);
+		for(i=0; i<npages; i++) {
+			if(entries[i] != NULL) {
+				free_ppages(PTE_PADDR(entries[i]));
+				vm_lodentry_free(as, winstart + i*PAGE_SIZE, entries[i]);
+			}
+		}
+		return result;
 	}
 
-	if(is_code_seg){
-		p_offset = faultpage - as->as_code->vbase;
-		result = load_page_od(as->as_code->file, as->as_code->uio, p_offset);
-		if(result){
-			return result;
+	/* Copy the pages out and fill in their entries */
+	for(i=0; i<npages; i++) {
+		if(entries[i] == NULL) {
+			continue;
+		}
+		vpage = winstart + i*PAGE_SIZE;
+
+		if(vpage < bssstart) {
+			memmove((void *)PADDR_TO_KVADDR(PTE_PADDR(entries[i])), faultaround_buf + i*PAGE_SIZE, PAGE_SIZE);
+		}
+		PTE_SET_PERMS(entries[i], region->vr_perms);
+		PTE_SET_STATE(entries[i], PTE_CLEAN);
+		entries[i]->pte_word |= PTE_FILE;
+		entries[i]->swap_location = 0;
+		vm_setfilepage(region, PTE_PADDR(entries[i]), vpage);
+		if(vm_cacheable(region, vpage, &offset)) {
+			/* if somebody beat us to it, the entry simply stays ours */
+			pagecache_insert(region->vr_file, offset, entries[i]);
+		}
+		coremap_busy_unmark(PTE_PADDR(entries[i]));
+
+		if(vpage != faultpage) {
+			vmstat.vs_faultaround++;
 		}
-		new_entry->permissions = as->as_code->permissions;
-		/* Set TLB to read only */
-		TLB_WriteDirty(idx, 0);
 	}
-	else if(is_data_seg){
-		p_offset = faultpage - as->as_data->vbase;
-		result = load_page_od(as->as_data->file, as->as_data->uio, p_offset);
-		if(result){
-			return result;
+	lock_release(faultaround_lock);
+
+	/* 
+	 * Only the faulting page goes into the TLB. It stays read only until it is written, unless this
+	 * is the write. Written private pages are anonymous from now on.
+	 */
+	if(faulttype != VM_FAULT_READ) {
+		if(region->vr_flags & VR_SHARED) {
+			PTE_SET_STATE(new_entry, PTE_DIRTY);
+		}
+		else {
+			new_entry->pte_word &= ~PTE_FILE;
+			PTE_SET_STATE(new_entry, PTE_PRESENT);
 		}
-		new_entry->permissions = as->as_data->permissions;		
 	}
+	idx = TLB_Replace(faultpage, PTE_PADDR(new_entry));
+	TLB_WriteDirty(idx, (faulttype != VM_FAULT_READ) ? 1 : 0);
+	TLB_WriteValid(idx, 1);
+
+	coremap_page_referenced(PTE_PADDR(new_entry), faultpage);
+
 	return 0;	
 }
 
-/* Create and allocate page. This or calls onto stack or heap */
-int vm_allocstackheap(struct addrspace *as, vaddr_t faultaddress) 
+/*
+ * vm_filepagein()
+ * Read a dropped file page back in. Like swap_pagein(), we may sleep for the frame, and if somebody
+ * sharing the entry read it in meanwhile we return EAGAIN so the fault is retried. The page comes
+ * back clean, vm_fault maps it on the retry.
+ */
+int vm_filepagein(struct addrspace *as, struct vm_region *region, struct pte *entry, vaddr_t faultpage)
 {
+	assert(lock_do_i_hold(as->as_lock));
+	assert(region->vr_pager == &vm_filepager);
+
+	int result;
+	paddr_t paddr;
+
+	paddr = alloc_uframe(entry);
+	if(paddr == 0) {
+		return ENOMEM;
+	}
+	if(PTE_STATE(entry) != PTE_NONE || PTE_PADDR(entry) != 0) {
+		free_ppages(paddr);
+		return EAGAIN;
+	}
+	PTE_SET_PADDR(entry, paddr);
+
+	result = load_pages_od(region, faultpage, 1, (char *)PADDR_TO_KVADDR(paddr));
+	if(result) {
+		PTE_SET_PADDR(entry, 0);
+		free_ppages(paddr);
+		return result;
+	}
+
+	vm_setfilepage(region, paddr, faultpage);
+	PTE_SET_STATE(entry, PTE_CLEAN);
+	coremap_busy_unmark(paddr);
+	vmstat.vs_filereads++;
+
+	return 0;
+}
+
+/* 
+ * Handle faults for anonymous regions, the heap and the stack. Nothing was ever written to the page,
+ * so a read maps the zero page, and a write gets a new zeroed page.
+ */
+int vm_anonfault(struct addrspace *as, struct vm_region *region, vaddr_t faultaddress, int faulttype)
+{
+	assert(lock_do_i_hold(as->as_lock));
+
 	int idx;
-	int err;
 	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
 
-	struct pte *new_entry = pte_init();
-	if(new_entry == NULL) {
-		return ENOMEM;
+	if(ZERO_PAGE_ENABLE && faulttype == VM_FAULT_READ) {
+		return vm_zerofault(as, faultaddress);
 	}
 
-	/* Give a physical page */
-	alloc_upage(new_entry);
-	if(new_entry->ppageaddr == 0) {
-		pte_destroy(new_entry);
+	struct pte *new_entry = pt_alloc(as->as_pagetable, faultpage);
+	if(new_entry == NULL) {
 		return ENOMEM;
 	}
 
-	err = pt_add(as->as_pagetable, faultpage, new_entry);
-	if(err) {
-		pte_destroy(new_entry);
+	/* Give a physical page, anonymous memory starts out zeroed */
+	PTE_SET_PADDR(new_entry, alloc_uzeroframe(new_entry));
+	if(PTE_PADDR(new_entry) == 0) {
+		pt_remove(as->as_pagetable, faultpage);
 		return ENOMEM;
 	}
 
-	/* entry->ppageaddr is updated by alloc_upage */
-	new_entry->permissions = set_permissions(1, 1, 0);
-	new_entry->swap_state = PTE_PRESENT;
+	/* the frame is filled in by alloc_upage */
+	PTE_SET_PERMS(new_entry, region->vr_perms);
+	PTE_SET_STATE(new_entry, PTE_PRESENT);
 	new_entry->swap_location = 0;
+	coremap_busy_unmark(PTE_PADDR(new_entry));
 
 	/* Add to the TLB */
-	idx = TLB_Replace(faultpage, new_entry->ppageaddr);
-	TLB_WriteDirty(idx, 1);
+	idx = TLB_Replace(faultpage, PTE_PADDR(new_entry));
+	TLB_WriteDirty(idx, is_writeable(region->vr_perms) ? 1 : 0);
 	TLB_WriteValid(idx, 1);
 
-	if(LRU_CLOCK) {
-		coremap_lruclock_update(new_entry->ppageaddr);
-	}
+	coremap_page_referenced(PTE_PADDR(new_entry), faultpage);
 	
 	return 0;
 }
 
+
+/* 
+ * Map the zero page read only at faultaddress. Used for reads of heap, stack and bss pages that
+ * have never been written.
+ */
+int vm_zerofault(struct addrspace *as, vaddr_t faultaddress)
+{
+	assert(lock_do_i_hold(as->as_lock));
+
+	int idx;
+	int err;
+	vaddr_t faultpage = (faultaddress & PAGE_FRAME);
+
+	err = pt_add_shared(as->as_pagetable, faultpage, &vm_zeropte.ps_pte);
+	if(err) {
+		return ENOMEM;
+	}
+	pte_addsharer(&vm_zeropte.ps_pte);
+
+	/* Read only, a write is a copy on write fault */
+	idx = TLB_Replace(faultpage, PTE_PADDR(&vm_zeropte.ps_pte));
+	TLB_WriteDirty(idx, 0);
+	TLB_WriteValid(idx, 1);
+
+	vmstat.vs_zerofaults++;
+
+	return 0;
+}
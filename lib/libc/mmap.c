@@ -0,0 +1,19 @@
+#include <unistd.h>
+
+/*
+ * OS/161 C function: map a file into memory.
+ * Like the usual mmap, except that there are no file descriptors
+ * in OS/161, so the file is given by its path instead. The address
+ * is only a hint, and it is ignored: the kernel always picks the
+ * address. Uses the system call __mmap, which takes the PROT_ and
+ * MAP_ bits in one argument.
+ *
+ * Returns the address of the mapping, or MAP_FAILED with errno set.
+ */
+
+void *
+mmap(void *addr, size_t len, int prot, int flags, const char *path, off_t offset)
+{
+	(void)addr;
+	return __mmap(path, offset, len, prot | flags);
+}
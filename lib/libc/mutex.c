@@ -0,0 +1,146 @@
+#include <unistd.h>
+#include <mutex.h>
+
+/*
+ * OS/161 C functions: mutexes and condition variables, built on the
+ * futex_wait and futex_wake system calls. See mutex.h.
+ *
+ * The mutex is the three state futex mutex: 0 is unlocked, 1 is
+ * locked, and 2 is locked with processes that may be waiting. Only
+ * an unlock that finds 2 has to call futex_wake. The condition
+ * variable is a sequence number, a waiter sleeps until a signal
+ * changes it.
+ */
+
+/* in mips-atomic.S */
+int __atomic_cas(volatile int *p, int old, int new);
+extern char __ras_start[], __ras_end[];
+
+/* wake everybody */
+#define ALL_WAITERS 0x7fffffff
+
+static int ras_registered;
+
+/*
+ * Compare and swap. The kernel has to know where the atomic sequence
+ * is first, fork keeps it registered and execv starts over with
+ * ras_registered clear.
+ */
+static
+int
+cas(volatile int *p, int old, int new)
+{
+	if (!ras_registered) {
+		__ras(__ras_start, __ras_end);
+		ras_registered = 1;
+	}
+	return __atomic_cas(p, old, new);
+}
+
+/* Add to *p. Returns what *p was */
+static
+int
+fetch_add(volatile int *p, int n)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (cas(p, old, old + n) != old);
+	return old;
+}
+
+/* Set *p to n. Returns what *p was */
+static
+int
+swap(volatile int *p, int n)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (cas(p, old, n) != old);
+	return old;
+}
+
+/* Take the mutex as 2, sleeping while somebody else holds it */
+static
+void
+lock_contended(struct mutex *m, int c)
+{
+	while (c != 0) {
+		futex_wait(&m->m_state, 2);
+		c = swap(&m->m_state, 2);
+	}
+}
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return (cas(&m->m_state, 0, 1) == 0) ? 0 : -1;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	int c;
+
+	c = cas(&m->m_state, 0, 1);
+	if (c == 0) {
+		return;
+	}
+
+	/* Contended. Mark it waited for, we don't know if others wait too */
+	if (c != 2) {
+		c = swap(&m->m_state, 2);
+	}
+	lock_contended(m, c);
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (fetch_add(&m->m_state, -1) != 1) {
+		m->m_state = 0;
+		futex_wake(&m->m_state, 1);
+	}
+}
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	int seq = c->c_seq;
+
+	mutex_unlock(m);
+	/* a signal after the unlock changed c_seq, and we don't sleep */
+	futex_wait(&c->c_seq, seq);
+
+	/* others may have been woken too, take the mutex as 2 */
+	lock_contended(m, swap(&m->m_state, 2));
+}
+
+void
+cond_signal(struct cond *c)
+{
+	fetch_add(&c->c_seq, 1);
+	futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	fetch_add(&c->c_seq, 1);
+	futex_wake(&c->c_seq, ALL_WAITERS);
+}
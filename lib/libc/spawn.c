@@ -0,0 +1,26 @@
+#include <unistd.h>
+
+/*
+ * OS/161 C function: run a program in a new process.
+ * Same as fork() followed by execv() in the child, but the address
+ * space of the caller is never copied. Uses the system call __spawn,
+ * which does all the work. If args is NULL, the program only gets
+ * its own name as argument.
+ *
+ * Returns the pid of the child, or -1 with errno set if the program
+ * could not be started.
+ */
+
+pid_t
+spawn(const char *prog, char *const *args)
+{
+	char *noargs[2];
+
+	if (args == NULL) {
+		noargs[0] = (char *)prog;
+		noargs[1] = NULL;
+		args = noargs;
+	}
+
+	return __spawn(prog, args);
+}
@@ -0,0 +1,336 @@
+/*
+ * mmaptest.c
+ *
+ * Checks what mmap() and munmap() do to the file behind a mapping.
+ *
+ *      private:  writes to a MAP_PRIVATE mapping are seen through the mapping, but never reach
+ *                the file.
+ *      shared:   writes to a MAP_SHARED mapping are in the file after munmap().
+ *      exit:     a child writes to a MAP_SHARED mapping and exits without munmap(). The writes
+ *                are in the file once the child is gone.
+ *      badlen:   munmap() with a length that doesn't cover exactly the mapping fails with EINVAL
+ *                and leaves the mapping alone.
+ *      full:     a page that can't be written back makes munmap() fail and keeps the mapping.
+ *                The test fills the disk, so the page in a hole of the file has nowhere to go,
+ *                then frees the space and munmap()s again.
+ *
+ * The files are created in the current directory and removed at the end.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE   4096
+#define NPAGES      4
+#define FILENAME    "mmaptest.dat"
+#define FILLNAME    "mmaptest.fill"
+#define FILL_MAX    (64*1024*1024)
+
+static char buf[NPAGES*PAGE_SIZE];
+static int failures;
+
+static void
+fail(const char *test, const char *msg)
+{
+        warnx("%s: %s", test, msg);
+        failures++;
+}
+
+/* byte i of the file after a write with seed */
+static char
+pattern(int seed, int i)
+{
+        return (char)(seed + i*7 + i/PAGE_SIZE);
+}
+
+static void
+fillpattern(char *p, int seed)
+{
+        int i;
+
+        for (i = 0; i < NPAGES*PAGE_SIZE; i++) {
+                p[i] = pattern(seed, i);
+        }
+}
+
+/* does p hold the pattern with seed. Returns the first byte that doesn't, or -1 */
+static int
+checkpattern(const char *p, int seed)
+{
+        int i;
+
+        for (i = 0; i < NPAGES*PAGE_SIZE; i++) {
+                if (p[i] != pattern(seed, i)) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+/* make the file hold the pattern with seed */
+static void
+writefile(int seed)
+{
+        int fd;
+
+        fillpattern(buf, seed);
+        fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC);
+        if (fd < 0) {
+                err(1, "%s", FILENAME);
+        }
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+                err(1, "%s: write", FILENAME);
+        }
+        close(fd);
+}
+
+/* read the whole file into buf */
+static void
+readfile(void)
+{
+        int fd;
+
+        fd = open(FILENAME, O_RDONLY);
+        if (fd < 0) {
+                err(1, "%s", FILENAME);
+        }
+        if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+                err(1, "%s: read", FILENAME);
+        }
+        close(fd);
+}
+
+static char *
+mapfile(int flags)
+{
+        char *p;
+
+        p = mmap(NULL, sizeof(buf), PROT_READ|PROT_WRITE, flags, FILENAME, 0);
+        if (p == MAP_FAILED) {
+                err(1, "mmap");
+        }
+        return p;
+}
+
+static void
+unmap(char *p, size_t len)
+{
+        if (munmap(p, len) < 0) {
+                err(1, "munmap");
+        }
+}
+
+static void
+test_private(void)
+{
+        char *p;
+
+        writefile(1);
+        p = mapfile(MAP_PRIVATE);
+        if (checkpattern(p, 1) >= 0) {
+                fail("private", "mapping does not show the file");
+        }
+        fillpattern(p, 2);
+        if (checkpattern(p, 2) >= 0) {
+                fail("private", "mapping lost a write");
+        }
+        unmap(p, sizeof(buf));
+
+        readfile();
+        if (checkpattern(buf, 1) >= 0) {
+                fail("private", "a write reached the file");
+        }
+        else {
+                printf("private: ok\n");
+        }
+}
+
+static void
+test_shared(void)
+{
+        char *p;
+        int bad;
+
+        writefile(3);
+        p = mapfile(MAP_SHARED);
+        fillpattern(p, 4);
+        unmap(p, sizeof(buf));
+
+        readfile();
+        bad = checkpattern(buf, 4);
+        if (bad >= 0) {
+                fail("shared", "file is missing writes after munmap");
+                warnx("shared: first wrong byte at %d", bad);
+        }
+        else {
+                printf("shared: ok\n");
+        }
+}
+
+static void
+test_exit(void)
+{
+        char *p;
+        pid_t pid;
+        int status;
+
+        writefile(5);
+
+        pid = fork();
+        if (pid < 0) {
+                err(1, "fork");
+        }
+        if (pid == 0) {
+                p = mapfile(MAP_SHARED);
+                fillpattern(p, 6);
+                _exit(0);
+        }
+        if (waitpid(pid, &status, 0) < 0) {
+                err(1, "waitpid");
+        }
+        if (status != 0) {
+                fail("exit", "child failed");
+                return;
+        }
+
+        readfile();
+        if (checkpattern(buf, 6) >= 0) {
+                fail("exit", "file is missing writes after exit");
+        }
+        else {
+                printf("exit: ok\n");
+        }
+}
+
+/* munmap with the wrong length has to fail with EINVAL */
+static void
+badlen(char *p, size_t len, const char *what)
+{
+        if (munmap(p, len) == 0) {
+                fail("badlen", what);
+                errx(1, "badlen: the mapping is gone, can't go on");
+        }
+        if (errno != EINVAL) {
+                warn("badlen: %s", what);
+                fail("badlen", "wrong error");
+        }
+}
+
+static void
+test_badlen(void)
+{
+        char *p;
+
+        writefile(7);
+        p = mapfile(MAP_SHARED);
+
+        badlen(p, 0, "munmap of 0 bytes worked");
+        badlen(p, PAGE_SIZE, "munmap of the first page worked");
+        badlen(p, sizeof(buf) + PAGE_SIZE, "munmap past the end worked");
+        badlen(p + PAGE_SIZE, sizeof(buf) - PAGE_SIZE, "munmap of the tail worked");
+
+        /* the mapping is still there and still shared */
+        p[0] = 'x';
+        unmap(p, sizeof(buf) - 1);      /* rounds up to the whole mapping */
+
+        readfile();
+        if (buf[0] != 'x') {
+                fail("badlen", "mapping broken by a failed munmap");
+        }
+        else {
+                printf("badlen: ok\n");
+        }
+}
+
+/* write to the fill file until the disk is full. Returns 0 if it never filled up */
+static int
+filldisk(void)
+{
+        int fd, n, total = 0;
+
+        fd = open(FILLNAME, O_WRONLY|O_CREAT|O_TRUNC);
+        if (fd < 0) {
+                err(1, "%s", FILLNAME);
+        }
+        memset(buf, 'f', sizeof(buf));
+
+        /* big writes first, then top it off a block at a time */
+        for (n = sizeof(buf); n >= 512; n /= 2) {
+                while (total < FILL_MAX && write(fd, buf, n) == n) {
+                        total += n;
+                }
+        }
+        close(fd);
+        return (total < FILL_MAX);
+}
+
+static void
+test_full(void)
+{
+        char *p;
+        int fd;
+
+        /* one byte past the mapping, everything before it is a hole */
+        remove(FILENAME);
+        fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC);
+        if (fd < 0) {
+                err(1, "%s", FILENAME);
+        }
+        if (lseek(fd, sizeof(buf), SEEK_SET) < 0 || write(fd, "e", 1) != 1) {
+                err(1, "%s: write", FILENAME);
+        }
+        close(fd);
+
+        p = mapfile(MAP_SHARED);
+        if (!filldisk()) {
+                remove(FILLNAME);
+                unmap(p, sizeof(buf));
+                printf("full: disk did not fill up, skipped\n");
+                return;
+        }
+
+        p[0] = 'y';
+        if (munmap(p, sizeof(buf)) == 0) {
+                remove(FILLNAME);
+                fail("full", "munmap worked with nowhere to write the page");
+                return;
+        }
+        if (errno != ENOSPC) {
+                warn("full: munmap");
+        }
+        if (p[0] != 'y') {
+                fail("full", "mapping lost its data after the failed munmap");
+        }
+
+        remove(FILLNAME);
+        unmap(p, sizeof(buf));
+
+        readfile();
+        if (buf[0] != 'y') {
+                fail("full", "write lost after the second munmap");
+        }
+        else {
+                printf("full: ok\n");
+        }
+}
+
+int
+main(void)
+{
+        test_private();
+        test_shared();
+        test_exit();
+        test_badlen();
+        test_full();
+
+        remove(FILENAME);
+        if (failures) {
+                errx(1, "%d failures", failures);
+        }
+        printf("mmaptest: passed\n");
+        return 0;
+}
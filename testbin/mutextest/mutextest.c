@@ -0,0 +1,146 @@
+/*
+ * mutextest.c
+ *
+ * Parent and child share a mutex and a condition variable in a shared memory segment.
+ *
+ *      count:   both processes add to a counter under the mutex. The increment is spread out
+ *               over a read, a delay and a write, so a process that loses the processor in the
+ *               middle leaves the other one to wait in futex_wait(). Lost updates show up as a
+ *               wrong total.
+ *      handoff: the processes take turns with the condition variable, so every round one of
+ *               them sleeps in cond_wait() and the other wakes it up. A turn taken out of order
+ *               or a missed wakeup shows up as a wrong count or a hang.
+ *
+ * Both loops spend most of their time in the atomic sequences of mutex.c, so the timer keeps
+ * interrupting them there and the kernel has to restart them.
+ *
+ * usage: mutextest [iterations]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <mutex.h>
+
+#define PAGE_SIZE   4096
+#define ITERATIONS  5000
+#define ROUNDS      500
+#define DELAY       20
+
+struct shared {
+        struct mutex s_lock;
+        struct cond s_turncv;
+        volatile int s_count;           /* protected by s_lock */
+        volatile int s_turn;            /* whose turn it is, 0 parent, 1 child */
+        volatile int s_handoffs;        /* turns taken */
+};
+
+static int iterations = ITERATIONS;
+static struct shared *sh;
+
+static void
+count(void)
+{
+        int i, c;
+        volatile int j;
+
+        for (i = 0; i < iterations; i++) {
+                mutex_lock(&sh->s_lock);
+                c = sh->s_count;
+                /* widen the window for the other process */
+                for (j = 0; j < DELAY; j++);
+                sh->s_count = c + 1;
+                mutex_unlock(&sh->s_lock);
+        }
+}
+
+static void
+handoff(int me)
+{
+        int r;
+
+        for (r = 0; r < ROUNDS; r++) {
+                mutex_lock(&sh->s_lock);
+                while (sh->s_turn != me) {
+                        cond_wait(&sh->s_turncv, &sh->s_lock);
+                }
+                sh->s_handoffs++;
+                sh->s_turn = !me;
+                cond_signal(&sh->s_turncv);
+                mutex_unlock(&sh->s_lock);
+        }
+}
+
+int
+main(int argc, char *argv[])
+{
+        int id, status, bad = 0;
+        pid_t pid;
+
+        if (argc > 1) {
+                iterations = atoi(argv[1]);
+        }
+        if (iterations <= 0) {
+                errx(1, "usage: mutextest [iterations]");
+        }
+
+        id = shmget(IPC_PRIVATE, PAGE_SIZE, IPC_CREAT);
+        if (id < 0) {
+                err(1, "shmget");
+        }
+        sh = shmat(id, NULL, 0);
+        if (sh == (void *)-1) {
+                err(1, "shmat");
+        }
+        memset(sh, 0, sizeof(*sh));
+        mutex_init(&sh->s_lock);
+        cond_init(&sh->s_turncv);
+
+        pid = fork();
+        if (pid < 0) {
+                err(1, "fork");
+        }
+        if (pid == 0) {
+                count();
+                handoff(1);
+                _exit(0);
+        }
+        count();
+        handoff(0);
+
+        if (waitpid(pid, &status, 0) < 0) {
+                err(1, "waitpid");
+        }
+        if (status != 0) {
+                warnx("child exited with %d", status);
+                bad++;
+        }
+
+        if (sh->s_count != 2*iterations) {
+                warnx("count: %d, expected %d", sh->s_count, 2*iterations);
+                bad++;
+        }
+        else {
+                printf("count: %d, ok\n", sh->s_count);
+        }
+        if (sh->s_handoffs != 2*ROUNDS || sh->s_turn != 0) {
+                warnx("handoff: %d turns, expected %d", sh->s_handoffs, 2*ROUNDS);
+                bad++;
+        }
+        else {
+                printf("handoff: %d turns, ok\n", sh->s_handoffs);
+        }
+        if (sh->s_lock.m_state != 0) {
+                warnx("mutex left in state %d", sh->s_lock.m_state);
+                bad++;
+        }
+
+        shmdt(sh);
+        if (bad) {
+                errx(1, "FAILED");
+        }
+        printf("mutextest: passed\n");
+        return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * pagexfer.c
+ *
+ * Throughput of moving buffers between two processes, with pagesend()/pagerecv() against
+ * copying them.
+ *
+ * The parent produces ROUNDS buffers of NPAGES pages and hands each one to its child, which
+ * checks it. Two ways of handing them over are timed:
+ *
+ *      copy:   the parent copies the buffer into a shared memory segment and the child copies it
+ *              out again, the way a pipe copies through a kernel buffer. A one page pagesend()
+ *              tells the child the buffer is ready, so both runs wait for each other the same way.
+ *              The segment holds two buffers used in turn: the parent only gets to fill one again
+ *              once the child asked for the next bell, and so is done copying it out.
+ *      remap:  the parent pagesend()s the buffer itself and the child pagerecv()s it in place.
+ *              Nothing is copied, the parent gets fresh pages when it writes the next buffer.
+ *
+ * usage: pagexfer [rounds] [pages]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#define PAGE_SIZE   4096
+#define ROUNDS      64
+#define NPAGES      16
+
+static int rounds = ROUNDS;
+static int npages = NPAGES;
+
+/* page aligned buffers from the heap */
+static char *src, *dst, *bell;
+static char *seg;
+
+/* the half of the segment used in a round */
+#define SEGBUF(r)   (seg + ((r) % 2)*npages*PAGE_SIZE)
+
+static void *
+pagealloc(int pages)
+{
+        char *brk = sbrk(0);
+        int pad = (PAGE_SIZE - ((unsigned)brk % PAGE_SIZE)) % PAGE_SIZE;
+
+        if (sbrk(pad + pages*PAGE_SIZE) == (void *)-1) {
+                err(1, "sbrk");
+        }
+        return brk + pad;
+}
+
+/* the parent writes every word, like a producer would */
+static void
+produce(char *buf, int round)
+{
+        int i;
+        int *p = (int *)buf;
+
+        for (i = 0; i < npages*PAGE_SIZE/(int)sizeof(int); i++) {
+                p[i] = round ^ i;
+        }
+}
+
+/* the child looks at the first and last word of every page. Returns the pages that are wrong */
+static int
+check(char *buf, int round)
+{
+        int i, bad = 0;
+        int words = PAGE_SIZE/sizeof(int);
+        int *p;
+
+        for (i = 0; i < npages; i++) {
+                p = (int *)(buf + i*PAGE_SIZE);
+                if (p[0] != (round ^ (i*words)) || p[words-1] != (round ^ (i*words + words - 1))) {
+                        bad++;
+                }
+        }
+        return bad;
+}
+
+static void
+child(int remap)
+{
+        int r, bad = 0;
+
+        for (r = 0; r < rounds; r++) {
+                if (remap) {
+                        if (pagerecv(dst, npages*PAGE_SIZE) != npages*PAGE_SIZE) {
+                                err(1, "pagerecv");
+                        }
+                }
+                else {
+                        if (pagerecv(bell, PAGE_SIZE) != PAGE_SIZE) {
+                                err(1, "pagerecv");
+                        }
+                        memcpy(dst, SEGBUF(r), npages*PAGE_SIZE);
+                }
+                bad += check(dst, r);
+        }
+        _exit(bad);
+}
+
+static void
+parent(pid_t pid, int remap)
+{
+        int r;
+
+        for (r = 0; r < rounds; r++) {
+                produce(src, r);
+                if (remap) {
+                        if (pagesend(pid, src, npages*PAGE_SIZE) != npages*PAGE_SIZE) {
+                                err(1, "pagesend");
+                        }
+                }
+                else {
+                        memcpy(SEGBUF(r), src, npages*PAGE_SIZE);
+                        if (pagesend(pid, bell, PAGE_SIZE) != PAGE_SIZE) {
+                                err(1, "pagesend");
+                        }
+                }
+        }
+}
+
+/* microseconds it took to move all buffers */
+static unsigned long
+run(const char *name, int remap)
+{
+        pid_t pid;
+        int status;
+        time_t s0, s1;
+        unsigned long ns0, ns1, us, ms;
+
+        s0 = __time(NULL, &ns0);
+
+        pid = fork();
+        if (pid < 0) {
+                err(1, "fork");
+        }
+        if (pid == 0) {
+                child(remap);
+        }
+        parent(pid, remap);
+        if (waitpid(pid, &status, 0) < 0) {
+                err(1, "waitpid");
+        }
+
+        s1 = __time(NULL, &ns1);
+        us = (s1 - s0)*1000000UL + ns1/1000 - ns0/1000;
+        ms = (us > 1000) ? us/1000 : 1;
+
+        printf("%s: %d rounds of %d pages in %lu.%03lu ms, %lu KB/s, %d bad pages\n",
+               name, rounds, npages, us/1000, us%1000,
+               (unsigned long)rounds*npages*(PAGE_SIZE/1024)*1000/ms, status);
+        return us;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int id;
+        unsigned long copy_us, remap_us;
+
+        if (argc > 1) {
+                rounds = atoi(argv[1]);
+        }
+        if (argc > 2) {
+                npages = atoi(argv[2]);
+        }
+        if (rounds <= 0 || npages <= 0) {
+                errx(1, "usage: pagexfer [rounds] [pages]");
+        }
+
+        src = pagealloc(npages);
+        dst = pagealloc(npages);
+        bell = pagealloc(1);
+
+        id = shmget(IPC_PRIVATE, 2*npages*PAGE_SIZE, IPC_CREAT);
+        if (id < 0) {
+                err(1, "shmget");
+        }
+        seg = shmat(id, NULL, 0);
+        if (seg == (void *)-1) {
+                err(1, "shmat");
+        }
+
+        copy_us = run("copy ", 0);
+        remap_us = run("remap", 1);
+
+        if (remap_us > 0) {
+                printf("remap is %lu.%02lu times as fast as copy\n",
+                       copy_us/remap_us, (copy_us%remap_us)*100/remap_us);
+        }
+
+        shmdt(seg);
+        return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * shmtest.c
+ *
+ * Checks that shared memory segments are shared, and that they go away when they should.
+ *
+ *      share:   parent and child attach a segment by key, each on its own after the fork. The
+ *               child fills it, the parent checks the data and writes back an answer the child
+ *               checks in turn.
+ *      detach:  once both have detached the segment is gone: its id can't be attached again.
+ *      rmid:    shmctl(IPC_RMID) frees a segment that was never attached, and one that is still
+ *               attached once the last process detaches. Its key is free for a new segment
+ *               right away.
+ *      free:    the above over and over. Each round touches two 1 MB segments, so together they
+ *               are many times the size of memory, and there are more of them than can exist at once. Frames or segments that are not
+ *               freed run the system out of memory or of segment ids.
+ *
+ * usage: shmtest [rounds]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE   4096
+#define KEY         0x5348
+#define NPAGES      256         /* 1 MB segments */
+#define ROUNDS      64          /* more than SHM_MAX */
+#define SEGSIZE     (NPAGES*PAGE_SIZE)
+
+static int failures;
+
+static void
+fail(const char *test, const char *msg)
+{
+        warnx("%s: %s", test, msg);
+        failures++;
+}
+
+static int *
+attach(int id)
+{
+        int *p;
+
+        p = shmat(id, NULL, 0);
+        if (p == (void *)-1) {
+                err(1, "shmat");
+        }
+        return p;
+}
+
+/* one word in every page, so every page of the segment gets a frame */
+static void
+fill(int *p, int seed)
+{
+        int i;
+
+        for (i = 0; i < NPAGES; i++) {
+                p[i*PAGE_SIZE/sizeof(int)] = seed + i;
+        }
+}
+
+/* Returns the number of pages that don't hold what fill() put there */
+static int
+check(int *p, int seed)
+{
+        int i, bad = 0;
+
+        for (i = 0; i < NPAGES; i++) {
+                if (p[i*PAGE_SIZE/sizeof(int)] != seed + i) {
+                        bad++;
+                }
+        }
+        return bad;
+}
+
+/* the child fills the segment with seed, the parent answers with seed+1 */
+static void
+child(int seed)
+{
+        int id, bad;
+        volatile int *flag;
+        int *p;
+
+        id = shmget(KEY, SEGSIZE, 0);
+        if (id < 0) {
+                err(1, "child: shmget");
+        }
+        p = attach(id);
+        flag = (volatile int *)(p + NPAGES*PAGE_SIZE/sizeof(int) - 1);
+
+        fill(p, seed);
+        *flag = 1;
+        while (*flag != 2) {
+                /* wait for the parent's answer */
+        }
+        bad = check(p, seed + 1);
+        shmdt(p);
+        _exit(bad);
+}
+
+/* one round of share and detach. Returns 0 if the segment was shared and went away */
+static int
+share(int seed)
+{
+        int id, status, bad = 0;
+        volatile int *flag;
+        int *p;
+        pid_t pid;
+
+        /* nobody attaches before the fork, so the child has to attach on its own */
+        id = shmget(KEY, SEGSIZE, IPC_CREAT|IPC_EXCL);
+        if (id < 0) {
+                err(1, "shmget");
+        }
+        pid = fork();
+        if (pid < 0) {
+                err(1, "fork");
+        }
+        if (pid == 0) {
+                child(seed);
+        }
+        p = attach(id);
+        flag = (volatile int *)(p + NPAGES*PAGE_SIZE/sizeof(int) - 1);
+
+        while (*flag != 1) {
+                /* wait for the child to fill it */
+        }
+        if (check(p, seed) != 0) {
+                fail("share", "parent does not see what the child wrote");
+                bad++;
+        }
+        fill(p, seed + 1);
+        *flag = 2;
+
+        if (waitpid(pid, &status, 0) < 0) {
+                err(1, "waitpid");
+        }
+        if (status != 0) {
+                fail("share", "child does not see what the parent wrote");
+                bad++;
+        }
+
+        shmdt(p);
+        if (shmat(id, NULL, 0) != (void *)-1 || errno != EINVAL) {
+                fail("detach", "segment still there after both detached");
+                bad++;
+        }
+        return bad;
+}
+
+/* Returns 0 if removed segments went away */
+static int
+rmid(int seed)
+{
+        int id, bad = 0;
+        int *p;
+
+        /* never attached */
+        id = shmget(KEY, SEGSIZE, IPC_CREAT|IPC_EXCL);
+        if (id < 0) {
+                err(1, "shmget");
+        }
+        if (shmctl(id, IPC_RMID) < 0) {
+                err(1, "shmctl");
+        }
+        if (shmat(id, NULL, 0) != (void *)-1) {
+                fail("rmid", "unattached segment still there after IPC_RMID");
+                bad++;
+        }
+
+        /* attached, the key is free right away but the pages stay until the detach */
+        id = shmget(KEY, SEGSIZE, IPC_CREAT|IPC_EXCL);
+        if (id < 0) {
+                err(1, "shmget");
+        }
+        p = attach(id);
+        fill(p, seed);
+        if (shmctl(id, IPC_RMID) < 0) {
+                err(1, "shmctl");
+        }
+        if (shmget(KEY, SEGSIZE, 0) >= 0) {
+                fail("rmid", "removed segment can still be looked up");
+                bad++;
+        }
+        if (check(p, seed) != 0) {
+                fail("rmid", "removed segment lost its data while attached");
+                bad++;
+        }
+        shmdt(p);
+        if (shmctl(id, IPC_RMID) == 0) {
+                fail("rmid", "IPC_RMID worked twice");
+                bad++;
+        }
+        return bad;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int r, rounds = ROUNDS;
+
+        if (argc > 1) {
+                rounds = atoi(argv[1]);
+        }
+        if (rounds <= 0) {
+                errx(1, "usage: shmtest [rounds]");
+        }
+
+        for (r = 0; r < rounds; r++) {
+                if (share(r*NPAGES) != 0 || rmid(r*NPAGES) != 0) {
+                        break;
+                }
+        }
+        if (r == rounds) {
+                printf("share, detach, rmid: ok\n");
+                printf("free: %d MB of segments in %d rounds, ok\n", rounds*2*SEGSIZE/(1024*1024), rounds);
+        }
+
+        if (failures) {
+                errx(1, "%d failures after %d rounds", failures, r);
+        }
+        printf("shmtest: passed\n");
+        return 0;
+}
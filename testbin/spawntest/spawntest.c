@@ -0,0 +1,265 @@
+/*
+ * spawntest.c
+ *
+ * Checks spawn() and the __spawn system call. The test spawns itself, and the child checks what
+ * it got and reports through its exit status.
+ *
+ *      args:    argv reaches the child as given, including empty strings. With args NULL the
+ *               child only gets the program name. That child is spawned through a path with
+ *               "/././" in it, which is how it knows it is one.
+ *      status:  waitpid() returns the exit status of the spawned child.
+ *      badpath: a path that does not exist, a directory and a file that is not a program all
+ *               fail in the caller, with no child. They are repeated many times, so an address
+ *               space or a lock left behind by a failed load adds up. A spawn and a fork
+ *               afterwards still have to work.
+ *
+ * usage: spawntest
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define BADROUNDS   200
+#define NOTPROG     "spawntest.txt"
+#define NOARGS      "/././"
+
+/* exit status of a child that got what it should, and of one that didn't */
+#define CHILD_OK    42
+#define CHILD_BAD   1
+
+static const char *childargs[] = { "-child", "", "two words", "three", NULL };
+
+static int failures;
+
+static void
+fail(const char *test, const char *msg)
+{
+        warnx("%s: %s", test, msg);
+        failures++;
+}
+
+/* self with NOARGS in front of the last component, for a child spawned with args NULL */
+static char noargs_path[256];
+
+static void
+make_noargs_path(const char *self)
+{
+        const char *name = strrchr(self, '/');
+        size_t dirlen = (name == NULL) ? 0 : (size_t)(name - self);
+
+        name = (name == NULL) ? self : name + 1;
+        if (dirlen + strlen(NOARGS) + strlen(name) + 1 >= sizeof(noargs_path)) {
+                errx(1, "%s: path too long", self);
+        }
+        if (dirlen == 0) {
+                strcpy(noargs_path, ".");
+        }
+        else {
+                memcpy(noargs_path, self, dirlen);
+                noargs_path[dirlen] = 0;
+        }
+        strcat(noargs_path, NOARGS);
+        strcat(noargs_path, name);
+}
+
+/* was path made by make_noargs_path(): does NOARGS come right before the last component */
+static int
+is_noargs_path(const char *path)
+{
+        const char *name = strrchr(path, '/');
+        int i, len = strlen(NOARGS);
+
+        if (name == NULL || name + 1 - path < len) {
+                return 0;
+        }
+        for (i = 0; i < len; i++) {
+                if (name[1 - len + i] != NOARGS[i]) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* the spawned copy of us. Checks its arguments against what the parent passes */
+static int
+child(int argc, char *argv[])
+{
+        int i;
+
+        if (!strcmp(argv[1], "-exit") && argc == 3) {
+                return atoi(argv[2]);
+        }
+        if (strcmp(argv[1], "-child") != 0 || argc != 5 || argv[argc] != NULL) {
+                return CHILD_BAD;
+        }
+        for (i = 1; i < argc; i++) {
+                if (strcmp(argv[i], childargs[i-1]) != 0) {
+                        return CHILD_BAD;
+                }
+        }
+        return CHILD_OK;
+}
+
+/* spawn and wait. Returns the exit status, or -1 if the spawn failed */
+static int
+runchild(const char *prog, char *const *args)
+{
+        pid_t pid;
+        int status;
+
+        pid = spawn(prog, args);
+        if (pid < 0) {
+                return -1;
+        }
+        if (waitpid(pid, &status, 0) != pid) {
+                err(1, "waitpid");
+        }
+        return status;
+}
+
+static void
+test_args(const char *self)
+{
+        char *args[6];
+        int i, status;
+
+        args[0] = (char *)self;
+        for (i = 0; childargs[i] != NULL; i++) {
+                args[i+1] = (char *)childargs[i];
+        }
+        args[i+1] = NULL;
+
+        status = runchild(self, args);
+        if (status < 0) {
+                warn("spawn %s", self);
+                fail("args", "spawn failed");
+        }
+        else if (status != CHILD_OK) {
+                fail("args", "child got the wrong arguments");
+        }
+        else {
+                printf("args: ok\n");
+        }
+
+        status = runchild(noargs_path, NULL);
+        if (status != CHILD_OK) {
+                fail("args", "child of spawn with args NULL got the wrong arguments");
+        }
+}
+
+static void
+test_status(const char *self)
+{
+        char *args[4];
+        int status;
+
+        args[0] = (char *)self;
+        args[1] = (char *)"-exit";
+        args[2] = (char *)"7";
+        args[3] = NULL;
+
+        status = runchild(self, args);
+        if (status != 7) {
+                fail("status", "waitpid did not return the exit status");
+        }
+        else {
+                printf("status: ok\n");
+        }
+}
+
+/* spawning path has to fail without making a child. Returns 0 if it did */
+static int
+badspawn(const char *path, int expected)
+{
+        pid_t pid;
+        int status;
+
+        pid = spawn(path, NULL);
+        if (pid >= 0) {
+                waitpid(pid, &status, 0);
+                warnx("badpath: spawn %s made process %d", path, pid);
+                return -1;
+        }
+        if (expected != 0 && errno != expected) {
+                warn("badpath: spawn %s", path);
+                return -1;
+        }
+        return 0;
+}
+
+static void
+test_badpath(const char *self)
+{
+        int i, fd, status, bad = 0;
+        pid_t pid;
+
+        fd = open(NOTPROG, O_WRONLY|O_CREAT|O_TRUNC);
+        if (fd < 0) {
+                err(1, "%s", NOTPROG);
+        }
+        if (write(fd, "not a program\n", 14) != 14) {
+                err(1, "%s: write", NOTPROG);
+        }
+        close(fd);
+
+        for (i = 0; i < BADROUNDS && bad == 0; i++) {
+                bad += badspawn("/testbin/no-such-program", ENOENT);
+                bad += badspawn("/testbin", 0);
+                bad += badspawn(NOTPROG, ENOEXEC);
+        }
+        remove(NOTPROG);
+        if (bad) {
+                fail("badpath", "bad spawn did not fail properly");
+                return;
+        }
+
+        /* a lock or an address space left behind would show up here */
+        if (runchild(noargs_path, NULL) != CHILD_OK) {
+                fail("badpath", "spawn after the failures did not work");
+                return;
+        }
+        pid = fork();
+        if (pid < 0) {
+                err(1, "fork");
+        }
+        if (pid == 0) {
+                _exit(CHILD_OK);
+        }
+        if (waitpid(pid, &status, 0) != pid || status != CHILD_OK) {
+                fail("badpath", "fork after the failures did not work");
+                return;
+        }
+        printf("badpath: ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *self;
+
+        if (argc == 0 || argv[0] == NULL) {
+                errx(1, "no program name to spawn");
+        }
+        if (argc > 1) {
+                return child(argc, argv);
+        }
+        if (is_noargs_path(argv[0])) {
+                return CHILD_OK;
+        }
+        self = argv[0];
+        make_noargs_path(self);
+
+        test_args(self);
+        test_status(self);
+        test_badpath(self);
+
+        if (failures) {
+                errx(1, "%d failures", failures);
+        }
+        printf("spawntest: passed\n");
+        return 0;
+}